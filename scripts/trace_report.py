@@ -0,0 +1,113 @@
+#!/usr/bin/env python3
+import argparse
+import struct
+import sys
+
+parser = argparse.ArgumentParser(
+                    prog='trace_report',
+                    description='Per-thread wakeup latency and run queue delay from a /dev/trace dump')
+
+parser.add_argument('filename', help="Dump of /dev/trace, e.g. from cat /dev/trace > dump")
+parser.add_argument('-n', '--top', type=int, default=20, help="Number of threads to show")
+parser.add_argument('-s', '--syscalls', action='store_true', help="Also report time spent in syscalls")
+
+args = parser.parse_args()
+
+# Matches struct TraceRecord in src/kernel/trace.hpp
+RECORD = struct.Struct('<QIHHiIQQ')
+
+SWITCH, WAKEUP, WAIT, WAKE, SYSCALL_ENTER, SYSCALL_EXIT, LOST = range(1, 8)
+
+# Thread::state, and what the idle thread reports instead
+RUNNING = 0
+TRACE_IDLE = (1 << 64) - 1
+
+records = []
+
+with open(args.filename, 'rb') as f:
+    data = f.read()
+
+for off in range(0, len(data) - RECORD.size + 1, RECORD.size):
+    time, seq, type, cpu, tid, arg0, arg1, arg2 = RECORD.unpack_from(data, off)
+    records.append((time, type, cpu, tid, arg0, arg1, arg2))
+
+lost = sum(r[5] for r in records if r[1] == LOST)
+
+# Each CPU's records are in order, sort them all on the TSC-based timestamps
+records = sorted((r for r in records if r[1] != LOST), key=lambda r: r[0])
+
+if not records:
+    sys.exit("no records in " + args.filename)
+
+idle = set()
+runnable = {}  # tid -> (since, woken up)
+wakeup_latency = {}
+runqueue_delay = {}
+switches = {}
+syscall_start = {}
+syscall_time = {}
+
+for time, type, cpu, tid, arg0, arg1, arg2 in records:
+    if type == WAKEUP:
+        runnable.setdefault(arg0, (time, True))
+    elif type == SWITCH:
+        next_tid = arg0
+
+        if arg1 == TRACE_IDLE:
+            idle.add(tid)
+        elif arg1 == RUNNING:
+            # Preempted or yielded, it's back in a run queue. It may also have
+            # been woken up while switching away, then that's when it counts.
+            runnable.setdefault(tid, (time, False))
+
+        switches[next_tid] = switches.get(next_tid, 0) + 1
+
+        if next_tid in runnable:
+            since, woken = runnable.pop(next_tid)
+            runqueue_delay.setdefault(next_tid, []).append(time - since)
+
+            if woken:
+                wakeup_latency.setdefault(next_tid, []).append(time - since)
+    elif type == SYSCALL_ENTER:
+        syscall_start[tid] = (time, arg0)
+    elif type == SYSCALL_EXIT and tid in syscall_start:
+        start, num = syscall_start.pop(tid)
+
+        if num == arg0:
+            syscall_time.setdefault(num, []).append(time - start)
+
+
+def summary(samples):
+    if not samples:
+        return "{:>8} {:>8} {:>8}".format('-', '-', '-')
+
+    samples = sorted(samples)
+    avg = sum(samples) / len(samples)
+    p99 = samples[min(len(samples) - 1, len(samples) * 99 // 100)]
+
+    return "{:>8.1f} {:>8.1f} {:>8.1f}".format(avg / 1000, p99 / 1000, samples[-1] / 1000)
+
+
+span = records[-1][0] - records[0][0]
+
+print("{} records over {:.3f} ms, {} lost".format(len(records), span / 1e6, lost))
+print()
+print("{:>6} {:>8} {:>8} | {:^26} | {:^26}".format('', '', '', 'wakeup latency (us)', 'run queue delay (us)'))
+print("{:>6} {:>8} {:>8} | {:>8} {:>8} {:>8} | {:>8} {:>8} {:>8}".format(
+    'tid', 'switches', 'wakeups', 'avg', 'p99', 'max', 'avg', 'p99', 'max'))
+
+tids = [t for t in switches if t not in idle]
+tids.sort(key=lambda t: max(runqueue_delay.get(t, [0])), reverse=True)
+
+for tid in tids[:args.top]:
+    print("{:>6} {:>8} {:>8} | {} | {}".format(
+        tid, switches[tid], len(wakeup_latency.get(tid, [])),
+        summary(wakeup_latency.get(tid, [])), summary(runqueue_delay.get(tid, []))))
+
+if args.syscalls:
+    print()
+    print("{:>6} {:>8} | {:^26}".format('', '', 'time in syscall (us)'))
+    print("{:>6} {:>8} | {:>8} {:>8} {:>8}".format('nr', 'calls', 'avg', 'p99', 'max'))
+
+    for num in sorted(syscall_time, key=lambda n: sum(syscall_time[n]), reverse=True):
+        print("{:>6} {:>8} | {}".format(num, len(syscall_time[num]), summary(syscall_time[num])))
@@ -117,20 +117,37 @@ void VirtQueue::free_desc(uint16_t desc) {
   num_free++;
 }
 
+// Largest queue we ask the device for
+static constexpr uint16_t QUEUE_MAX_SIZE = 256;
+
 void VirtioDevice::setup_queue(VirtQueue &queue, uint16_t index) {
-  auto paddr = Vm::phys_alloc(true).unwrap();
+  common_cfg->queue_select = index;
+
+  uint16_t size = common_cfg->queue_size;
+
+  if (size > QUEUE_MAX_SIZE)
+    size = QUEUE_MAX_SIZE;
+
+  // The device reads the rings by physical address, each of them has to be
+  // contiguous: keep them together in one physically contiguous allocation
+  auto avail_off = sizeof(VirtQueueDesc) * size;
+  auto used_off = ALIGN_UP(avail_off + sizeof(VirtQueueAvail) +
+                               sizeof(queue.avail->ring[0]) * size,
+                           4);
+  auto total = used_off + sizeof(VirtQueueUsed) +
+               sizeof(queue.used->ring[0]) * size;
+
+  auto paddr = Vm::phys_alloc_contiguous(DIV_CEIL(total, Hal::PAGE_SIZE),
+                                         Hal::PAGE_SIZE, true)
+                   .unwrap();
   auto addr = Hal::phys_to_virt((uintptr_t)paddr);
 
   queue.num = index;
-  queue.num_max = 128;
+  queue.num_max = size;
 
   queue.desc = (VirtQueueDesc *)addr;
-  auto offset = sizeof(VirtQueueDesc) * 128;
-
-  queue.avail = (VirtQueueAvail *)(addr + offset);
-  offset += sizeof(VirtQueueAvail) + sizeof(queue.avail->ring[0]) * 128;
-
-  queue.used = (VirtQueueUsed *)(addr + offset);
+  queue.avail = (VirtQueueAvail *)(addr + avail_off);
+  queue.used = (VirtQueueUsed *)(addr + used_off);
 
   for (int i = 0; i < queue.num_max; i++) {
     queue.desc[i].next = i + 1;
@@ -138,14 +155,13 @@ void VirtioDevice::setup_queue(VirtQueue &queue, uint16_t index) {
 
   queue.last_free_desc = 0;
 
-  queue.num_free = 128;
+  queue.num_free = size;
 
-  common_cfg->queue_select = index;
   queue.notify_off = common_cfg->queue_notify_off;
   common_cfg->queue_desc = Hal::virt_to_phys((uint64_t)queue.desc);
   common_cfg->queue_avail = Hal::virt_to_phys((uint64_t)queue.avail);
   common_cfg->queue_used = Hal::virt_to_phys((uint64_t)queue.used);
-  common_cfg->queue_size = 128;
+  common_cfg->queue_size = size;
   common_cfg->queue_enable = 1;
 }
 
@@ -7,14 +7,48 @@
 
 namespace Gaia {
 
+constexpr size_t MAX_CPUS = 64;
+constexpr uint32_t CPU_MAGIC = 0xCAFEBABE;
+
+/// Values of Cpu::idle_poll
+enum : uint32_t {
+  IDLE_AWAKE,
+  IDLE_POLLING, ///< The idle thread waits for the word to be written to
+  IDLE_KICKED,  ///< Written by a CPU kicking it instead of sending an IPI
+};
+
 struct Cpu {
-  Hal::CpuData data;
-  uint32_t magic = 0xCAFEBABE;
-  uint64_t ms;
+  Hal::CpuData data; // Must come first
+  uint32_t magic = CPU_MAGIC;
+  size_t id;
   Thread *current_thread, *idle_thread, *previous_thread;
-  Spinlock timer_lock;
+
+  // Whether the frame of the current thread has to be saved on the next tick,
+  // false until the first thread was switched to
+  bool restore_frame = false;
+
+  // Set when the current thread should give up the CPU on the next tick, even
+  // if its slice isn't over
+  bool need_resched = false;
+
+  // Set when no tick is armed for the current thread's slice, because it runs
+  // alone or the CPU is idle. The CPU has to be kicked when a thread is queued.
+  bool tick_stopped = false;
+
+  // Watched by the idle thread with Hal::idle_wait, see sched_kick_cpu
+  uint32_t idle_poll = IDLE_AWAKE;
+
+  // Idle state the CPU is in plus one, 0 when it's running something
+  size_t idle_depth = 0;
+  uint64_t idle_start = 0; // When it went idle, in ns
 };
 
+/// The CPU we're running on, only valid with preemption disabled
 Cpu *cpu_self();
 
+/// Number of CPUs that were brought up
+size_t cpu_count();
+
+Cpu *cpu_get(size_t id);
+
 } // namespace Gaia
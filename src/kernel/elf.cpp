@@ -64,7 +64,7 @@ elf_load(Task &task, Fs::Vnode vnode, Auxval &auxval, uintptr_t base = 0,
                  .unwrap();
 
       for (size_t i = 0; i < page_count; i++) {
-        task.space->fault(addr + i * 0x1000, Vm::Space::WRITE);
+        TRY(task.space->fault(addr + i * 0x1000, Vm::Space::WRITE));
       }
 
       auto prev_pagemap = Hal::Vm::get_current_map();
@@ -107,6 +107,28 @@ elf_load(Task &task, Fs::Vnode vnode, Auxval &auxval, uintptr_t base = 0,
   return Ok(auxval.at_entry);
 }
 
+// Start the first thread of a new image, which owns the context's stack and
+// SIMD area from then on. They are freed here if the thread can't be created.
+static Result<Void, Error> start_user_thread(Task &task, const char *name,
+                                             Hal::CpuContext &ctx) {
+  auto res = ctx.alloc_fpu();
+
+  if (res.is_err()) {
+    sched_free_kernel_stack(ctx.info.syscall_kernel_stack);
+    return Err(res.error().value());
+  }
+
+  auto thread = sched_new_thread(name, &task, ctx, true);
+
+  if (thread.is_err()) {
+    sched_free_kernel_stack(ctx.info.syscall_kernel_stack);
+    Amd64::simd_free_area(ctx.fpu_regs);
+    return Err(thread.error().value());
+  }
+
+  return Ok({});
+}
+
 Result<Void, Error> exec(Task &task, const char *path) {
   auto file = TRY(Fs::vfs_find(path));
   auto auxval = Auxval{};
@@ -116,16 +138,12 @@ Result<Void, Error> exec(Task &task, const char *path) {
       USER_STACK_TOP - USER_STACK_SIZE, USER_STACK_SIZE,
       (Hal::Vm::Prot)((int)Hal::Vm::Prot::READ | Hal::Vm::Prot::WRITE));
 
-  auto kstack =
-      (uintptr_t)Vm::vm_kernel_alloc(KERNEL_STACK_SIZE / Hal::PAGE_SIZE) +
-      KERNEL_STACK_SIZE;
+  auto kstack = TRY(sched_alloc_kernel_stack());
 
   Hal::CpuContext ctx{entry, kstack, static_cast<uintptr_t>(USER_STACK_TOP),
                       true};
 
-  sched_new_thread(path, &task, ctx, true);
-
-  return Ok({});
+  return start_user_thread(task, path, ctx);
 }
 
 // adapted from managarm
@@ -184,7 +202,7 @@ Result<Void, Error> execve(Task &task, const char *path, char const *argv[],
       (Hal::Vm::Prot)((int)Hal::Vm::Prot::READ | Hal::Vm::Prot::WRITE));
 
   // hack
-  if (!task.space->fault(mapped_stack, (Vm::Space::WRITE))) {
+  if (task.space->fault(mapped_stack, (Vm::Space::WRITE)).is_err()) {
     panic("Couldn't preallocate stack");
   }
 
@@ -255,9 +273,7 @@ Result<Void, Error> execve(Task &task, const char *path, char const *argv[],
 
   prev_space.activate();
 
-  auto kstack =
-      (uintptr_t)Vm::vm_kernel_alloc((KERNEL_STACK_SIZE / Hal::PAGE_SIZE)) +
-      KERNEL_STACK_SIZE;
+  auto kstack = TRY(sched_alloc_kernel_stack());
 
   Hal::CpuContext ctx{entry, kstack,
                       static_cast<uintptr_t>(stack_base + offset), true};
@@ -271,9 +287,7 @@ Result<Void, Error> execve(Task &task, const char *path, char const *argv[],
     ctx.regs.rip = ld_auxval.at_entry;
   }
 
-  sched_new_thread(path, &task, ctx, true);
-
-  return Ok({});
+  return start_user_thread(task, path, ctx);
 }
 
 } // namespace Gaia
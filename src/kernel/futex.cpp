@@ -0,0 +1,457 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+#include <hal/hal.hpp>
+#include <kernel/futex.hpp>
+#include <kernel/ipl.hpp>
+#include <kernel/sched.hpp>
+#include <kernel/task.hpp>
+#include <lib/log.hpp>
+#include <linux/futex.h>
+#include <vm/vm.hpp>
+#include <vm/vm_kernel.hpp>
+
+namespace Gaia {
+
+/*
+ * Futexes, waiters are kept in a hash table of buckets keyed by FutexKey.
+ *
+ * A waiter checks the futex's value and queues itself with its bucket locked,
+ * then sleeps with Waitq::await releasing the bucket lock once the thread is
+ * in the waiter's queue. Userspace changes the value before calling wake, and
+ * wake takes the bucket lock, so a wakeup can't fall between the check and
+ * the sleep.
+ *
+ * Wakers take waiters out of the bucket before waking them up, and a waiter
+ * takes its bucket lock again before returning, so wakers never touch a
+ * waiter that went away.
+ *
+ * The value is never read through the user mapping with a bucket lock held,
+ * since that could fault: the page is faulted in first, and the locked check
+ * goes through the direct map, starting over if the page went away meanwhile.
+ */
+
+static constexpr size_t FUTEX_HASH_BITS = 8;
+static constexpr size_t FUTEX_BUCKETS = 1 << FUTEX_HASH_BITS;
+
+struct FutexBucket {
+  Spinlock lock;
+  List<FutexWaiter, &FutexWaiter::link> waiters;
+};
+
+static FutexBucket buckets[FUTEX_BUCKETS];
+
+static FutexBucket &futex_bucket(FutexKey key) {
+  uint64_t hash = ((uintptr_t)key.space ^ key.address) * 0x9e3779b97f4a7c15;
+  return buckets[hash >> (64 - FUTEX_HASH_BITS)];
+}
+
+static Result<FutexKey, Error> futex_key(uint32_t *address, bool shared) {
+  auto addr = (uintptr_t)address;
+
+  if (addr % sizeof(uint32_t))
+    return Err(Error::INVALID_PARAMETERS);
+
+  auto space = sched_curr()->task->space;
+
+  if (!shared)
+    return Ok(FutexKey{space, addr});
+
+  // Not the physical page: KSM and compaction move those around under us
+  uintptr_t offset = 0;
+  auto obj = space->object_at(addr, offset);
+
+  if (!obj)
+    return Err(Error::NOT_FOUND);
+
+  return Ok(FutexKey{*obj, offset});
+}
+
+static Result<Void, Error> fault_word(uint32_t *address) {
+  auto space = sched_curr()->task->space;
+
+  // Kernel memory never faults
+  if (space == Vm::kernel_space)
+    return Ok({});
+
+  return space->fault((uintptr_t)address, Vm::Space::USER);
+}
+
+// Read the futex word through the direct map so that it can't fault, with a
+// bucket lock held. Fails if the page isn't mapped at the moment.
+static frg::optional<uint32_t> peek_word(uint32_t *address) {
+  auto space = sched_curr()->task->space;
+  auto addr = (uintptr_t)address;
+
+  if (space == Vm::kernel_space)
+    return __atomic_load_n(address, __ATOMIC_SEQ_CST);
+
+  auto mapping =
+      space->pagemap->get_mapping(ALIGN_DOWN(addr, Hal::PAGE_SIZE));
+
+  if (mapping.is_err())
+    return frg::null_opt;
+
+  auto word = (uint32_t *)Hal::phys_to_virt(mapping.unwrap().address +
+                                            addr % Hal::PAGE_SIZE);
+
+  return __atomic_load_n(word, __ATOMIC_SEQ_CST);
+}
+
+// Fault the word in and read it without a lock held
+static Result<uint32_t, Error> read_word(uint32_t *address) {
+  while (true) {
+    TRY(fault_word(address));
+
+    if (auto word = peek_word(address))
+      return Ok(*word);
+  }
+}
+
+// The waiter may be requeued to another bucket while we wait for the lock
+static FutexBucket *lock_waiter_bucket(FutexWaiter *waiter) {
+  while (true) {
+    auto bucket = __atomic_load_n(&waiter->bucket, __ATOMIC_ACQUIRE);
+
+    bucket->lock.lock();
+
+    if (bucket == waiter->bucket)
+      return bucket;
+
+    bucket->lock.unlock();
+  }
+}
+
+// NOTE: the bucket lock must be held
+static void wake_waiter(FutexBucket &bucket, FutexWaiter *waiter) {
+  bucket.waiters.remove(waiter);
+  waiter->queued = false;
+
+  // Nobody is left in the queue if the wait just timed out
+  waiter->wq.wake(-1).unwrap();
+}
+
+Result<Void, Error> futex_wait(uint32_t *address, uint32_t value,
+                               uint32_t bitset, uint64_t timeout,
+                               bool shared) {
+  if (!bitset)
+    return Err(Error::INVALID_PARAMETERS);
+
+  auto key = TRY(futex_key(address, shared));
+  auto &bucket = futex_bucket(key);
+  auto thread = sched_curr();
+
+  FutexWaiter waiter;
+  waiter.key = key;
+  waiter.bitset = bitset;
+  waiter.bucket = &bucket;
+  waiter.queued = true;
+
+  auto ipl = iplx(Ipl::HIGH);
+  frg::optional<uint32_t> word;
+
+  // Checked once without the lock, where the page can be faulted in, and
+  // again with it, which is what wakers serialise against
+  while (true) {
+    auto res = read_word(address);
+
+    if (res.is_err()) {
+      iplx(ipl);
+      return Err(res.error().value());
+    }
+
+    if (res.unwrap() != value) {
+      iplx(ipl);
+      return Err(Error::WOULD_BLOCK);
+    }
+
+    bucket.lock.lock();
+
+    if ((word = peek_word(address)))
+      break;
+
+    // Paged out or moved in between
+    bucket.lock.unlock();
+  }
+
+  if (*word != value) {
+    bucket.lock.unlock();
+    iplx(ipl);
+    return Err(Error::WOULD_BLOCK);
+  }
+
+  bucket.waiters.insert_tail(&waiter);
+  thread->futex_waiter = &waiter;
+
+  auto res = waiter.wq.await(timeout, &bucket.lock);
+
+  auto locked = lock_waiter_bucket(&waiter);
+  bool woken = !waiter.queued;
+
+  // Timed out, unless a waker got to us in the meantime
+  if (!woken)
+    locked->waiters.remove(&waiter);
+
+  thread->futex_waiter = nullptr;
+
+  locked->lock.unlock();
+  iplx(ipl);
+
+  if (woken)
+    return Ok({});
+
+  return Err(res.is_err() ? res.error().value() : Error::UNKNOWN);
+}
+
+Result<size_t, Error> futex_wake(uint32_t *address, size_t count,
+                                 uint32_t bitset, bool shared) {
+  if (!bitset)
+    return Err(Error::INVALID_PARAMETERS);
+
+  auto key = TRY(futex_key(address, shared));
+  auto &bucket = futex_bucket(key);
+  size_t woken = 0;
+
+  auto ipl = iplx(Ipl::HIGH);
+
+  bucket.lock.lock();
+
+  auto waiter = bucket.waiters.head();
+
+  while (waiter && woken < count) {
+    auto next = waiter->link.next;
+
+    if (waiter->key == key && (waiter->bitset & bitset)) {
+      wake_waiter(bucket, waiter);
+      woken++;
+    }
+
+    waiter = next;
+  }
+
+  bucket.lock.unlock();
+  iplx(ipl);
+
+  return Ok(woken);
+}
+
+Result<size_t, Error> futex_requeue(uint32_t *address, size_t count,
+                                    uint32_t *target, size_t requeue_count,
+                                    frg::optional<uint32_t> expected,
+                                    bool shared) {
+  auto key = TRY(futex_key(address, shared));
+  auto target_key = TRY(futex_key(target, shared));
+
+  auto &src = futex_bucket(key);
+  auto &dst = futex_bucket(target_key);
+
+  // Both locks are taken in address order
+  auto &first = &src < &dst ? src : dst;
+  auto &second = &src < &dst ? dst : src;
+
+  auto ipl = iplx(Ipl::HIGH);
+  frg::optional<uint32_t> word;
+
+  // Like futex_wait, the word is only read with the locks held once it was
+  // faulted in
+  while (true) {
+    if (expected) {
+      auto res = read_word(address);
+
+      if (res.is_err()) {
+        iplx(ipl);
+        return Err(res.error().value());
+      }
+    }
+
+    first.lock.lock();
+
+    if (&first != &second)
+      second.lock.lock();
+
+    if (!expected || (word = peek_word(address)))
+      break;
+
+    if (&first != &second)
+      second.lock.unlock();
+
+    first.lock.unlock();
+  }
+
+  size_t woken = 0, requeued = 0;
+  bool mismatch = expected && *word != *expected;
+
+  auto waiter = mismatch ? nullptr : src.waiters.head();
+
+  while (waiter && (woken < count || requeued < requeue_count)) {
+    auto next = waiter->link.next;
+
+    if (!(waiter->key == key)) {
+      waiter = next;
+      continue;
+    }
+
+    if (woken < count) {
+      wake_waiter(src, waiter);
+      woken++;
+    } else if (waiter->key != target_key) {
+      src.waiters.remove(waiter);
+      waiter->key = target_key;
+      __atomic_store_n(&waiter->bucket, &dst, __ATOMIC_RELEASE);
+      dst.waiters.insert_tail(waiter);
+      requeued++;
+    }
+
+    waiter = next;
+  }
+
+  if (&first != &second)
+    second.lock.unlock();
+
+  first.lock.unlock();
+  iplx(ipl);
+
+  if (mismatch)
+    return Err(Error::WOULD_BLOCK);
+
+  return Ok(woken + requeued);
+}
+
+// NOTE: the thread is off its CPU for good, its waiter can't go away
+void futex_abort_wait(Thread *thread) {
+  auto waiter = thread->futex_waiter;
+
+  if (!waiter)
+    return;
+
+  auto bucket = lock_waiter_bucket(waiter);
+
+  if (thread->futex_waiter == waiter && waiter->queued) {
+    bucket->waiters.remove(waiter);
+    waiter->queued = false;
+  }
+
+  bucket->lock.unlock();
+}
+
+#if FUTEX_BENCHMARK
+
+/*
+ * BENCH_THREADS kernel threads take turns holding a lock for BENCH_HOLD_NS,
+ * first with a futex-based mutex then with a spinlock. Threads waiting for
+ * the futex sleep, while the ones waiting for the spinlock burn their CPU: we
+ * count how many times the former went to sleep and the latter spun.
+ */
+
+static constexpr size_t BENCH_THREADS = 4;
+static constexpr size_t BENCH_ITERATIONS = 2000;
+static constexpr uint64_t BENCH_HOLD_NS = 10000;
+
+static uint32_t bench_phase = 0, bench_done = 0;
+static uint32_t bench_mutex = 0, bench_spinlock = 0;
+static uint64_t bench_sleeps = 0, bench_spins = 0;
+
+// Drepper's mutex: 0 is unlocked, 1 locked, 2 locked with waiters
+static void mutex_lock(uint32_t *mutex) {
+  uint32_t c = 0;
+
+  if (__atomic_compare_exchange_n(mutex, &c, 1, false, __ATOMIC_ACQUIRE,
+                                  __ATOMIC_RELAXED))
+    return;
+
+  if (c != 2)
+    c = __atomic_exchange_n(mutex, 2, __ATOMIC_ACQUIRE);
+
+  while (c != 0) {
+    __atomic_add_fetch(&bench_sleeps, 1, __ATOMIC_RELAXED);
+    (void)futex_wait(mutex, 2, FUTEX_BITSET_MATCH_ANY, -1, false);
+    c = __atomic_exchange_n(mutex, 2, __ATOMIC_ACQUIRE);
+  }
+}
+
+static void mutex_unlock(uint32_t *mutex) {
+  if (__atomic_exchange_n(mutex, 0, __ATOMIC_RELEASE) == 2)
+    futex_wake(mutex, 1, FUTEX_BITSET_MATCH_ANY, false).unwrap();
+}
+
+static void spin_lock(uint32_t *lock) {
+  while (__atomic_exchange_n(lock, 1, __ATOMIC_ACQUIRE)) {
+    while (__atomic_load_n(lock, __ATOMIC_RELAXED))
+      __atomic_add_fetch(&bench_spins, 1, __ATOMIC_RELAXED);
+  }
+}
+
+static void spin_unlock(uint32_t *lock) {
+  __atomic_store_n(lock, 0, __ATOMIC_RELEASE);
+}
+
+static void hold() {
+  auto end = Hal::get_monotonic_ns() + BENCH_HOLD_NS;
+
+  while (Hal::get_monotonic_ns() < end)
+    ;
+}
+
+// Sleep until `*word` reaches `value`
+static void wait_for(uint32_t *word, uint32_t value) {
+  uint32_t c;
+
+  while ((c = __atomic_load_n(word, __ATOMIC_ACQUIRE)) != value)
+    (void)futex_wait(word, c, FUTEX_BITSET_MATCH_ANY, -1, false);
+}
+
+static void bench_worker() {
+  for (uint32_t phase = 1; phase <= 2; phase++) {
+    wait_for(&bench_phase, phase);
+
+    for (size_t i = 0; i < BENCH_ITERATIONS; i++) {
+      if (phase == 1) {
+        mutex_lock(&bench_mutex);
+        hold();
+        mutex_unlock(&bench_mutex);
+      } else {
+        spin_lock(&bench_spinlock);
+        hold();
+        spin_unlock(&bench_spinlock);
+      }
+    }
+
+    __atomic_add_fetch(&bench_done, 1, __ATOMIC_RELEASE);
+    futex_wake(&bench_done, 1, FUTEX_BITSET_MATCH_ANY, false).unwrap();
+  }
+
+  sched_suspend_thread(sched_curr());
+}
+
+static void bench_thread() {
+  for (uint32_t phase = 1; phase <= 2; phase++) {
+    auto start = Hal::get_monotonic_ns();
+
+    __atomic_store_n(&bench_phase, phase, __ATOMIC_RELEASE);
+    futex_wake(&bench_phase, -1, FUTEX_BITSET_MATCH_ANY, false).unwrap();
+
+    wait_for(&bench_done, phase * BENCH_THREADS);
+
+    auto elapsed = (Hal::get_monotonic_ns() - start) / 1000;
+
+    if (phase == 1) {
+      log("futex bench: futex mutex took {} us, {} sleeps", elapsed,
+          bench_sleeps);
+    } else {
+      log("futex bench: spinlock took {} us, {} spins", elapsed, bench_spins);
+    }
+  }
+
+  sched_suspend_thread(sched_curr());
+}
+
+Result<Void, Error> futex_benchmark() {
+  for (size_t i = 0; i < BENCH_THREADS; i++)
+    TRY(sched_new_worker_thread("futex bench worker", (uintptr_t)bench_worker));
+
+  TRY(sched_new_worker_thread("futex bench", (uintptr_t)bench_thread));
+
+  return Ok({});
+}
+
+#endif
+
+} // namespace Gaia
@@ -0,0 +1,73 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+#pragma once
+#include <kernel/wait.hpp>
+#include <lib/list.hpp>
+
+// Run a lock contention benchmark at boot, see futex_benchmark
+#define FUTEX_BENCHMARK 0
+
+namespace Gaia {
+
+struct FutexBucket;
+
+/// What a futex is identified by: the space and virtual address of private
+/// futexes, the object and offset in it of shared ones
+struct FutexKey {
+  void *space;
+  uintptr_t address;
+
+  bool operator==(const FutexKey &other) const {
+    return space == other.space && address == other.address;
+  }
+};
+
+/// A thread sleeping on a futex, lives on the thread's stack
+struct FutexWaiter {
+  ListNode<FutexWaiter> link;
+  FutexKey key;
+  uint32_t bitset;
+
+  // Changes when the waiter is requeued, only stable with its lock held
+  FutexBucket *bucket;
+
+  // Cleared by whoever takes the waiter out of its bucket to wake it up
+  bool queued;
+
+  Waitq wq;
+};
+
+/**
+ * @brief Sleep until woken up, if the futex still holds `value`
+ * @param timeout The timeout in nanoseconds, any value lower or equal to 0
+ * means no timeout
+ * @return Error::WOULD_BLOCK if the futex didn't hold `value`,
+ * Error::TIMED_OUT if the timeout expired
+ */
+Result<Void, Error> futex_wait(uint32_t *address, uint32_t value,
+                               uint32_t bitset, uint64_t timeout, bool shared);
+
+/// Wake up to `count` threads waiting on the futex with a bitset matching
+/// `bitset`, returns how many were woken up
+Result<size_t, Error> futex_wake(uint32_t *address, size_t count,
+                                 uint32_t bitset, bool shared);
+
+/**
+ * @brief Wake up to `count` threads waiting on `address`, and move up to
+ * `requeue_count` of the others to `target` without waking them up
+ * @param expected If set, fail with Error::WOULD_BLOCK unless `address` holds
+ * this value
+ * @return The number of threads woken up and requeued
+ */
+Result<size_t, Error> futex_requeue(uint32_t *address, size_t count,
+                                    uint32_t *target, size_t requeue_count,
+                                    frg::optional<uint32_t> expected,
+                                    bool shared);
+
+/// Take a thread that is being killed out of the futex it sleeps on
+void futex_abort_wait(Thread *thread);
+
+#if FUTEX_BENCHMARK
+Result<Void, Error> futex_benchmark();
+#endif
+
+} // namespace Gaia
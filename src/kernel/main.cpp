@@ -8,15 +8,20 @@
 #include <fs/vfs.hpp>
 #include <hal/hal.hpp>
 #include <kernel/elf.hpp>
+#include <kernel/futex.hpp>
 #include <kernel/main.hpp>
 #include <kernel/sched.hpp>
 #include <kernel/timer.hpp>
+#include <kernel/trace.hpp>
 #include <lib/list.hpp>
 #include <linux/fb.h>
 #include <posix/errno.hpp>
 #include <posix/exec.hpp>
 #include <posix/fd.hpp>
+#include <vm/compact.hpp>
+#include <vm/ksm.hpp>
 #include <vm/phys.hpp>
+#include <vm/reclaim.hpp>
 #include <vm/vm.hpp>
 
 using namespace Gaia;
@@ -115,6 +120,20 @@ Result<Void, Error> Gaia::main(Charon charon) {
    */
   TRY(sched_init());
 
+  TRY(Vm::reclaim_init());
+
+#if VM_ENABLE_KSM
+  TRY(Vm::ksm_start(100, 20));
+#endif
+
+#if FUTEX_BENCHMARK
+  TRY(futex_benchmark());
+#endif
+
+#if SCHED_BENCHMARK
+  TRY(sched_benchmark());
+#endif
+
   Hal::init_devices(&pc);
 
   pc.load_drivers();
@@ -129,11 +148,19 @@ Result<Void, Error> Gaia::main(Charon charon) {
 
   Fs::vfs_find_and("/dev/fb0", MAKEDEV(maj, 0), Fs::vfs_create_file).unwrap();
 
+  sched_create_stat_dev();
+  trace_create_dev();
+  Vm::compact_create_dev();
+
+#if VM_ENABLE_KSM
+  Vm::ksm_create_dev();
+#endif
+
   log("Gaia v0.0.1 (git version {}), {} pages are available",
       __GAIA_GIT_VERSION__, Vm::phys_usable_pages());
 
-  auto task =
-      TRY(sched_new_task(sched_allocate_pid(), sched_kernel_task(), true));
+  auto pid = TRY(sched_allocate_pid());
+  auto task = TRY(sched_new_task(pid, sched_kernel_task(), true));
 
   const char *argv[] = {"/usr/bin/init", nullptr};
   const char *envp[] = {"SHELL=/usr/bin/bash", nullptr};
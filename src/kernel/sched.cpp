@@ -6,40 +6,256 @@
 #include "hal/hal.hpp"
 #include "hal/int.hpp"
 #include "kernel/cpu.hpp"
+#include "kernel/ipl.hpp"
 #include "lib/result.hpp"
 #include "posix/fd.hpp"
 #include "vm/phys.hpp"
 #include "vm/vm_kernel.hpp"
 #include <frg/manual_box.hpp>
+#include <kernel/futex.hpp>
+#include <kernel/main.hpp>
 #include <kernel/sched.hpp>
 #include <kernel/task.hpp>
+#include <kernel/timer.hpp>
+#include <kernel/trace.hpp>
 #include <kernel/wait.hpp>
+#include <lib/cmdline.hpp>
+#include <lib/log.hpp>
+#include <linux/futex.h>
 #include <vm/heap.hpp>
+#include <vm/reclaim.hpp>
 #include <vm/vm.hpp>
+#include <vm/vmem.h>
 
 namespace Gaia {
 
-static pid_t current_pid = 0;
+struct VruntimeComp {
+  bool operator()(const Thread *a, const Thread *b) const {
+    return (int64_t)(a->vruntime - b->vruntime) > 0;
+  }
+};
+
+// Per-CPU run queue, indexed by Cpu::id
+struct RunQueue {
+  frg::simple_spinlock lock;
+  frg::pairing_heap<Thread,
+                    frg::locate_member<Thread, frg::pairing_heap_hook<Thread>,
+                                       &Thread::sched_hook>,
+                    VruntimeComp>
+      threads;
+
+  // Real-time threads, one FIFO per priority, always picked before the others
+  List<Thread, &Thread::rt_link> rt_queues[RT_PRIO_MAX + 1];
+  uint64_t rt_bitmap[2]; // Which rt_queues aren't empty
+
+  // Only moves forward, newly woken threads are placed relative to it
+  uint64_t min_vruntime;
+  uint64_t next_balance;
+  SchedStats stats;
+};
 
-static List<Thread, &Thread::link> runq;
-static List<Thread, &Thread::link> to_die;
-static frg::manual_box<frg::simple_spinlock> sched_lock;
-static frg::manual_box<frg::simple_spinlock> reaper_lock;
-static Thread *current_thread = nullptr;
+static RunQueue runqueues[MAX_CPUS];
+static List<Thread, &Thread::death_link> to_die;
+static List<Task, &Task::task_link> tasks;
+Spinlock tasks_lock;
+static Spinlock reaper_lock;
+static Waitq reaper_wq; // The reaper sleeps there while nothing is to be freed
 static Task *kernel_task = nullptr;
-static bool restore_frame = false;
-static Thread *idle_thread = nullptr;
 
-pid_t sched_allocate_pid() { return current_pid++; }
+// Protects the parent, children and zombies of every task
+static Spinlock tree_lock;
+
+// Pids and tids come from the same arena, handed out in a cycle through
+// [1, PID_MAX) so that one isn't reused right after being freed
+static constexpr size_t PID_MAX = 32768;
+static constexpr size_t PID_HASH_SIZE = 1024;
+
+// Protects pid_arena, pid_hash and tid_hash. Taken after tasks_lock and any
+// task's lock, so it's never held while locking a task.
+static Spinlock pid_lock;
+static Vmem pid_arena;
+static List<Task, &Task::pid_link> pid_hash[PID_HASH_SIZE];
+static List<Thread, &Thread::tid_link> tid_hash[PID_HASH_SIZE];
+
+static Cpu *cpus[MAX_CPUS];
+static size_t ncpus = 0;
+
+// CPUs given by isolcpus= on the command line. They are left out of load
+// balancing and only run the threads whose affinity asks for them.
+static uint64_t isolated_cpus = 0;
+
+static constexpr uint64_t NS_PER_MS = 1000000;
+
+// How often a busy CPU looks for a busier one to pull threads from. A CPU
+// running a thread alone still ticks at this rate.
+static constexpr uint64_t BALANCE_INTERVAL = 64 * NS_PER_MS;
+
+// Shortest delay the tick is armed for, so that a deadline that just passed
+// doesn't make us take interrupts in a loop
+static constexpr uint64_t MIN_TICK = 2000;
+
+// How long the reaper waits before looking again at dead threads that are
+// still queued somewhere, they are dropped from the queue when picked
+static constexpr uint64_t REAPER_RETRY = 10 * NS_PER_MS;
+
+// Freed kernel stacks kept around for new threads
+static constexpr size_t KSTACK_CACHE_MAX = 16;
+
+// How many threads pinned to their CPU migrate may look past
+static constexpr size_t MIGRATE_PINNED_MAX = 8;
+
+#if SCHED_BENCHMARK
+// Cleared by the benchmark to time voluntary switches going through the tick
+static bool direct_switch = true;
+#else
+static constexpr bool direct_switch = true;
+#endif
+
+// How far behind min_vruntime a thread that slept may be placed
+static constexpr uint64_t SLEEPER_BONUS = SCHED_LATENCY * NS_PER_MS / 2;
+
+// How much less vruntime a woken thread needs to preempt the current one
+static constexpr uint64_t WAKEUP_GRANULARITY = NS_PER_MS;
+
+static constexpr uint32_t NICE_0_WEIGHT = 1024;
+static constexpr uint32_t IDLE_WEIGHT = 3;
+
+// Same as Linux, each nice level is worth ~10% of CPU time
+static constexpr uint32_t nice_weights[NICE_MAX - NICE_MIN + 1] = {
+    88761, 71755, 56483, 46273, 36291, 29154, 23254, 18705, 14949, 11916,
+    9548,  7620,  6100,  4904,  3906,  3121,  2501,  1991,  1586,  1277,
+    1024,  820,   655,   526,   423,   335,   272,   215,   172,   137,
+    110,   87,    70,    56,    45,    36,    29,    23,    18,    15,
+};
+
+static List<Task, &Task::pid_link> &pid_bucket(pid_t pid) {
+  return pid_hash[(size_t)pid % PID_HASH_SIZE];
+}
+
+static List<Thread, &Thread::tid_link> &tid_bucket(pid_t tid) {
+  return tid_hash[(size_t)tid % PID_HASH_SIZE];
+}
+
+Result<pid_t, Error> sched_allocate_pid() {
+  auto ipl = iplx(Ipl::HIGH);
+  pid_lock.lock();
+
+  auto pid = (pid_t)(uintptr_t)vmem_alloc(&pid_arena, 1,
+                                          VM_NEXTFIT | VM_NOSLEEP);
+
+  pid_lock.unlock();
+  iplx(ipl);
+
+  if (!pid)
+    return Err(Error::FULL);
+
+  return Ok(pid);
+}
+
+void sched_free_pid(pid_t pid) {
+  auto ipl = iplx(Ipl::HIGH);
+  pid_lock.lock();
+
+  vmem_free(&pid_arena, (void *)(uintptr_t)pid, 1);
+
+  pid_lock.unlock();
+  iplx(ipl);
+}
+
+Task *sched_find_task(pid_t pid) {
+  Task *ret = nullptr;
+
+  auto ipl = iplx(Ipl::HIGH);
+  pid_lock.lock();
+
+  for (auto task : pid_bucket(pid)) {
+    if (task->pid == pid) {
+      ret = task;
+      break;
+    }
+  }
+
+  pid_lock.unlock();
+  iplx(ipl);
+
+  return ret;
+}
+
+// tasks_lock keeps a task found in the pid hash from being freed until it's
+// locked: ~Task takes it out of the hash before it takes tasks_lock. A task
+// that hasn't exited can't be reaped after that.
+Task *sched_lock_task(pid_t pid) {
+  tasks_lock.lock();
+
+  auto task = sched_find_task(pid);
+
+  if (task) {
+    task->lock.lock();
+
+    if (task->has_exited) {
+      task->lock.unlock();
+      task = nullptr;
+    }
+  }
+
+  tasks_lock.unlock();
+
+  return task;
+}
+
+// Same as sched_lock_task: a thread is in the tid hash until it's sent to
+// death, which happens before ~Task takes tasks_lock
+Thread *sched_lock_thread(pid_t tid) {
+  Task *task = nullptr;
+
+  tasks_lock.lock();
+  pid_lock.lock();
+
+  for (auto thread : tid_bucket(tid)) {
+    if (thread->tid == tid) {
+      task = thread->task;
+      break;
+    }
+  }
+
+  pid_lock.unlock();
+
+  Thread *ret = nullptr;
+
+  if (task && task != kernel_task) {
+    task->lock.lock();
+
+    // It may have died and its tid been reused since
+    if (!task->has_exited) {
+      for (auto thread : task->threads) {
+        if (thread->tid == tid && thread->state != Thread::EXITED) {
+          ret = thread;
+          break;
+        }
+      }
+    }
+
+    if (!ret)
+      task->lock.unlock();
+  }
+
+  tasks_lock.unlock();
 
-// AAA this sucks so much
-static Cpu *cpu = nullptr;
+  return ret;
+}
+
+void sched_register_cpu(Cpu *cpu) {
+  ASSERT(ncpus < MAX_CPUS);
 
-void sched_register_cpu(Cpu *_cpu) {
-  cpu = _cpu;
-  current_thread = cpu->current_thread;
+  cpu->id = ncpus;
+  cpu->magic = CPU_MAGIC;
+  cpus[ncpus++] = cpu;
 }
 
+size_t cpu_count() { return ncpus; }
+
+Cpu *cpu_get(size_t id) { return id < ncpus ? cpus[id] : nullptr; }
+
 Result<Thread *, Error> sched_new_thread(frg::string_view name, Task *task,
                                          Hal::CpuContext ctx, bool insert) {
 
@@ -57,12 +273,59 @@ Result<Thread *, Error> sched_new_thread(frg::string_view name, Task *task,
   thread->task = task;
   thread->ctx = ctx;
   thread->state = Thread::RUNNING;
-  thread->cpu = cpu;
+  thread->cpu = nullptr;
+  thread->affinity = ~isolated_cpus;
+  thread->cpu_mode = ctx.user ? CpuMode::USER : CpuMode::SYSTEM;
+
+  auto ipl = iplx(Ipl::HIGH);
+
+  task->lock.lock();
+
+  // Being torn down or exec'd, its threads are being stopped
+  if (task->has_exited || task->stopping) {
+    task->lock.unlock();
+    iplx(ipl);
+
+    // The caller still owns the context's stack and FPU area
+    thread->ctx.info.syscall_kernel_stack = 0;
+    thread->ctx.fpu_regs = nullptr;
+    delete thread;
+
+    return Err(Error::NOT_FOUND);
+  }
+
+  // The first thread goes by the task's pid, the others get their own
+  if (task->threads.size()) {
+    auto tid = sched_allocate_pid();
+
+    if (tid.is_err()) {
+      task->lock.unlock();
+      iplx(ipl);
+
+      thread->ctx.info.syscall_kernel_stack = 0;
+      thread->ctx.fpu_regs = nullptr;
+      delete thread;
+
+      return Err(tid.error().value());
+    }
+
+    thread->tid = tid.unwrap();
+    thread->owns_tid = true;
+  } else {
+    thread->tid = task->pid;
+  }
 
   task->threads.push(thread);
 
+  pid_lock.lock();
+  tid_bucket(thread->tid).insert_tail(thread);
+  pid_lock.unlock();
+
+  task->lock.unlock();
+  iplx(ipl);
+
   if (insert) {
-    runq.insert_tail(thread);
+    sched_enqueue_thread(thread);
   }
 
   return Ok(thread);
@@ -74,15 +337,24 @@ Result<Task *, Error> sched_new_task(pid_t pid, Task *parent, bool user) {
 
   auto task = new (Vm::Subsystem::SCHED) Task();
 
+  if (!task)
+    return Err(Error::OUT_OF_MEMORY);
+
   task->cwd = Fs::root_vnode;
   task->pid = pid;
 
   task->parent = parent;
 
-  if (parent)
+  if (parent) {
+    auto ipl = iplx(Ipl::HIGH);
+    tree_lock.lock();
     parent->children.insert_tail(task);
+    tree_lock.unlock();
+    iplx(ipl);
+  }
 
-  if (pid == 0) {
+  // init
+  if (pid == 1) {
     auto fd = new (Vm::Subsystem::FS)
         Posix::Fd(Posix::Fd::open("/dev/tty", O_RDWR).unwrap());
     task->fds.allocate(fd);
@@ -91,152 +363,1851 @@ Result<Task *, Error> sched_new_task(pid_t pid, Task *parent, bool user) {
   }
 
   if (user) {
-    task->space = new (Vm::Subsystem::SCHED) Vm::Space("task space", user);
-    if (!task->space)
-      return Err(Error::OUT_OF_MEMORY);
+    auto space = Vm::Space::create("task space", user);
+
+    if (space.is_err()) {
+      // The caller still owns the pid
+      task->pid = 0;
+      delete task;
+
+      return Err(space.error().value());
+    }
+
+    task->space = space.unwrap();
   } else {
     task->space = Vm::kernel_space;
   }
 
+  // Only findable by pid, or by walking the tasks, once it's complete
+  auto ipl = iplx(Ipl::HIGH);
+
+  tasks_lock.lock();
+  tasks.insert_tail(task);
+  tasks_lock.unlock();
+
+  if (pid > 0) {
+    pid_lock.lock();
+    pid_bucket(pid).insert_tail(task);
+    pid_lock.unlock();
+  }
+
+  iplx(ipl);
+
   return Ok(task);
 }
 
-Thread::~Thread() {
-  Vm::vm_kernel_free(
-      (void *)(ctx.info.syscall_kernel_stack - KERNEL_STACK_SIZE),
-      KERNEL_STACK_SIZE / Hal::PAGE_SIZE);
-  Vm::phys_free((void *)(Hal::virt_to_phys((uintptr_t)ctx.fpu_regs)));
+static void wake_reaper() {
+  auto ipl = iplx(Ipl::HIGH);
+
+  // It sleeps with reaper_lock as the interlock, the wakeup can't be missed
+  reaper_lock.lock();
+  reaper_wq.wake(-1).unwrap();
+  reaper_lock.unlock();
+
+  iplx(ipl);
 }
 
-Task::~Task() {
-  for (auto thread : threads) {
-    sched_send_to_death(thread);
+// A free kernel stack, the link lives at its bottom
+struct FreeStack {
+  FreeStack *next;
+};
+
+static FreeStack *free_stacks = nullptr;
+static size_t nr_free_stacks = 0;
+static Spinlock kstack_lock;
+
+Result<uintptr_t, Error> sched_alloc_kernel_stack() {
+  auto ipl = iplx(Ipl::HIGH);
+
+  kstack_lock.lock();
+
+  auto stack = free_stacks;
+
+  if (stack) {
+    free_stacks = stack->next;
+    nr_free_stacks--;
+  }
+
+  kstack_lock.unlock();
+  iplx(ipl);
+
+  if (!stack)
+    stack = (FreeStack *)Vm::vm_kernel_alloc(KERNEL_STACK_SIZE /
+                                             Hal::PAGE_SIZE);
+
+  if (!stack)
+    return Err(Error::OUT_OF_MEMORY);
+
+  return Ok((uintptr_t)stack + KERNEL_STACK_SIZE);
+}
+
+void sched_free_kernel_stack(uintptr_t top) {
+  auto stack = (FreeStack *)(top - KERNEL_STACK_SIZE);
+  auto ipl = iplx(Ipl::HIGH);
+
+  kstack_lock.lock();
+
+  if (nr_free_stacks < KSTACK_CACHE_MAX) {
+    stack->next = free_stacks;
+    free_stacks = stack;
+    nr_free_stacks++;
+    stack = nullptr;
+  }
+
+  kstack_lock.unlock();
+  iplx(ipl);
+
+  if (stack)
+    Vm::vm_kernel_free(stack, KERNEL_STACK_SIZE / Hal::PAGE_SIZE);
+}
+
+static size_t shrink_kstacks(size_t target) {
+  size_t freed = 0;
+
+  while (freed < target) {
+    kstack_lock.lock();
+
+    auto stack = free_stacks;
+
+    if (stack) {
+      free_stacks = stack->next;
+      nr_free_stacks--;
+    }
+
+    kstack_lock.unlock();
+
+    if (!stack)
+      break;
+
+    Vm::vm_kernel_free(stack, KERNEL_STACK_SIZE / Hal::PAGE_SIZE);
+    freed += KERNEL_STACK_SIZE / Hal::PAGE_SIZE;
   }
 
-  for (auto fd : fds.data()) {
+  return freed;
+}
+
+static Vm::Shrinker kstack_shrinker = {.shrink = shrink_kstacks, .link = {}};
+
+Thread::~Thread() {
+  if (ctx.info.syscall_kernel_stack)
+    sched_free_kernel_stack(ctx.info.syscall_kernel_stack);
+
+  if (ctx.fpu_regs)
+    Amd64::simd_free_area(ctx.fpu_regs);
+
+  if (owns_tid)
+    sched_free_pid(tid);
+}
+
+List<Task, &Task::task_link> &sched_tasks() { return tasks; }
+
+// Close the files and drop the space of a task that exited or never ran
+static void task_release(Task *task) {
+  for (auto fd : task->fds.data()) {
     if (fd) {
       delete fd;
     }
   }
 
-  space->release();
-  delete space;
+  if (task->space) {
+    task->space->release();
+    delete task->space;
+
+    // Its memory is back, see Vm::oom_kill
+    __atomic_store_n(&task->space, nullptr, __ATOMIC_RELEASE);
+  }
 }
 
-static Thread *get_next_thread() {
-  if (!runq.head()) {
-    return idle_thread;
+Task::~Task() {
+  // Otherwise this was done when it exited. Its threads leave the tid hash
+  // before tasks_lock is taken, see sched_lock_thread.
+  if (!has_exited) {
+    for (auto thread : threads) {
+      sched_send_to_death(thread);
+    }
+  }
+
+  // Out of the pid hash before the list of tasks, see sched_lock_task
+  if (pid > 0) {
+    auto ipl = iplx(Ipl::HIGH);
+    pid_lock.lock();
+    pid_bucket(pid).remove(this);
+    pid_lock.unlock();
+    iplx(ipl);
+  }
+
+  auto ipl = iplx(Ipl::HIGH);
+  tasks_lock.lock();
+  tasks.remove(this);
+  tasks_lock.unlock();
+  iplx(ipl);
+
+  // Reaped tasks were already taken out of their parent
+  if (parent) {
+    auto ipl = iplx(Ipl::HIGH);
+    tree_lock.lock();
+    parent->children.remove(this);
+    tree_lock.unlock();
+    iplx(ipl);
   }
 
-  return runq.remove_head().unwrap();
+  // The pid may be handed out again from now on
+  if (pid > 0)
+    sched_free_pid(pid);
+
+  if (!has_exited)
+    task_release(this);
 }
 
-Cpu *cpu_self() { return Hal::get_current_thread()->cpu; }
+Result<Task *, Error> sched_reap_child(Task *parent, pid_t pid, bool nohang) {
+  auto ipl = iplx(Ipl::HIGH);
 
-void sched_tick(Hal::InterruptFrame *frame) {
-  ASSERT(cpu_self()->magic == 0xCAFEBABE);
+  tree_lock.lock();
+
+  while (true) {
+    Task *child = nullptr;
+    bool found;
 
-  sched_lock->lock();
+    if (pid == -1) {
+      child = parent->zombies.head();
+      found = child || parent->children.head();
+    } else {
+      auto task = sched_find_task(pid);
+      found = task && task->parent == parent;
+      child = found && task->zombie ? task : nullptr;
+    }
 
-  if (restore_frame) {
-    current_thread->ctx.save(frame);
-  } else {
-    restore_frame = true;
+    if (child) {
+      parent->zombies.remove(child).unwrap();
+      child->parent = nullptr;
+
+      parent->child_times += child->exited_times;
+      parent->child_times += child->child_times;
+      parent->child_min_faults += child->min_faults + child->child_min_faults;
+      tree_lock.unlock();
+      iplx(ipl);
+      return Ok(child);
+    }
+
+    if (!found) {
+      tree_lock.unlock();
+      iplx(ipl);
+      return Err(Error::NOT_FOUND);
+    }
+
+    if (nohang) {
+      tree_lock.unlock();
+      iplx(ipl);
+      return Ok((Task *)nullptr);
+    }
+
+    // Exiting children wake us up with tree_lock held, so none is missed
+    auto res = parent->wq.await(0, &tree_lock);
+
+    if (res.is_err()) {
+      iplx(ipl);
+      return Err(res.error().value());
+    }
+
+    tree_lock.lock();
   }
+}
+
+static RunQueue &cpu_rq(Cpu *cpu) { return runqueues[cpu->id]; }
+
+static size_t rq_length(Cpu *cpu) {
+  return __atomic_load_n(&cpu_rq(cpu).stats.nr_queued, __ATOMIC_RELAXED);
+}
+
+static uint64_t cpu_bit(Cpu *cpu) { return 1ull << cpu->id; }
+
+static uint64_t online_cpus() {
+  return ncpus == MAX_CPUS ? ~0ull : (1ull << ncpus) - 1;
+}
+
+static bool cpu_allowed(Thread *thread, Cpu *cpu) {
+  return __atomic_load_n(&thread->affinity, __ATOMIC_RELAXED) & cpu_bit(cpu);
+}
+
+static bool cpu_isolated(Cpu *cpu) { return isolated_cpus & cpu_bit(cpu); }
 
-  if (current_thread->state == Thread::RUNNING &&
-      current_thread != idle_thread) {
-    runq.insert_tail(current_thread);
+// Least loaded CPU the thread may run on
+static Cpu *allowed_cpu(Thread *thread) {
+  Cpu *ret = nullptr;
+
+  for (size_t i = 0; i < ncpus; i++) {
+    if (cpu_allowed(thread, cpus[i]) &&
+        (!ret || rq_length(cpus[i]) < rq_length(ret)))
+      ret = cpus[i];
   }
 
-  current_thread = get_next_thread();
-  current_thread->state = Thread::RUNNING;
+  // Its affinity always has an online CPU, see sched_set_affinity
+  return ret ? ret : cpus[0];
+}
+
+// Lock the run queues of two CPUs, in CPU order
+static void lock_rq_pair(Cpu *a, Cpu *b) {
+  auto first = a->id < b->id ? a : b;
+  auto second = a->id < b->id ? b : a;
 
-  sched_lock->unlock();
+  cpu_rq(first).lock.lock();
 
-  Hal::set_current_thread(current_thread);
-  current_thread->task->space->activate();
-  Hal::do_context_switch();
+  if (first != second)
+    cpu_rq(second).lock.lock();
 }
 
-void sched_dequeue_and_die() {
-  sched_dequeue_thread(sched_curr());
-  sched_yield();
-  Hal::halt();
+static void unlock_rq_pair(Cpu *a, Cpu *b) {
+  if (a != b)
+    cpu_rq(b).lock.unlock();
+
+  cpu_rq(a).lock.unlock();
 }
 
-void sched_yield() {
-  Hal::disable_interrupts();
-  Amd64::lapic_send_ipi(32);
-  Hal::enable_interrupts();
+static bool is_rt(Thread *thread) {
+  return thread->policy == SchedPolicy::FIFO ||
+         thread->policy == SchedPolicy::RR;
 }
 
-void sched_suspend_thread(Thread *thread) {
-  thread->state = Thread::SUSPENDED;
-  sched_yield();
+// Highest priority of the queued real-time threads, -1 if there are none
+static int rq_rt_prio(RunQueue &rq) {
+  for (int word = 1; word >= 0; word--) {
+    if (rq.rt_bitmap[word])
+      return word * 64 + 63 - __builtin_clzll(rq.rt_bitmap[word]);
+  }
+
+  return -1;
 }
 
-void sched_send_to_death(Thread *thread) {
-  reaper_lock->lock();
-  thread->state = Thread::EXITED;
-  to_die.insert_tail(thread);
-  reaper_lock->unlock();
+// Preempted real-time threads go back to the head of their queue
+// NOTE: the run queue lock must be held
+static void rq_insert(RunQueue &rq, Cpu *cpu, Thread *thread,
+                      bool head = false) {
+  thread->cpu = cpu;
+  thread->queued = true;
+
+  if (is_rt(thread)) {
+    auto prio = thread->rt_priority;
+
+    if (head)
+      rq.rt_queues[prio].insert_head(thread);
+    else
+      rq.rt_queues[prio].insert_tail(thread);
+
+    rq.rt_bitmap[prio / 64] |= 1ull << (prio % 64);
+  } else {
+    rq.threads.push(thread);
+    rq.stats.load += thread->weight;
+  }
+
+  rq.stats.nr_queued++;
 }
 
-void idle_thread_fn() { Hal::halt(); }
+// NOTE: the run queue lock must be held
+static void rq_remove(RunQueue &rq, Thread *thread) {
+  thread->queued = false;
 
-void reaper() {
-  while (true) {
-    if (to_die.length() > 0) {
-      reaper_lock->lock();
-      for (auto thread : to_die) {
-        to_die.remove(thread);
+  if (is_rt(thread)) {
+    auto prio = thread->rt_priority;
 
-        delete thread;
-      }
-      reaper_lock->unlock();
-    } else {
-      sched_yield();
-    }
+    rq.rt_queues[prio].remove(thread);
+
+    if (!rq.rt_queues[prio].head())
+      rq.rt_bitmap[prio / 64] &= ~(1ull << (prio % 64));
+  } else {
+    rq.threads.remove(thread);
+    rq.stats.load -= thread->weight;
   }
+
+  rq.stats.nr_queued--;
 }
 
-Result<Void, Error> sched_init() {
-  kernel_task = TRY(sched_new_task(-1, nullptr, false));
+// The thread that should run next. NOTE: the run queue lock must be held
+static Thread *rq_first(RunQueue &rq) {
+  auto prio = rq_rt_prio(rq);
 
-  sched_lock.initialize();
-  reaper_lock.initialize();
+  if (prio >= 0)
+    return rq.rt_queues[prio].head();
 
-  TRY(sched_new_worker_thread("reaper", (uintptr_t)reaper));
+  return rq.threads.top();
+}
 
-  current_thread = cpu->idle_thread =
-      sched_new_worker_thread("idle thread", (uintptr_t)idle_thread_fn, false)
-          .unwrap();
-  cpu->idle_thread->cpu = cpu;
-  cpu->current_thread = cpu->idle_thread;
-  cpu->magic = 0xCAFEBABE;
-  Hal::set_current_thread(cpu->idle_thread);
+static uint32_t thread_weight(SchedPolicy policy, int nice) {
+  if (policy == SchedPolicy::IDLE)
+    return IDLE_WEIGHT;
 
-  return Ok({});
+  return nice_weights[nice - NICE_MIN];
 }
 
-Thread *sched_curr() { return current_thread; }
+static void charge_time(Thread *thread, CpuMode mode, uint64_t now) {
+  auto delta = now - thread->acct_start;
 
-Result<Thread *, Error> sched_new_worker_thread(frg::string_view name,
-                                                uintptr_t entry_point,
-                                                bool insert) {
-  auto stack = (uintptr_t)Vm::vm_kernel_alloc(4);
+  thread->acct_start = now;
 
-  auto ctx = Hal::CpuContext(entry_point, stack + 0x4000, 0, false);
-  return sched_new_thread(name, kernel_task, ctx, insert);
+  switch (mode) {
+  case CpuMode::USER:
+    thread->times.user += delta;
+    break;
+  case CpuMode::SYSTEM:
+    thread->times.system += delta;
+    break;
+  case CpuMode::IRQ:
+    thread->times.irq += delta;
+    break;
+  }
 }
 
-void sched_enqueue_thread(Thread *thread) { runq.insert_tail(thread); }
-void sched_dequeue_thread(Thread *thread) { runq.remove(thread); }
+void sched_account(CpuMode from, CpuMode to) {
+  auto ipl = iplx(Ipl::HIGH);
+  auto thread = sched_curr();
 
-void sched_wake_thread(Thread *thread) {
-  thread->state = Thread::RUNNING;
-  sched_enqueue_thread(thread);
+  if (thread) {
+    charge_time(thread, from, Hal::get_monotonic_ns());
+    thread->cpu_mode = to;
+  }
+
+  iplx(ipl);
+}
+
+CpuTimes sched_task_times(Task *task) {
+  auto ipl = iplx(Ipl::HIGH);
+
+  // Bring our own times up to date
+  auto curr = sched_curr();
+
+  if (curr->task == task)
+    charge_time(curr, curr->cpu_mode, Hal::get_monotonic_ns());
+
+  task->lock.lock();
+
+  auto ret = task->exited_times;
+
+  for (auto thread : task->threads)
+    ret += thread->times;
+
+  task->lock.unlock();
+  iplx(ipl);
+
+  return ret;
+}
+
+CpuTimes sched_child_times(Task *task, uint64_t *min_faults) {
+  auto ipl = iplx(Ipl::HIGH);
+  tree_lock.lock();
+
+  auto ret = task->child_times;
+
+  if (min_faults)
+    *min_faults = task->child_min_faults;
+
+  tree_lock.unlock();
+  iplx(ipl);
+
+  return ret;
 }
 
+// Charge the current thread for the time it ran since the last update
+static void update_curr(Thread *thread) {
+  auto now = Hal::get_monotonic_ns();
+  auto delta = now - thread->exec_start;
+
+  thread->exec_start = now;
+  thread->vruntime += delta * NICE_0_WEIGHT / thread->weight;
+}
+
+// NOTE: the run queue lock must be held
+static void update_min_vruntime(RunQueue &rq, Thread *curr) {
+  auto first = rq.threads.top();
+  uint64_t vruntime;
+
+  if (curr && first)
+    vruntime = VruntimeComp{}(curr, first) ? first->vruntime : curr->vruntime;
+  else if (curr)
+    vruntime = curr->vruntime;
+  else if (first)
+    vruntime = first->vruntime;
+  else
+    return;
+
+  if ((int64_t)(vruntime - rq.min_vruntime) > 0)
+    rq.min_vruntime = vruntime;
+}
+
+// vruntimes only mean something relative to their queue's min_vruntime
+static void renormalize(Thread *thread, RunQueue &from, RunQueue &to) {
+  thread->vruntime = thread->vruntime -
+                     __atomic_load_n(&from.min_vruntime, __ATOMIC_RELAXED) +
+                     to.min_vruntime;
+}
+
+// New threads start at min_vruntime. Threads that slept get a bit of an
+// advantage, without being able to use the time they slept to monopolize the
+// CPU. NOTE: the run queue lock must be held
+static void place_thread(RunQueue &rq, Thread *thread, bool initial) {
+  auto vruntime = initial ? rq.min_vruntime : rq.min_vruntime - SLEEPER_BONUS;
+
+  if (initial || (int64_t)(vruntime - thread->vruntime) > 0)
+    thread->vruntime = vruntime;
+}
+
+// The current thread's share of SCHED_LATENCY, in ns
+// NOTE: the run queue lock must be held
+static uint64_t sched_slice(RunQueue &rq, Thread *curr) {
+  uint64_t slice = SCHED_LATENCY * NS_PER_MS * curr->weight /
+                   (rq.stats.load + curr->weight);
+
+  return MAX(slice, (uint64_t)TIME_SLICE * NS_PER_MS);
+}
+
+// Whether a round-robin thread used its slice
+static bool rr_expired(Thread *thread) {
+  return thread->policy == SchedPolicy::RR &&
+         Hal::get_monotonic_ns() - thread->slice_start >=
+             RR_TIME_SLICE * NS_PER_MS;
+}
+
+// Whether the current thread should give up the CPU to a queued one
+// NOTE: the run queue lock must be held
+static bool should_preempt(RunQueue &rq, Thread *curr) {
+  auto rt_prio = rq_rt_prio(rq);
+
+  if (is_rt(curr)) {
+    if (rt_prio > curr->rt_priority)
+      return true;
+
+    return rt_prio == curr->rt_priority && rr_expired(curr);
+  }
+
+  if (rt_prio >= 0)
+    return true;
+
+  // A fair thread keeps the CPU until it ran long enough and isn't the one
+  // that ran the least anymore
+  auto first = rq.threads.top();
+
+  if (!first)
+    return false;
+
+  if (Hal::get_monotonic_ns() - curr->slice_start < sched_slice(rq, curr))
+    return false;
+
+  return VruntimeComp{}(curr, first);
+}
+
+// Whether a newly woken thread is owed enough CPU time to take the CPU from the
+// current one right away
+static bool wakeup_preempt(Thread *curr, Thread *thread) {
+  if (is_rt(thread))
+    return !is_rt(curr) || thread->rt_priority > curr->rt_priority;
+
+  if (is_rt(curr) || thread->policy != SchedPolicy::OTHER)
+    return false;
+
+  if (curr->policy == SchedPolicy::IDLE)
+    return true;
+
+  return (int64_t)(curr->vruntime - thread->vruntime) >
+         (int64_t)WAKEUP_GRANULARITY;
+}
+
+// Whether a queued thread outranks the current one, whose priority changed
+// NOTE: the run queue lock must be held
+static bool outranked(RunQueue &rq, Thread *curr) {
+  auto rt_prio = rq_rt_prio(rq);
+
+  if (is_rt(curr))
+    return rt_prio > curr->rt_priority;
+
+  if (rt_prio >= 0)
+    return true;
+
+  auto first = rq.threads.top();
+
+  return first && wakeup_preempt(curr, first);
+}
+
+static bool cpu_idle(Cpu *cpu) {
+  return cpu->current_thread == cpu->idle_thread && !rq_length(cpu);
+}
+
+void sched_kick_cpu(Cpu *cpu) {
+  uint32_t polling = IDLE_POLLING;
+
+  if (cpu == cpu_self()) {
+    Amd64::lapic_send_ipi_self(32);
+  } else if (__atomic_compare_exchange_n(&cpu->idle_poll, &polling,
+                                         IDLE_KICKED, false, __ATOMIC_SEQ_CST,
+                                         __ATOMIC_RELAXED)) {
+    // Its idle thread watches that word, and goes through the scheduler once
+    // it changes
+    __atomic_add_fetch(&cpu_rq(cpu).stats.ipis_avoided, 1, __ATOMIC_RELAXED);
+  } else {
+    Amd64::lapic_send_ipi(cpu->data.lapic_id, 32);
+  }
+}
+
+// Called with interrupts disabled when the CPU wakes up, or the idle thread
+// gets switched away from while polling
+static void idle_exit(Cpu *cpu) {
+  __atomic_store_n(&cpu->idle_poll, IDLE_AWAKE, __ATOMIC_SEQ_CST);
+  __atomic_store_n(&cpu->idle_depth, 0, __ATOMIC_RELAXED);
+
+  if (cpu->idle_start) {
+    __atomic_add_fetch(&cpu_rq(cpu).stats.idle_ns,
+                       Hal::get_monotonic_ns() - cpu->idle_start,
+                       __ATOMIC_RELAXED);
+    cpu->idle_start = 0;
+  }
+}
+
+// Idle CPUs in a shallow state (or still awake) get threads running sooner
+static bool shallower(Cpu *a, Cpu *b) {
+  return __atomic_load_n(&a->idle_depth, __ATOMIC_RELAXED) <
+         __atomic_load_n(&b->idle_depth, __ATOMIC_RELAXED);
+}
+
+// Make a CPU switch threads as soon as possible
+static void resched_cpu(Cpu *cpu) {
+  __atomic_store_n(&cpu->need_resched, true, __ATOMIC_RELAXED);
+  sched_kick_cpu(cpu);
+}
+
+// Idle CPUs don't tick, so they have to be told when there's work to steal
+static void kick_idle_cpu(Cpu *busy) {
+  Cpu *target = nullptr;
+
+  for (size_t i = 0; i < ncpus; i++) {
+    if (cpus[i] != busy && !cpu_isolated(cpus[i]) && cpu_idle(cpus[i]) &&
+        (!target || shallower(cpus[i], target)))
+      target = cpus[i];
+  }
+
+  if (target)
+    sched_kick_cpu(target);
+}
+
+static void enqueue_on(Cpu *cpu, Thread *thread, bool initial) {
+  auto &rq = cpu_rq(cpu);
+
+  rq.lock.lock();
+
+  if (!is_rt(thread)) {
+    if (thread->cpu && thread->cpu != cpu)
+      renormalize(thread, cpu_rq(thread->cpu), rq);
+
+    place_thread(rq, thread, initial);
+  }
+
+  rq_insert(rq, cpu, thread);
+
+  auto curr = __atomic_load_n(&cpu->current_thread, __ATOMIC_RELAXED);
+  bool idle = curr == cpu->idle_thread;
+  bool preempt = !idle && wakeup_preempt(curr, thread);
+
+  if (preempt)
+    rq.stats.preemptions++;
+
+  bool waiting = rq.stats.nr_queued > 1;
+
+  rq.lock.unlock();
+
+  if (idle || preempt) {
+    resched_cpu(cpu);
+  } else {
+    // Its tick has to be armed for the current thread's slice
+    if (__atomic_load_n(&cpu->tick_stopped, __ATOMIC_RELAXED))
+      sched_kick_cpu(cpu);
+
+    if (waiting)
+      kick_idle_cpu(cpu);
+  }
+}
+
+/*
+ * Move up to `count` threads from `from`'s queue to `to`'s, starting with the
+ * ones that would run next there. Threads that aren't allowed on `to` are
+ * skipped, we give up after MIGRATE_PINNED_MAX of them.
+ */
+static size_t migrate(Cpu *from, Cpu *to, size_t count) {
+  auto &src = cpu_rq(from);
+  auto &dst = cpu_rq(to);
+
+  lock_rq_pair(from, to);
+
+  Thread *pinned[MIGRATE_PINNED_MAX];
+  size_t moved = 0, npinned = 0;
+
+  while (moved < count && npinned < MIGRATE_PINNED_MAX) {
+    auto thread = rq_first(src);
+
+    if (!thread)
+      break;
+
+    rq_remove(src, thread);
+
+    if (!cpu_allowed(thread, to)) {
+      pinned[npinned++] = thread;
+      continue;
+    }
+
+    if (!is_rt(thread))
+      renormalize(thread, src, dst);
+
+    rq_insert(dst, to, thread);
+    moved++;
+  }
+
+  // Back where they were, real-time ones at the head of their queue
+  while (npinned)
+    rq_insert(src, from, pinned[--npinned], true);
+
+  unlock_rq_pair(from, to);
+
+  return moved;
+}
+
+// Move a thread queued on `from` to `to`'s queue, unless it left it already
+static void requeue_on(Cpu *from, Cpu *to, Thread *thread) {
+  auto &src = cpu_rq(from);
+  auto &dst = cpu_rq(to);
+
+  lock_rq_pair(from, to);
+
+  bool move = thread->queued && thread->cpu == from;
+
+  if (move) {
+    rq_remove(src, thread);
+
+    if (!is_rt(thread))
+      renormalize(thread, src, dst);
+
+    rq_insert(dst, to, thread);
+  }
+
+  unlock_rq_pair(from, to);
+
+  if (move)
+    sched_kick_cpu(to);
+}
+
+static Cpu *busiest_cpu(Cpu *self) {
+  Cpu *ret = nullptr;
+  size_t max = 0;
+
+  for (size_t i = 0; i < ncpus; i++) {
+    auto len = rq_length(cpus[i]);
+
+    // Threads queued on isolated CPUs were pinned there
+    if (cpus[i] != self && !cpu_isolated(cpus[i]) && len > max) {
+      ret = cpus[i];
+      max = len;
+    }
+  }
+
+  return ret;
+}
+
+// We have nothing to run, take half of the busiest queue
+static void steal(Cpu *self) {
+  if (cpu_isolated(self))
+    return;
+
+  auto victim = busiest_cpu(self);
+
+  if (!victim)
+    return;
+
+  auto moved = migrate(victim, self, (rq_length(victim) + 1) / 2);
+
+  cpu_rq(self).stats.steals += moved;
+}
+
+// Even out our queue with the busiest one
+static void balance(Cpu *self) {
+  if (cpu_isolated(self))
+    return;
+
+  auto busiest = busiest_cpu(self);
+
+  if (!busiest)
+    return;
+
+  auto theirs = rq_length(busiest), ours = rq_length(self);
+
+  if (theirs <= ours + 1)
+    return;
+
+  auto moved = migrate(busiest, self, (theirs - ours) / 2);
+
+  cpu_rq(self).stats.balanced += moved;
+}
+
+// Wake up on the CPU the thread last ran on, where its cache is warm, unless
+// the waker's CPU is less loaded. Both have to be allowed by its affinity.
+static Cpu *select_cpu(Thread *thread) {
+  auto self = cpu_self();
+  auto last = thread->cpu;
+
+  if (last && !cpu_allowed(thread, last))
+    last = nullptr;
+
+  if (!cpu_allowed(thread, self))
+    return last ? last : allowed_cpu(thread);
+
+  if (!last || last == self)
+    return self;
+
+  if (cpu_idle(last))
+    return last;
+
+  if (rq_length(self) < rq_length(last)) {
+    cpu_rq(self).stats.wakeups_migrated++;
+    return self;
+  }
+
+  return last;
+}
+
+// Priority of what a CPU runs, for placing real-time threads
+static int cpu_prio(Cpu *cpu) {
+  auto curr = __atomic_load_n(&cpu->current_thread, __ATOMIC_RELAXED);
+
+  if (curr == cpu->idle_thread)
+    return -2;
+
+  return is_rt(curr) ? curr->rt_priority : -1;
+}
+
+// Real-time threads go where they can run right away, preferably where they
+// last ran
+static Cpu *select_rt_cpu(Thread *thread) {
+  auto best = thread->cpu ? thread->cpu : cpu_self();
+
+  if (!cpu_allowed(thread, best))
+    best = allowed_cpu(thread);
+
+  auto best_prio = cpu_prio(best);
+
+  if (best_prio < 0)
+    return best;
+
+  for (size_t i = 0; i < ncpus; i++) {
+    if (!cpu_allowed(thread, cpus[i]))
+      continue;
+
+    auto prio = cpu_prio(cpus[i]);
+
+    if (prio < best_prio) {
+      best = cpus[i];
+      best_prio = prio;
+    }
+  }
+
+  return best;
+}
+
+static void record_latency(RunQueue &rq, Thread *thread) {
+  auto us = (Hal::get_monotonic_ns() - thread->wake_time) / 1000;
+  size_t bucket = 0;
+
+  while (bucket < LATENCY_BUCKETS - 1 && us >= (1ull << bucket))
+    bucket++;
+
+  rq.stats.rt_latency[bucket]++;
+  thread->wake_time = 0;
+}
+
+// Take the thread that should run next out of the queue
+static Thread *get_next_thread(Cpu *cpu) {
+  auto &rq = cpu_rq(cpu);
+
+  rq.lock.lock();
+
+  Thread *ret = nullptr;
+
+  while (auto thread = rq_first(rq)) {
+    rq_remove(rq, thread);
+
+    // Killed while waiting for its turn
+    if (thread->state == Thread::EXITED)
+      continue;
+
+    ret = thread;
+    ret->on_cpu = true;
+    break;
+  }
+
+  rq.lock.unlock();
+
+  return ret;
+}
+
+/*
+ * Arm the tick for the next thing the scheduler or the timers have to do on
+ * this CPU: the end of the current thread's slice if others are waiting,
+ * periodic balancing and the CPU's timer wheel.
+ */
+static void rearm_tick(Cpu *cpu, Thread *curr) {
+  auto &rq = cpu_rq(cpu);
+  auto now = Hal::get_monotonic_ns();
+  uint64_t deadline = UINT64_MAX;
+  bool stopped = true;
+
+  rq.lock.lock();
+
+  if (curr != cpu->idle_thread) {
+    // Higher real-time priorities preempt on wakeup, lower ones wait
+    if (is_rt(curr)) {
+      if (curr->policy == SchedPolicy::RR &&
+          rq_rt_prio(rq) == curr->rt_priority) {
+        deadline = curr->slice_start + RR_TIME_SLICE * NS_PER_MS;
+        stopped = false;
+      }
+    } else if (rq.stats.nr_queued) {
+      deadline = curr->slice_start + sched_slice(rq, curr);
+      stopped = false;
+
+      // The slice is over but it still ran the least, check again later
+      if (deadline <= now)
+        deadline = now + TIME_SLICE * NS_PER_MS;
+    }
+
+    // Isolated CPUs don't balance, a lone thread there runs without a tick
+    if (!cpu_isolated(cpu) && rq.next_balance < deadline)
+      deadline = rq.next_balance;
+  }
+
+  rq.lock.unlock();
+
+  auto timer = timer_next_deadline();
+  deadline = timer < deadline ? timer : deadline;
+
+  __atomic_store_n(&cpu->tick_stopped, stopped, __ATOMIC_RELAXED);
+
+  if (deadline == UINT64_MAX) {
+    Hal::arm_timer(0);
+  } else {
+    Hal::arm_timer(deadline > now + MIN_TICK ? deadline - now : MIN_TICK);
+  }
+}
+
+// Pick the thread to switch to, nullptr if `prev` keeps the CPU. `resched`
+// makes it give up the CPU if anything else can run.
+static Thread *pick_next(Cpu *cpu, Thread *prev, bool resched) {
+  auto &rq = cpu_rq(cpu);
+  bool running = prev != cpu->idle_thread && prev->state == Thread::RUNNING;
+
+  if (prev != cpu->idle_thread)
+    update_curr(prev);
+
+  // Keep going until the slice is over, unless someone asked for the CPU
+  rq.lock.lock();
+  update_min_vruntime(rq, running && !is_rt(prev) ? prev : nullptr);
+  bool keep = running && !resched && !should_preempt(rq, prev);
+  rq.lock.unlock();
+
+  if (keep) {
+    prev->yielded = false;
+    rearm_tick(cpu, prev);
+    return nullptr;
+  }
+
+  if (running && rr_expired(prev))
+    prev->yielded = true;
+
+  auto next = get_next_thread(cpu);
+
+  if (!next) {
+    steal(cpu);
+    next = get_next_thread(cpu);
+  }
+
+  if (!next) {
+    // Nothing else to run, keep going
+    if (prev->state == Thread::RUNNING) {
+      prev->slice_start = Hal::get_monotonic_ns();
+      prev->yielded = false;
+      rearm_tick(cpu, prev);
+      return nullptr;
+    }
+
+    next = cpu->idle_thread;
+  }
+
+  return next;
+}
+
+// Make `next` the current thread, prev is put back in the queue by
+// sched_finish_switch once we're off its stack
+static void prepare_switch(Cpu *cpu, Thread *prev, Thread *next) {
+  auto &rq = cpu_rq(cpu);
+
+  // The idle thread may be preempted while polling, kicks need an IPI again
+  if (prev == cpu->idle_thread)
+    idle_exit(cpu);
+
+  trace_event(TraceEvent::SWITCH, next->tid,
+              prev == cpu->idle_thread ? TRACE_IDLE : prev->state,
+              rq.stats.nr_queued);
+
+  auto now = Hal::get_monotonic_ns();
+
+  charge_time(prev, prev->cpu_mode, now);
+
+  next->state = Thread::RUNNING;
+  next->on_cpu = true;
+  next->cpu = cpu;
+  next->exec_start = next->slice_start = next->acct_start = now;
+
+  if (next->wake_time)
+    record_latency(rq, next);
+
+  rq.stats.switches++;
+  cpu->previous_thread = prev;
+
+  rearm_tick(cpu, next);
+
+  Hal::set_current_thread(next);
+  next->task->space->activate();
+}
+
+void sched_tick(Hal::InterruptFrame *frame) {
+  auto cpu = cpu_self();
+  auto prev = cpu->current_thread;
+  auto &rq = cpu_rq(cpu);
+
+  ASSERT(cpu->magic == CPU_MAGIC);
+
+  // The boot context isn't a thread, nothing to save the first time
+  bool save = cpu->restore_frame;
+  cpu->restore_frame = true;
+
+  if (prev != cpu->idle_thread && !cpu_isolated(cpu) &&
+      Hal::get_monotonic_ns() >= rq.next_balance) {
+    balance(cpu);
+    rq.next_balance = Hal::get_monotonic_ns() + BALANCE_INTERVAL;
+  }
+
+  bool resched = __atomic_exchange_n(&cpu->need_resched, false,
+                                     __ATOMIC_RELAXED);
+
+  auto next = pick_next(cpu, prev, resched);
+
+  if (!next)
+    return;
+
+  // Only saved when switching out, the SIMD state stays live otherwise
+  if (save)
+    prev->ctx.save(frame);
+
+  prepare_switch(cpu, prev, next);
+  Hal::do_context_switch();
+}
+
+void sched_finish_switch() {
+  auto cpu = cpu_self();
+  auto prev = cpu->previous_thread;
+
+  if (!prev || prev == cpu->current_thread)
+    return;
+
+  cpu->previous_thread = nullptr;
+
+  // Its affinity changed while it ran, it goes to a CPU it's allowed on
+  auto target = cpu;
+
+  if (prev != cpu->idle_thread && !cpu_allowed(prev, cpu))
+    target = allowed_cpu(prev);
+
+  // We are off prev's stack, so it can now run elsewhere (or be freed). Waking
+  // it up and us putting it back in the queue must not race.
+  auto &rq = cpu_rq(target);
+
+  lock_rq_pair(cpu, target);
+  prev->lock.lock();
+
+  __atomic_store_n(&prev->on_cpu, false, __ATOMIC_RELEASE);
+
+  if (prev->state == Thread::RUNNING && prev != cpu->idle_thread) {
+    if (target != cpu && !is_rt(prev))
+      renormalize(prev, cpu_rq(cpu), rq);
+
+    rq_insert(rq, target, prev, !prev->yielded && target == cpu);
+  }
+
+  prev->yielded = false;
+
+  // Its memory may be freed as soon as we let go of the lock
+  bool dead = prev->state == Thread::EXITED;
+
+  prev->lock.unlock();
+  unlock_rq_pair(cpu, target);
+
+  if (target != cpu)
+    sched_kick_cpu(target);
+
+  if (dead)
+    wake_reaper();
+}
+
+void sched_dequeue_and_die() {
+  // Never put back in the run queue once switched away from
+  sched_curr()->state = Thread::EXITED;
+  sched_yield();
+  Hal::halt();
+}
+
+void sched_yield() {
+  Hal::disable_interrupts();
+
+  auto cpu = cpu_self();
+  auto prev = cpu->current_thread;
+
+  prev->yielded = true;
+
+  // Still on the boot stack, which isn't saved anywhere (or benchmarking the
+  // old path): let the tick switch us out
+  if (!cpu->restore_frame || !direct_switch) {
+    cpu->need_resched = true;
+    Amd64::lapic_send_ipi_self(32);
+    Hal::enable_interrupts();
+    return;
+  }
+
+  __atomic_store_n(&cpu->need_resched, false, __ATOMIC_RELAXED);
+
+  auto next = pick_next(cpu, prev, true);
+
+  if (next) {
+    prepare_switch(cpu, prev, next);
+
+    // Threads that were preempted expect to run at Ipl::ZERO, the ones that
+    // switched out themselves restore their own IPL
+    auto ipl = iplx(Ipl::ZERO);
+
+    Hal::switch_context(&prev->ctx, &next->ctx);
+
+    // We may be on another CPU by now
+    iplx(ipl);
+    sched_finish_switch();
+  }
+
+  Hal::enable_interrupts();
+}
+
+void sched_suspend_thread(Thread *thread) {
+  thread->state = Thread::SUSPENDED;
+  sched_yield();
+}
+
+void sched_send_to_death(Thread *thread) {
+  thread->lock.lock();
+  thread->state = Thread::EXITED;
+  thread->lock.unlock();
+
+  auto ipl = iplx(Ipl::HIGH);
+
+  pid_lock.lock();
+  tid_bucket(thread->tid).remove(thread);
+  pid_lock.unlock();
+
+  reaper_lock.lock();
+  to_die.insert_tail(thread);
+  reaper_wq.wake(-1).unwrap();
+  reaper_lock.unlock();
+
+  iplx(ipl);
+}
+
+// Take a thread that is off its CPU for good out of the run queue or wait
+// queue it's in. It's stuck where it switched away, so what it waits on is
+// still on its stack. Only wakers and its timeout still touch the wait.
+static void sched_detach_thread(Thread *thread) {
+  sched_dequeue_thread(thread);
+
+  auto wq = __atomic_load_n(&thread->waitq, __ATOMIC_ACQUIRE);
+
+  if (wq) {
+    wq->lock.lock();
+
+    if (thread->waitq == wq && thread->wait_res == WaitResult::WAITING) {
+      wq->waiters.remove(thread);
+      thread->wait_res = WaitResult::FAILED;
+      __atomic_store_n(&thread->waitq, nullptr, __ATOMIC_RELEASE);
+    }
+
+    wq->lock.unlock();
+  }
+
+  // Only the thread itself changes these, even if a waker got to it first. The
+  // timer callback may still be running on another CPU.
+  if (thread->wait_timer)
+    timer_cancel(thread->wait_timer);
+
+  futex_abort_wait(thread);
+}
+
+void sched_stop_other_threads(Task *task) {
+  auto curr = sched_curr();
+  auto ipl = iplx(Ipl::HIGH);
+
+  // The task's threads don't change while it's stopping
+  Vm::Vector<Thread *> threads;
+
+  task->lock.lock();
+
+  ASSERT(task->stopping);
+
+  for (auto thread : task->threads) {
+    if (thread != curr)
+      threads.push(thread);
+  }
+
+  task->lock.unlock();
+
+  // Threads running on another CPU are made to switch away. Once EXITED they're
+  // never picked or woken up again, and don't go to sleep anymore.
+  for (auto thread : threads) {
+    thread->lock.lock();
+    thread->state = Thread::EXITED;
+    thread->lock.unlock();
+
+    auto cpu = __atomic_load_n(&thread->cpu, __ATOMIC_RELAXED);
+
+    if (__atomic_load_n(&thread->on_cpu, __ATOMIC_ACQUIRE) && cpu &&
+        cpu != cpu_self())
+      resched_cpu(cpu);
+  }
+
+  // They still use the task's space until then. One of them may be waiting for
+  // us to flush our TLB before it can switch away.
+  for (auto thread : threads) {
+    while (__atomic_load_n(&thread->on_cpu, __ATOMIC_ACQUIRE))
+      Hal::Vm::poll_shootdowns();
+
+    sched_detach_thread(thread);
+  }
+
+  // Their times are final once they've switched away, they're folded into the
+  // task as they leave it so sched_task_times never misses them
+  task->lock.lock();
+
+  for (auto thread : threads)
+    task->exited_times += thread->times;
+
+  task->threads.clear();
+
+  if (curr->task == task)
+    task->threads.push(curr);
+
+  task->stopping = false;
+  task->lock.unlock();
+
+  for (auto thread : threads) {
+    sched_send_to_death(thread);
+  }
+
+  iplx(ipl);
+}
+
+bool sched_begin_exec(Task *task) {
+  auto ipl = iplx(Ipl::HIGH);
+
+  task->lock.lock();
+
+  bool ok = !task->has_exited && !task->stopping;
+
+  if (ok)
+    task->stopping = true;
+
+  task->lock.unlock();
+
+  iplx(ipl);
+
+  return ok;
+}
+
+bool sched_begin_exit(Task *task, int status) {
+  auto ipl = iplx(Ipl::HIGH);
+
+  task->lock.lock();
+
+  // Another thread may be exec'ing, we're one of the threads it stops then
+  bool exiting = task->has_exited || task->stopping;
+
+  if (!exiting) {
+    task->exit_code = status;
+    task->has_exited = true;
+    task->stopping = true;
+  }
+
+  task->lock.unlock();
+
+  iplx(ipl);
+
+  return !exiting;
+}
+
+void sched_exit_task(Task *task, int status) {
+  auto curr = sched_curr();
+  bool self = curr->task == task;
+
+  if (self) {
+    Hal::disable_interrupts();
+  }
+
+  // Another thread is already tearing the task down, it waits for us
+  if (!sched_begin_exit(task, status)) {
+    if (self)
+      sched_dequeue_and_die();
+
+    return;
+  }
+
+  sched_finish_exit(task);
+}
+
+void sched_finish_exit(Task *task) {
+  auto curr = sched_curr();
+  bool self = curr->task == task;
+
+  if (self) {
+    Hal::disable_interrupts();
+  }
+
+  auto ipl = iplx(Ipl::HIGH);
+
+  sched_stop_other_threads(task);
+
+  if (self)
+    charge_time(curr, curr->cpu_mode, Hal::get_monotonic_ns());
+
+  // Nobody looks at the times of a task that exited until it's reaped
+  for (auto thread : task->threads) {
+    task->exited_times += thread->times;
+    sched_send_to_death(thread);
+  }
+
+  task->threads.clear();
+
+  // We're the only one left on the task's space, until we switch away
+  if (self)
+    Vm::kernel_space->activate();
+
+  task_release(task);
+
+  tree_lock.lock();
+
+  // Orphans are adopted by init, which reaps them
+  auto init = sched_find_task(1);
+  auto heir = init && init != task ? init : kernel_task;
+  bool orphans = task->zombies.length();
+
+  while (auto child = task->children.head()) {
+    task->children.remove(child).unwrap();
+    child->parent = heir;
+    heir->children.insert_tail(child);
+  }
+
+  while (auto child = task->zombies.head()) {
+    task->zombies.remove(child).unwrap();
+    child->parent = heir;
+    heir->zombies.insert_tail(child);
+  }
+
+  if (orphans)
+    heir->trigger_event().unwrap();
+
+  // Stays around until its parent reaps it
+  auto parent = task->parent;
+
+  if (parent) {
+    parent->children.remove(task).unwrap();
+    parent->zombies.insert_tail(task);
+    task->zombie = true;
+    parent->trigger_event().unwrap();
+  }
+
+  tree_lock.unlock();
+
+  if (!parent)
+    delete task;
+
+  iplx(ipl);
+
+  if (self) {
+    sched_dequeue_and_die();
+  }
+}
+
+void sched_exit_thread(int status) {
+  auto curr = sched_curr();
+  auto task = curr->task;
+
+  // This is how pthread_join knows we're gone. Private and shared futexes
+  // have different keys, so wake up both kinds of waiters.
+  if (curr->clear_child_tid) {
+    __atomic_store_n(curr->clear_child_tid, 0, __ATOMIC_RELEASE);
+
+    auto word = (uint32_t *)curr->clear_child_tid;
+
+    (void)futex_wake(word, 1, FUTEX_BITSET_MATCH_ANY, false);
+    (void)futex_wake(word, 1, FUTEX_BITSET_MATCH_ANY, true);
+  }
+
+  Hal::disable_interrupts();
+
+  auto ipl = iplx(Ipl::HIGH);
+
+  task->lock.lock();
+
+  // Whoever is stopping the task's threads sends us to death once we're off
+  // the CPU
+  if (task->stopping) {
+    task->lock.unlock();
+    iplx(ipl);
+    sched_dequeue_and_die();
+  }
+
+  // The last thread takes the task down with it, and a task that is being torn
+  // down takes care of us
+  if (task->has_exited || task->threads.size() == 1) {
+    task->lock.unlock();
+    iplx(ipl);
+    sched_exit_task(task, status);
+    sched_dequeue_and_die();
+  }
+
+  charge_time(curr, curr->cpu_mode, Hal::get_monotonic_ns());
+  task->exited_times += curr->times;
+
+  for (size_t i = 0; i < task->threads.size(); i++) {
+    if (task->threads[i] == curr) {
+      task->threads[i] = task->threads.back();
+      task->threads.pop();
+      break;
+    }
+  }
+
+  // Nobody waits for us anymore, the task's space can go away as soon as we
+  // drop the lock
+  Vm::kernel_space->activate();
+
+  task->lock.unlock();
+
+  sched_send_to_death(curr);
+
+  iplx(ipl);
+
+  sched_dequeue_and_die();
+}
+
+// Deepest idle state worth entering before the next timer expires
+static size_t pick_idle_state() {
+  auto deadline = timer_next_deadline();
+  auto now = Hal::get_monotonic_ns();
+  auto expected = deadline > now ? deadline - now : 0;
+
+  size_t state = 0;
+
+  while (state + 1 < Hal::idle_state_count() &&
+         Hal::idle_residency(state + 1) <= expected)
+    state++;
+
+  return state;
+}
+
+void idle_thread_fn() {
+  // Never migrated
+  auto cpu = cpu_self();
+
+  while (true) {
+    Hal::disable_interrupts();
+
+    auto state = pick_idle_state();
+
+    // Kicks after that turn it into IDLE_KICKED, kicks before that sent an IPI
+    // which is pending until idle_wait enables interrupts
+    if (Hal::idle_can_watch())
+      __atomic_store_n(&cpu->idle_poll, IDLE_POLLING, __ATOMIC_SEQ_CST);
+
+    __atomic_store_n(&cpu->idle_depth, state + 1, __ATOMIC_RELAXED);
+    cpu->idle_start = Hal::get_monotonic_ns();
+
+    if (!rq_length(cpu))
+      Hal::idle_wait(&cpu->idle_poll, IDLE_POLLING, state);
+    else
+      Hal::enable_interrupts();
+
+    Hal::disable_interrupts();
+    idle_exit(cpu);
+    Hal::enable_interrupts();
+
+    // A kick that was only a write didn't get the scheduler to run
+    sched_yield();
+  }
+}
+
+void reaper() {
+  while (true) {
+    List<Thread, &Thread::death_link> batch;
+    bool pending = false;
+
+    auto ipl = iplx(Ipl::HIGH);
+
+    reaper_lock.lock();
+
+    auto thread = to_die.head();
+
+    while (thread) {
+      auto next = thread->death_link.next;
+
+      // Its CPU may still be on its stack, or it is still queued somewhere and
+      // will be dropped once picked. Taking its lock makes sure the CPU it
+      // ran on is done with it.
+      thread->lock.lock();
+      bool busy = __atomic_load_n(&thread->on_cpu, __ATOMIC_ACQUIRE) ||
+                  __atomic_load_n(&thread->queued, __ATOMIC_ACQUIRE);
+      thread->lock.unlock();
+
+      if (busy) {
+        pending = true;
+      } else {
+        to_die.remove(thread);
+        batch.insert_tail(thread);
+      }
+
+      thread = next;
+    }
+
+    // Woken up by sched_send_to_death, and by sched_finish_switch once a dead
+    // thread is off its CPU
+    if (!batch.head()) {
+      (void)reaper_wq.await(pending ? REAPER_RETRY : 0, &reaper_lock);
+      iplx(ipl);
+      continue;
+    }
+
+    reaper_lock.unlock();
+    iplx(ipl);
+
+    while (auto dead = batch.head()) {
+      batch.remove(dead);
+      delete dead;
+    }
+  }
+}
+
+Result<Void, Error> sched_init_cpu() {
+  auto cpu = cpu_self();
+
+  TRY(timer_init_cpu());
+
+  auto idle =
+      TRY(sched_new_worker_thread("idle thread", (uintptr_t)idle_thread_fn,
+                                  false));
+
+  idle->cpu = cpu;
+  idle->on_cpu = true;
+  cpu->idle_thread = idle;
+  Hal::set_current_thread(idle);
+
+  return Ok({});
+}
+
+// isolcpus=<list>, the boot CPU takes device interrupts and is never isolated
+static void parse_isolcpus() {
+  if (!charon().cmdline)
+    return;
+
+  auto list = cmdline_get(charon().cmdline, "isolcpus");
+
+  if (!list)
+    return;
+
+  auto mask = parse_cpu_list(*list);
+
+  if (!mask) {
+    error("sched: ignoring malformed isolcpus={}", *list);
+    return;
+  }
+
+  isolated_cpus = *mask & ~1ull;
+
+  log("sched: isolated CPUs {:x}", isolated_cpus);
+}
+
+Result<Void, Error> sched_init() {
+  parse_isolcpus();
+
+  vmem_init(&pid_arena, "pids", (void *)1, PID_MAX - 1, 1, nullptr, nullptr,
+            nullptr, 0, 0);
+
+  kernel_task = TRY(sched_new_task(-1, nullptr, false));
+
+  Vm::reclaim_register(&kstack_shrinker);
+
+  TRY(sched_new_worker_thread("reaper", (uintptr_t)reaper));
+
+  return sched_init_cpu();
+}
+
+Thread *sched_curr() { return Hal::get_current_thread(); }
+
+Result<Thread *, Error> sched_new_worker_thread(frg::string_view name,
+                                                uintptr_t entry_point,
+                                                bool insert) {
+  auto stack = TRY(sched_alloc_kernel_stack());
+
+  auto ctx = Hal::CpuContext(entry_point, stack, 0, false);
+  return sched_new_thread(name, kernel_task, ctx, insert);
+}
+
+void sched_enqueue_thread(Thread *thread) {
+  auto ipl = iplx(Ipl::HIGH);
+
+  // New threads go to the least loaded CPU they're allowed on
+  auto target = cpu_allowed(thread, cpu_self()) ? cpu_self()
+                                                : allowed_cpu(thread);
+
+  for (size_t i = 0; i < ncpus; i++) {
+    auto len = rq_length(cpus[i]);
+
+    if (!cpu_allowed(thread, cpus[i]))
+      continue;
+
+    if (len < rq_length(target) ||
+        (len == rq_length(target) && shallower(cpus[i], target)))
+      target = cpus[i];
+  }
+
+  enqueue_on(target, thread, true);
+  iplx(ipl);
+}
+
+// Lock the run queue of the CPU a thread belongs to, the thread may be migrated
+// while we wait for the lock
+static RunQueue *lock_thread_rq(Thread *thread) {
+  while (true) {
+    auto cpu = thread->cpu;
+
+    if (!cpu)
+      return nullptr;
+
+    auto &rq = cpu_rq(cpu);
+    rq.lock.lock();
+
+    if (thread->cpu == cpu)
+      return &rq;
+
+    rq.lock.unlock();
+  }
+}
+
+void sched_dequeue_thread(Thread *thread) {
+  auto ipl = iplx(Ipl::HIGH);
+
+  if (auto rq = lock_thread_rq(thread)) {
+    if (thread->queued)
+      rq_remove(*rq, thread);
+
+    rq->lock.unlock();
+  }
+
+  iplx(ipl);
+}
+
+void sched_wake_thread(Thread *thread) {
+  auto ipl = iplx(Ipl::HIGH);
+
+  thread->lock.lock();
+
+  // Killed while it was asleep
+  if (thread->state == Thread::EXITED) {
+    thread->lock.unlock();
+    iplx(ipl);
+    return;
+  }
+
+  thread->state = Thread::RUNNING;
+
+  // Otherwise, it is put back in a queue once its CPU switched away from it
+  bool queue = !thread->on_cpu;
+
+  thread->lock.unlock();
+
+  if (queue) {
+    if (is_rt(thread))
+      thread->wake_time = Hal::get_monotonic_ns();
+
+    auto target = is_rt(thread) ? select_rt_cpu(thread) : select_cpu(thread);
+
+    trace_event(TraceEvent::WAKEUP, thread->tid, target->id,
+                rq_length(target));
+    enqueue_on(target, thread, false);
+  } else {
+    trace_event(TraceEvent::WAKEUP, thread->tid, -1);
+  }
+
+  iplx(ipl);
+}
+
+SchedStats sched_stats(size_t cpu) {
+  ASSERT(cpu < ncpus);
+  return runqueues[cpu].stats;
+}
+
+void sched_set_priority(Thread *thread, SchedPolicy policy, int nice,
+                        int rt_priority) {
+  nice = nice < NICE_MIN ? NICE_MIN : nice > NICE_MAX ? NICE_MAX : nice;
+  rt_priority = rt_priority < 1             ? 1
+                : rt_priority > RT_PRIO_MAX ? RT_PRIO_MAX
+                                            : rt_priority;
+
+  auto ipl = iplx(Ipl::HIGH);
+  auto rq = lock_thread_rq(thread);
+
+  // The queue's load must stay the sum of its threads' weights
+  bool queued = rq && thread->queued;
+
+  if (queued)
+    rq_remove(*rq, thread);
+
+  bool was_rt = is_rt(thread);
+
+  thread->policy = policy;
+  thread->nice = nice;
+  thread->weight = thread_weight(policy, nice);
+  thread->rt_priority = is_rt(thread) ? rt_priority : 0;
+
+  // Its vruntime didn't move while it was real-time
+  if (rq && was_rt && !is_rt(thread))
+    thread->vruntime = rq->min_vruntime;
+
+  bool preempt = false;
+
+  if (queued) {
+    rq_insert(*rq, thread->cpu, thread);
+    preempt = wakeup_preempt(thread->cpu->current_thread, thread);
+  } else if (rq && __atomic_load_n(&thread->cpu->current_thread,
+                                   __ATOMIC_RELAXED) == thread) {
+    // A running thread whose priority was lowered gives up the CPU right away
+    // if it isn't the one that should run anymore
+    preempt = outranked(*rq, thread);
+  }
+
+  if (rq)
+    rq->lock.unlock();
+
+  if (preempt)
+    resched_cpu(thread->cpu);
+
+  iplx(ipl);
+}
+
+uint64_t sched_get_affinity(Thread *thread) {
+  return __atomic_load_n(&thread->affinity, __ATOMIC_RELAXED) & online_cpus();
+}
+
+Result<Void, Error> sched_set_affinity(Thread *thread, uint64_t mask) {
+  mask &= online_cpus();
+
+  if (!mask)
+    return Err(Error::INVALID_PARAMETERS);
+
+  auto ipl = iplx(Ipl::HIGH);
+  auto rq = lock_thread_rq(thread);
+
+  __atomic_store_n(&thread->affinity, mask, __ATOMIC_RELAXED);
+
+  auto cpu = thread->cpu;
+  bool moved = rq && !cpu_allowed(thread, cpu);
+  bool queued = moved && thread->queued;
+
+  if (rq)
+    rq->lock.unlock();
+
+  // A queued thread changes queues now, a running one once it is switched out
+  // (see sched_finish_switch)
+  if (queued) {
+    requeue_on(cpu, is_rt(thread) ? select_rt_cpu(thread) : select_cpu(thread),
+               thread);
+  } else if (moved && thread->on_cpu) {
+    resched_cpu(cpu);
+  }
+
+  iplx(ipl);
+
+  return Ok({});
+}
+
+#if SCHED_BENCHMARK
+
+/*
+ * Two kernel threads queued on the same CPU pass a turn back and forth through
+ * a futex BENCH_ROUNDS times. Each round trip is two wakeups and two voluntary
+ * switches, as long as wakeups don't move them to another CPU.
+ */
+
+static constexpr size_t BENCH_ROUNDS = 10000;
+
+static uint32_t bench_turn = 0;
+
+static void bench_wait_turn(uint32_t turn) {
+  uint32_t c;
+
+  while ((c = __atomic_load_n(&bench_turn, __ATOMIC_ACQUIRE)) != turn)
+    (void)futex_wait(&bench_turn, c, FUTEX_BITSET_MATCH_ANY, -1, false);
+}
+
+static void bench_pass_turn(uint32_t turn) {
+  __atomic_store_n(&bench_turn, turn, __ATOMIC_RELEASE);
+  futex_wake(&bench_turn, 1, FUTEX_BITSET_MATCH_ANY, false).unwrap();
+}
+
+static void bench_pong() {
+  for (size_t i = 0; i < 2 * BENCH_ROUNDS; i++) {
+    bench_wait_turn(1);
+    bench_pass_turn(0);
+  }
+
+  sched_suspend_thread(sched_curr());
+}
+
+static void bench_ping() {
+  for (bool direct : {true, false}) {
+    direct_switch = direct;
+
+    auto start = Hal::get_monotonic_ns();
+
+    for (size_t i = 0; i < BENCH_ROUNDS; i++) {
+      bench_pass_turn(1);
+      bench_wait_turn(0);
+    }
+
+    auto elapsed = Hal::get_monotonic_ns() - start;
+
+    log("sched bench: {} ns per round trip {}", elapsed / BENCH_ROUNDS,
+        direct ? "with direct switches" : "through the tick");
+  }
+
+  direct_switch = true;
+  sched_suspend_thread(sched_curr());
+}
+
+Result<Void, Error> sched_benchmark() {
+  auto ping = TRY(sched_new_worker_thread("sched bench ping",
+                                          (uintptr_t)bench_ping, false));
+  auto pong = TRY(sched_new_worker_thread("sched bench pong",
+                                          (uintptr_t)bench_pong, false));
+
+  auto ipl = iplx(Ipl::HIGH);
+  enqueue_on(cpu_self(), ping, true);
+  enqueue_on(cpu_self(), pong, true);
+  iplx(ipl);
+
+  return Ok({});
+}
+
+#endif
+
 } // namespace Gaia
@@ -2,6 +2,7 @@
 #pragma once
 #include "frg/spinlock.hpp"
 #include "kernel/cpu.hpp"
+#include <frg/pairing_heap.hpp>
 #include <fs/vfs.hpp>
 #include <hal/int.hpp>
 #include <hal/mmu.hpp>
@@ -13,18 +14,78 @@
 // FIXME: Find an architecture-independent way of doing this
 #include <amd64/idt.hpp>
 
+// Run a context switch benchmark at boot, see sched_benchmark
+#define SCHED_BENCHMARK 0
+
 namespace Gaia {
 
-constexpr auto TIME_SLICE = 5;
+/// Period (in ms) in which every runnable thread of a CPU should get to run,
+/// it is split between them according to their weight
+constexpr auto SCHED_LATENCY = 20;
+
+/// Shortest slice (in ms) a thread gets before being preempted by the tick
+constexpr auto TIME_SLICE = 4;
+
+constexpr int NICE_MIN = -20;
+constexpr int NICE_MAX = 19;
+
+/// Values match Linux's, so that they can be passed as is to userspace
+enum class SchedPolicy {
+  OTHER = 0,
+  FIFO = 1,  ///< Real-time, runs until it blocks, yields or is preempted
+  RR = 2,    ///< Real-time, takes turns with threads of the same priority
+  BATCH = 3, ///< Never preempts on wakeup
+  IDLE = 5,  ///< Only runs when nothing else wants to
+};
+
+/// Real-time priorities go from 1 to RT_PRIO_MAX, higher runs first. Any
+/// real-time thread runs before every other thread.
+constexpr int RT_PRIO_MAX = 99;
+
+/// How long (in ms) a SCHED_RR thread runs before letting the next one of its
+/// priority run
+constexpr auto RR_TIME_SLICE = 100;
+
+/// Number of buckets in the wakeup latency histogram, bucket i counts the
+/// wakeups handled in less than 2^i us (the last one counts the rest)
+constexpr size_t LATENCY_BUCKETS = 16;
+
+/// What a thread is doing, the CPU time it uses is charged accordingly
+enum class CpuMode : uint8_t {
+  USER,
+  SYSTEM, ///< In a syscall, a fault, or a kernel thread
+  IRQ,    ///< Handling an interrupt that came while it ran
+};
+
+/// CPU time in ns
+struct CpuTimes {
+  uint64_t user = 0;
+  uint64_t system = 0;
+  uint64_t irq = 0;
+
+  CpuTimes &operator+=(const CpuTimes &other) {
+    user += other.user;
+    system += other.system;
+    irq += other.irq;
+    return *this;
+  }
+
+  uint64_t total() const { return user + system + irq; }
+};
 
 struct Task;
 
 struct Waitq;
 
+struct Timer;
+
+struct FutexWaiter;
+
 enum class WaitResult {
   WAITING,
   SUCCESS,
   FAILED,
+  TIMED_OUT,
 };
 
 struct Thread {
@@ -39,23 +100,90 @@ struct Thread {
   Vm::String name;
 
   Task *task;
+  pid_t tid; // The first thread of a task has the task's pid
+  bool owns_tid = false; // The tid was allocated for it, freed with it
+
+  // Cleared and woken up (as a futex) when the thread exits
+  pid_t *clear_child_tid = nullptr;
 
   Vm::Vector<Task> children;
 
-  ListNode<Thread> link; // Scheduler queue
+  frg::pairing_heap_hook<Thread> sched_hook; // Scheduler queue
+  ListNode<Thread> rt_link;                  // Real-time scheduler queue
+  ListNode<Thread> death_link;               // Reaper queue
+  ListNode<Thread> tid_link;                 // Tid hash, until it dies
+
+  // Fair scheduling, vruntime is the time the thread ran (in ns), scaled by
+  // the inverse of its weight. The thread with the lowest one runs next.
+  uint64_t vruntime = 0;
+  uint64_t exec_start = 0;  // Last time vruntime was updated
+  uint64_t slice_start = 0; // When the thread got the CPU
+  SchedPolicy policy = SchedPolicy::OTHER;
+  int nice = 0;
+  uint32_t weight = 1024;
+  int rt_priority = 0;
+
+  // Real-time threads that get preempted stay at the head of their queue,
+  // unless they gave up the CPU themselves or used their RR slice
+  bool yielded = false;
+
+  // When a real-time thread was woken up, to measure its wakeup latency
+  uint64_t wake_time = 0;
 
   bool in_fault = false;
 
+  // Set while a CPU runs the thread or still is on its stack, a thread can't be
+  // picked by another CPU (or freed) before this is cleared
+  bool on_cpu = false;
+
+  // Set while the thread is in a run queue, protected by that queue's lock
+  bool queued = false;
+
+  // CPUs the thread may run on, bit n is CPU n
+  uint64_t affinity = ~0ull;
+
+  // CPU time it used, only the CPU running it updates this
+  CpuTimes times;
+  uint64_t acct_start = 0; // Last time it was charged
+  CpuMode cpu_mode = CpuMode::SYSTEM;
+
+  // CPUs that may still cache a translation it changed, see
+  // Hal::Vm::flush_stale
+  uint64_t tlb_stale = 0;
+
   frg::simple_spinlock lock;
 
+  // What it sleeps on, which may be on its stack. The first four change under
+  // the waitq's lock, waitq is cleared once it leaves the queue. futex_waiter
+  // changes under its futex bucket's lock.
   ListNode<Thread> wait_link;
   Waitq *waitq = nullptr;
   WaitResult wait_res;
+  Timer *wait_timer = nullptr; // Armed while in a timed wait
+  FutexWaiter *futex_waiter = nullptr;
 
   ~Thread();
 };
 
-pid_t sched_allocate_pid();
+/// Per-CPU scheduler counters, exported through /dev/schedstat
+struct SchedStats {
+  size_t nr_queued;          ///< Threads waiting in the run queue
+  uint64_t switches;         ///< Context switches
+  uint64_t steals;           ///< Threads stolen while idle
+  uint64_t balanced;         ///< Threads pulled by periodic balancing
+  uint64_t wakeups_migrated; ///< Wakeups moved to the waker's CPU
+  uint64_t load;             ///< Sum of the weights of queued threads
+  uint64_t preemptions;      ///< Threads that got preempted on wakeup
+  uint64_t idle_ns;          ///< Time spent in the idle loop
+  uint64_t ipis_avoided;     ///< Kicks that only took a write, see idle_poll
+
+  /// Time between a real-time thread being woken up and it running
+  uint64_t rt_latency[LATENCY_BUCKETS];
+};
+
+/// Take the next free pid, pids are recycled once their task is freed
+Result<pid_t, Error> sched_allocate_pid();
+void sched_free_pid(pid_t pid);
 
 Result<Thread *, Error> sched_new_thread(frg::string_view name, Task *task,
                                          Hal::CpuContext ctx, bool insert);
@@ -64,10 +192,19 @@ Result<Task *, Error> sched_new_task(pid_t pid, Task *parent, bool user);
 
 void sched_tick(Hal::InterruptFrame *frame);
 
+/// Give up the CPU, the thread is put back in the queue if it is still
+/// runnable
 void sched_yield();
 
 Result<Void, Error> sched_init();
 
+/// Create the idle thread of the calling CPU and make it the current thread
+Result<Void, Error> sched_init_cpu();
+
+/// Called once the CPU switched to the new thread's context, on a stack that
+/// isn't the previous thread's
+void sched_finish_switch();
+
 Thread *sched_curr();
 
 void sched_enqueue_thread(Thread *thread);
@@ -80,6 +217,44 @@ void sched_wake_thread(Thread *thread);
 
 void sched_send_to_death(Thread *thread);
 
+/// Kill every thread of the task but the current one, and wait for them to
+/// be off their CPU. The task must have been claimed by sched_begin_exit or
+/// sched_begin_exec.
+void sched_stop_other_threads(Task *task);
+
+/// Claim the task for an exec, returns false if another thread is exiting or
+/// exec'ing: the current thread is one of those it stops then, and has to die
+bool sched_begin_exec(Task *task);
+
+/// Terminate the current thread, and its task if it was the last thread
+[[noreturn]] void sched_exit_thread(int status);
+
+/**
+ * @brief Terminate every thread of a task and free it
+ *
+ * @param task The task to terminate, if it is the current task this function
+ * does not return
+ * @param status The wait status reported to the parent
+ */
+void sched_exit_task(Task *task, int status);
+
+/**
+ * @brief sched_exit_task in two steps, for callers that pick the task with a
+ * lock held: once sched_begin_exit succeeded, the task can't go away until
+ * sched_finish_exit tears it down
+ *
+ * @return false if the task was already exiting, it must be left alone then
+ */
+bool sched_begin_exit(Task *task, int status);
+
+void sched_finish_exit(Task *task);
+
+/// Allocate a kernel stack of KERNEL_STACK_SIZE bytes, returns its top
+Result<uintptr_t, Error> sched_alloc_kernel_stack();
+
+/// Give back a kernel stack, it is kept around for new threads
+void sched_free_kernel_stack(uintptr_t top);
+
 Result<Thread *, Error> sched_new_worker_thread(frg::string_view name,
                                                 uintptr_t entry_point,
                                                 bool insert = true);
@@ -88,4 +263,48 @@ Task *sched_kernel_task();
 
 void sched_register_cpu(Cpu *cpu);
 
+/// Make a CPU go through the scheduler, which re-arms its tick
+void sched_kick_cpu(Cpu *cpu);
+
+SchedStats sched_stats(size_t cpu);
+
+/**
+ * @brief Change the scheduling policy and priority of a thread
+ *
+ * @param nice Clamped to [NICE_MIN, NICE_MAX]
+ * @param rt_priority Only used by real-time policies, clamped to
+ * [1, RT_PRIO_MAX]
+ */
+void sched_set_priority(Thread *thread, SchedPolicy policy, int nice,
+                        int rt_priority);
+
+/// Restrict a thread to the CPUs in `mask`, bit n being CPU n. It is moved off
+/// its CPU if that one isn't in the mask anymore.
+/// @return Error::INVALID_PARAMETERS if no online CPU is in the mask
+Result<Void, Error> sched_set_affinity(Thread *thread, uint64_t mask);
+
+/// The online CPUs a thread may run on
+uint64_t sched_get_affinity(Thread *thread);
+
+/**
+ * @brief Charge the current thread for the CPU time since it was last charged
+ *
+ * Called on every syscall and interrupt entry and exit, switches charge the
+ * previous thread as well.
+ *
+ * @param from What the thread was doing until now
+ * @param to What it is doing from now on
+ */
+void sched_account(CpuMode from, CpuMode to);
+
+/// Create /dev/schedstat
+void sched_create_stat_dev();
+
+#if SCHED_BENCHMARK
+/// Two threads take turns waking each other up, once with voluntary switches
+/// going straight to the next thread and once through the tick, and log the
+/// average round trip
+Result<Void, Error> sched_benchmark();
+#endif
+
 } // namespace Gaia
@@ -0,0 +1,94 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+#include <frg/formatting.hpp>
+#include <fs/devfs.hpp>
+#include <fs/vfs.hpp>
+#include <kernel/cpu.hpp>
+#include <kernel/sched.hpp>
+#include <sys/stat.h>
+
+namespace Gaia {
+
+// Read-only text device, one line of counters per CPU
+class SchedStatDev : public Fs::DeviceOps {
+public:
+  Result<size_t, Error> read(dev_t minor, frg::span<uint8_t> buf,
+                             off_t off) override {
+    (void)minor;
+
+    Vm::String text = "cpu queued load switches steals balanced "
+                      "wakeups_migrated preemptions idle_us ipis_avoided\n";
+
+    for (size_t i = 0; i < cpu_count(); i++) {
+      auto stats = sched_stats(i);
+
+      frg::output_to(text) << frg::fmt(
+          "{} {} {} {} {} {} {} {} {} {}\n", i, stats.nr_queued, stats.load,
+          stats.switches, stats.steals, stats.balanced, stats.wakeups_migrated,
+          stats.preemptions, stats.idle_ns / 1000, stats.ipis_avoided);
+    }
+
+    // Real-time wakeup latency histogram, one column per bucket
+    frg::output_to(text) << frg::fmt("\nrt wakeup latency (us)\ncpu");
+
+    for (size_t b = 0; b < LATENCY_BUCKETS - 1; b++) {
+      frg::output_to(text) << frg::fmt(" <{}", 1ull << b);
+    }
+
+    frg::output_to(text) << frg::fmt(" >={}\n", 1ull << (LATENCY_BUCKETS - 2));
+
+    for (size_t i = 0; i < cpu_count(); i++) {
+      auto stats = sched_stats(i);
+
+      frg::output_to(text) << frg::fmt("{}", i);
+
+      for (auto count : stats.rt_latency) {
+        frg::output_to(text) << frg::fmt(" {}", count);
+      }
+
+      frg::output_to(text) << frg::fmt("\n");
+    }
+
+    if ((size_t)off >= text.size())
+      return Ok((size_t)0);
+
+    size_t left = text.size() - off;
+    auto count = buf.size() < left ? buf.size() : left;
+    memcpy(buf.data(), text.data() + off, count);
+
+    return Ok(count);
+  }
+
+  Result<size_t, Error> write(dev_t minor, frg::span<uint8_t> buf,
+                              off_t off) override {
+    (void)minor;
+    (void)buf;
+    (void)off;
+    return Err(Error::INVALID_FILE);
+  }
+
+  Result<uint64_t, Error> ioctl(dev_t minor, uint64_t request,
+                                void *arg) override {
+    (void)minor;
+    (void)request;
+    (void)arg;
+    return Err(Error::INVALID_PARAMETERS);
+  }
+
+  Result<Fs::VnodeAttr, Error> getattr(dev_t minor) override {
+    (void)minor;
+    auto ret = Fs::VnodeAttr{};
+
+    ret.mode = S_IFCHR;
+
+    return Ok(ret);
+  }
+};
+
+void sched_create_stat_dev() {
+  auto maj = Fs::dev_alloc_major(new SchedStatDev).unwrap();
+
+  Fs::vfs_find_and("/dev/schedstat", MAKEDEV(maj, 0), Fs::vfs_create_file)
+      .unwrap();
+}
+
+} // namespace Gaia
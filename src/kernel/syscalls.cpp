@@ -3,6 +3,8 @@
 #include "fs/vfs.hpp"
 #include "hal/hal.hpp"
 #include "kernel/elf.hpp"
+#include "kernel/futex.hpp"
+#include "kernel/ipl.hpp"
 #include "kernel/main.hpp"
 #include "kernel/timer.hpp"
 #include "posix/fd.hpp"
@@ -17,7 +19,13 @@
 #include <time.h>
 #define HAVE_ARCH_STRUCT_FLOCK
 #include <kernel/task.hpp>
+#include <kernel/trace.hpp>
 #include <linux/fcntl.h>
+#include <linux/futex.h>
+#include <linux/resource.h>
+#include <linux/sched.h>
+#include <linux/times.h>
+#include <linux/wait.h>
 #include <posix/errno.hpp>
 #include <sys/syscall.h>
 #include <unistd.h>
@@ -68,14 +76,53 @@ StraceDef get_strace_def(uint64_t num) {
   case SYS_newfstatat:
     return {"newfstatat", 4};
   case SYS_exit:
+    return {"exit", 1};
   case SYS_exit_group:
     return {"exit_group", 1};
+  case SYS_gettid:
+    return {"gettid", 0};
+  case SYS_set_tid_address:
+    return {"set_tid_address", 1};
   case SYS_fcntl:
     return {"fcntl", 3};
   case SYS_dup3:
     return {"dup3", 3};
   case SYS_clock_gettime:
     return {"clock_gettime", 2};
+  case SYS_clock_getres:
+    return {"clock_getres", 2};
+  case SYS_nanosleep:
+    return {"nanosleep", 2};
+  case SYS_getrusage:
+    return {"getrusage", 2};
+  case SYS_times:
+    return {"times", 1};
+  case SYS_setpriority:
+    return {"setpriority", 3};
+  case SYS_getpriority:
+    return {"getpriority", 2};
+  case SYS_sched_setattr:
+    return {"sched_setattr", 3};
+  case SYS_sched_getattr:
+    return {"sched_getattr", 4};
+  case SYS_sched_setscheduler:
+    return {"sched_setscheduler", 3};
+  case SYS_sched_getscheduler:
+    return {"sched_getscheduler", 1};
+  case SYS_sched_setparam:
+    return {"sched_setparam", 2};
+  case SYS_sched_getparam:
+    return {"sched_getparam", 2};
+  case SYS_sched_get_priority_max:
+    return {"sched_get_priority_max", 1};
+  case SYS_sched_get_priority_min:
+    return {"sched_get_priority_min", 1};
+  case SYS_sched_setaffinity:
+    return {"sched_setaffinity", 3};
+  case SYS_sched_getaffinity:
+    return {"sched_getaffinity", 3};
+  case SYS_futex:
+    return {"futex", 6};
   default:
     error("Unimplemented strace for {}", num);
     break;
@@ -297,19 +344,7 @@ uint64_t sys_getcwd(SyscallParams params) {
 }
 
 uint64_t sys_exit_group(SyscallParams params) {
-
-  auto curr_thread = sched_curr();
-
-  curr_thread->state = Thread::EXITED;
-  curr_thread->task->has_exited = true;
-  curr_thread->task->exit_code = (int)params.param1;
-
-  curr_thread->task->parent->trigger_event().unwrap();
-
-  Hal::disable_interrupts();
-  delete curr_thread->task;
-  sched_dequeue_and_die();
-  Hal::enable_interrupts();
+  sched_exit_task(sched_curr()->task, task_exit_status((int)params.param1));
 
   return 0;
 }
@@ -347,15 +382,40 @@ uint64_t sys_execve(SyscallParams params) {
   sanitized_envp.push(nullptr);
 
   auto prev_space = task->space;
+  auto space_res = Vm::Space::create("task space", true);
 
-  task->space = new Vm::Space("task space", true);
+  if (space_res.is_err())
+    return -ENOMEM;
 
-  for (auto thread : task->threads) {
-    sched_send_to_death(thread);
+  auto space = space_res.unwrap();
+
+  // Another thread is exiting or exec'ing, and stopping us
+  if (!sched_begin_exec(task)) {
+    space->release();
+    delete space;
+    sched_dequeue_and_die();
   }
 
+  // Our other threads go away with the old image
+  sched_stop_other_threads(task);
+
+  task->space = space;
+
+  // We're the last thread left, the new image starts on a fresh one and the
+  // task keeps our times
+  sched_account(CpuMode::SYSTEM, CpuMode::SYSTEM);
+
+  auto ipl = iplx(Ipl::HIGH);
+  task->lock.lock();
+
+  task->exited_times += sched_curr()->times;
   task->threads.clear();
 
+  task->lock.unlock();
+  iplx(ipl);
+
+  sched_send_to_death(sched_curr());
+
   auto exec_ret =
       execve(*task, filename, sanitized_argv.data(), sanitized_envp.data());
 
@@ -388,16 +448,120 @@ uint64_t sys_execve(SyscallParams params) {
   return 0;
 }
 
+// Create a thread in `task` that returns from the syscall with the same
+// registers as the current one, on `stack` if it is set
+static Result<Thread *, Error> clone_thread(Task *task, SyscallParams params,
+                                            uint64_t flags, uintptr_t stack,
+                                            uintptr_t tls) {
+  auto new_ctx = sched_curr()->ctx;
+
+  auto kernel_stack = TRY(sched_alloc_kernel_stack());
+  auto fpu_regs = Amd64::simd_alloc_area();
+
+  if (fpu_regs.is_err()) {
+    sched_free_kernel_stack(kernel_stack);
+    return Err(Error::OUT_OF_MEMORY);
+  }
+
+  new_ctx.info.syscall_kernel_stack = kernel_stack;
+  new_ctx.fpu_regs = fpu_regs.unwrap();
+
+  // Our SIMD state may only be in the registers, don't get switched out
+  // halfway through
+  auto ipl = iplx(Ipl::HIGH);
+  sched_curr()->ctx.copy_fpu(new_ctx.fpu_regs);
+  iplx(ipl);
+
+  new_ctx.regs = *params.frame;
+  new_ctx.regs.rax = 0;
+
+  if (stack)
+    new_ctx.regs.rsp = stack;
+
+  // Our saved context is only updated when we get switched away from
+  new_ctx.fs_base =
+      flags & CLONE_SETTLS ? (void *)tls : Amd64::get_fs_base();
+
+  auto thread_res = sched_new_thread(flags & CLONE_THREAD ? "thread"
+                                                          : "forked thread",
+                                     task, new_ctx, false);
+
+  if (thread_res.is_err()) {
+    sched_free_kernel_stack(kernel_stack);
+    Amd64::simd_free_area(fpu_regs.unwrap());
+    return Err(thread_res.error().value());
+  }
+
+  // The child inherits our scheduling parameters and affinity
+  auto thread = thread_res.unwrap();
+  sched_set_priority(thread, sched_curr()->policy, sched_curr()->nice,
+                     sched_curr()->rt_priority);
+  thread->affinity = sched_curr()->affinity;
+
+  return Ok(thread);
+}
+
 uint64_t sys_clone(SyscallParams params) {
-  // TODO: actually not ignore the parameters
-  (void)params;
+  uint64_t flags = params.param1;
+  auto stack = params.param2;
+  auto parent_tid = (pid_t *)params.param3;
+  auto child_tid = (pid_t *)params.param4;
+  auto tls = params.param5;
 
   auto curr_task = sched_curr()->task;
 
-  auto new_task =
-      sched_new_task(sched_allocate_pid(), curr_task, true).unwrap();
+  // A new thread of our task, sharing everything with us
+  if (flags & CLONE_THREAD) {
+    if (!(flags & CLONE_VM))
+      return -EINVAL;
+
+    auto thread_res = clone_thread(curr_task, params, flags, stack, tls);
 
-  curr_task->space->copy(new_task->space);
+    if (thread_res.is_err())
+      return thread_res.error().value() == Error::OUT_OF_MEMORY ? -ENOMEM
+                                                                : -EAGAIN;
+
+    auto thread = thread_res.unwrap();
+
+    if (flags & CLONE_PARENT_SETTID)
+      *parent_tid = thread->tid;
+
+    if (flags & CLONE_CHILD_SETTID)
+      *child_tid = thread->tid;
+
+    if (flags & CLONE_CHILD_CLEARTID)
+      thread->clear_child_tid = child_tid;
+
+    sched_enqueue_thread(thread);
+
+    return thread->tid;
+  }
+
+  // Otherwise, a new task with a copy of our space. CLONE_VM without
+  // CLONE_THREAD (vfork) gets a copy too, which is slower but behaves the same
+  // for a child that execs right away.
+  auto pid = sched_allocate_pid();
+
+  if (pid.is_err())
+    return -EAGAIN;
+
+  auto task_res = sched_new_task(pid.unwrap(), curr_task, true);
+
+  if (task_res.is_err()) {
+    sched_free_pid(pid.unwrap());
+    return -ENOMEM;
+  }
+
+  auto new_task = task_res.unwrap();
+
+  // The task has no thread yet, so it can be freed like any other
+  auto abort = [&]() {
+    delete new_task;
+    return -ENOMEM;
+  };
+
+  if (curr_task->space->copy(new_task->space).is_err())
+    return abort();
 
   size_t i = 0;
   for (auto fd : curr_task->fds.data()) {
@@ -406,51 +570,106 @@ uint64_t sys_clone(SyscallParams params) {
     i++;
   }
 
-  auto new_ctx = sched_curr()->ctx;
+  auto thread_res = clone_thread(new_task, params, flags, stack, tls);
 
-  new_ctx.info.syscall_kernel_stack =
-      (uintptr_t)Vm::vm_kernel_alloc(KERNEL_STACK_SIZE / Hal::PAGE_SIZE) +
-      KERNEL_STACK_SIZE;
+  if (thread_res.is_err())
+    return abort();
 
-  new_ctx.fpu_regs =
-      (void *)Hal::phys_to_virt((uintptr_t)Vm::phys_alloc(true).unwrap());
+  auto thread = thread_res.unwrap();
 
-  new_ctx.regs = *params.frame;
-  new_ctx.regs.rax = 0;
+  if (flags & CLONE_PARENT_SETTID)
+    *parent_tid = thread->tid;
+
+  // The child has its own copy of the page
+  if (flags & CLONE_CHILD_SETTID)
+    (void)new_task->space->write((uintptr_t)child_tid, &thread->tid,
+                                 sizeof(pid_t));
+
+  if (flags & CLONE_CHILD_CLEARTID)
+    thread->clear_child_tid = child_tid;
 
-  sched_new_thread("forked thread", new_task, new_ctx, true);
+  sched_enqueue_thread(thread);
 
   return new_task->pid;
 }
 
-// TODO: add support for rusage
+uint64_t sys_exit(SyscallParams params) {
+  sched_exit_thread(task_exit_status((int)params.param1));
+}
+
+uint64_t sys_gettid(SyscallParams params) {
+  (void)params;
+  return sched_curr()->tid;
+}
+
+uint64_t sys_set_tid_address(SyscallParams params) {
+  sched_curr()->clear_child_tid = (pid_t *)params.param1;
+  return sched_curr()->tid;
+}
+
+static constexpr uint64_t NS_PER_SEC = 1000000000;
+
+// Clock ticks reported by times(), USER_HZ on Linux
+static constexpr uint64_t NS_PER_TICK = NS_PER_SEC / 100;
+
+static void fill_rusage(struct rusage *usage, CpuTimes times,
+                        uint64_t min_faults) {
+  // Interrupts count as system time of the thread they interrupted
+  auto system = times.system + times.irq;
+
+  *usage = {};
+
+  usage->ru_utime.tv_sec = times.user / NS_PER_SEC;
+  usage->ru_utime.tv_usec = times.user % NS_PER_SEC / 1000;
+  usage->ru_stime.tv_sec = system / NS_PER_SEC;
+  usage->ru_stime.tv_usec = system % NS_PER_SEC / 1000;
+
+  // Pages are never read back from disk, every fault is a minor one
+  usage->ru_minflt = min_faults;
+}
+
 uint64_t sys_wait4(SyscallParams params) {
   pid_t upid = params.param1;
   int *status = (int *)params.param2;
   int flags = params.param3;
+  struct rusage *usage = (struct rusage *)params.param4;
 
-  (void)flags;
+  // Tasks can't be stopped or continued, WUNTRACED and WCONTINUED are
+  // accepted but never report anything
+  if (flags & ~(WNOHANG | WUNTRACED | WCONTINUED | __WNOTHREAD | __WCLONE |
+                __WALL))
+    return -EINVAL;
 
-  auto curr_task = sched_curr()->task;
+  // There are no process groups yet, the caller's has all its children
+  if (upid == 0)
+    upid = -1;
+  else if (upid < -1)
+    return -ECHILD;
 
-  while (true) {
-    for (auto child : curr_task->children) {
-      if (child->has_exited) {
-        if (upid != -1 && child->pid != upid)
-          continue;
+  auto res = sched_reap_child(sched_curr()->task, upid, flags & WNOHANG);
 
-        curr_task->children.remove(child);
-        *status = child->exit_code;
-        return child->pid;
-      }
-    }
+  if (res.is_err())
+    return res.error().value() == Error::NOT_FOUND ? -ECHILD : -EINTR;
+
+  auto child = res.unwrap();
+
+  if (!child)
+    return 0;
+
+  pid_t pid = child->pid;
 
-    curr_task->await_event(-1).unwrap();
+  if (status)
+    *status = child->exit_code;
+
+  if (usage) {
+    auto times = child->exited_times;
+    times += child->child_times;
+    fill_rusage(usage, times, child->min_faults + child->child_min_faults);
   }
 
-  ASSERT(false);
+  delete child;
 
-  return -1;
+  return pid;
 }
 
 uint64_t sys_newfstatat(SyscallParams params) {
@@ -676,40 +895,522 @@ uint64_t sys_clock_gettime(SyscallParams params) {
   auto which = params.param1;
   struct timespec *tp = (struct timespec *)params.param2;
 
-  if (which == 0) {
-    tp->tv_sec = charon().boot_time + Hal::get_time_since_boot().seconds;
-    tp->tv_nsec = Hal::get_time_since_boot().milliseconds * 1000000;
+  uint64_t ns = Hal::get_monotonic_ns();
+
+  switch (which) {
+  case CLOCK_REALTIME:
+  case CLOCK_REALTIME_COARSE:
+    ns += charon().boot_time * NS_PER_SEC;
+    break;
+  case CLOCK_MONOTONIC:
+  case CLOCK_MONOTONIC_RAW:
+  case CLOCK_MONOTONIC_COARSE:
+  case CLOCK_BOOTTIME:
+    break;
+  case CLOCK_PROCESS_CPUTIME_ID:
+    ns = sched_task_times(sched_curr()->task).total();
+    break;
+  case CLOCK_THREAD_CPUTIME_ID:
+    sched_account(CpuMode::SYSTEM, CpuMode::SYSTEM);
+    ns = sched_curr()->times.total();
+    break;
+  default:
+    return -EINVAL;
+  }
+
+  tp->tv_sec = ns / NS_PER_SEC;
+  tp->tv_nsec = ns % NS_PER_SEC;
+
+  return 0;
+}
+
+uint64_t sys_clock_getres(SyscallParams params) {
+  auto which = params.param1;
+  struct timespec *res = (struct timespec *)params.param2;
+
+  switch (which) {
+  case CLOCK_REALTIME:
+  case CLOCK_REALTIME_COARSE:
+  case CLOCK_MONOTONIC:
+  case CLOCK_MONOTONIC_RAW:
+  case CLOCK_MONOTONIC_COARSE:
+  case CLOCK_BOOTTIME:
+  case CLOCK_PROCESS_CPUTIME_ID:
+  case CLOCK_THREAD_CPUTIME_ID:
+    break;
+  default:
+    return -EINVAL;
+  }
+
+  // Every clock is read from the TSC
+  if (res) {
+    res->tv_sec = 0;
+    res->tv_nsec = 1;
+  }
+
+  return 0;
+}
+
+uint64_t sys_getrusage(SyscallParams params) {
+  int who = params.param1;
+  struct rusage *usage = (struct rusage *)params.param2;
+  auto curr = sched_curr();
+
+  switch (who) {
+  case RUSAGE_SELF:
+    fill_rusage(usage, sched_task_times(curr->task),
+                __atomic_load_n(&curr->task->min_faults, __ATOMIC_RELAXED));
+    break;
+  case RUSAGE_CHILDREN: {
+    uint64_t min_faults;
+    auto times = sched_child_times(curr->task, &min_faults);
+    fill_rusage(usage, times, min_faults);
+    break;
+  }
+  case RUSAGE_THREAD:
+    // Faults are only counted per task
+    sched_account(CpuMode::SYSTEM, CpuMode::SYSTEM);
+    fill_rusage(usage, curr->times, 0);
+    break;
+  default:
+    return -EINVAL;
   }
 
   return 0;
 }
 
+uint64_t sys_times(SyscallParams params) {
+  struct tms *buf = (struct tms *)params.param1;
+
+  if (buf) {
+    auto task = sched_curr()->task;
+    auto self = sched_task_times(task);
+    auto children = sched_child_times(task, nullptr);
+
+    buf->tms_utime = self.user / NS_PER_TICK;
+    buf->tms_stime = (self.system + self.irq) / NS_PER_TICK;
+    buf->tms_cutime = children.user / NS_PER_TICK;
+    buf->tms_cstime = (children.system + children.irq) / NS_PER_TICK;
+  }
+
+  return Hal::get_monotonic_ns() / NS_PER_TICK;
+}
+
 uint64_t sys_nanosleep(SyscallParams params) {
   struct timespec *rqtp = (struct timespec *)params.param1;
   struct timespec *rmtp = (struct timespec *)params.param2;
 
-  auto timer =
-      new Timer(nullptr, rqtp->tv_sec * 1000 + rqtp->tv_nsec / 1000000);
+  if (rqtp->tv_sec < 0 || rqtp->tv_nsec < 0 ||
+      (uint64_t)rqtp->tv_nsec >= NS_PER_SEC)
+    return -EINVAL;
 
-  timer_enqueue(timer);
+  Timer timer(nullptr, rqtp->tv_sec * NS_PER_SEC + rqtp->tv_nsec);
 
-  timer->await_event(-1).unwrap();
+  timer_enqueue(&timer).unwrap();
 
-  delete timer;
+  timer.await_event(-1).unwrap();
 
-  rmtp->tv_nsec = 0;
-  rmtp->tv_sec = 0;
+  if (rmtp) {
+    rmtp->tv_nsec = 0;
+    rmtp->tv_sec = 0;
+  }
 
   return 0;
 }
 
+static uint64_t futex_errno(Error error) {
+  switch (error) {
+  case Error::WOULD_BLOCK:
+    return -EAGAIN;
+  case Error::TIMED_OUT:
+    return -ETIMEDOUT;
+  case Error::INVALID_PARAMETERS:
+    return -EINVAL;
+  default:
+    return -EFAULT;
+  }
+}
+
+uint64_t sys_futex(SyscallParams params) {
+  auto address = (uint32_t *)params.param1;
+  int op = params.param2 & FUTEX_CMD_MASK;
+  bool shared = !(params.param2 & FUTEX_PRIVATE_FLAG);
+  bool realtime = params.param2 & FUTEX_CLOCK_REALTIME;
+  uint32_t val = params.param3;
+  struct timespec *ts = (struct timespec *)params.param4;
+  uint32_t val2 = params.param4;
+  auto target = (uint32_t *)params.param5;
+  uint32_t val3 = params.param6;
+
+  switch (op) {
+  case FUTEX_WAIT:
+  case FUTEX_WAIT_BITSET: {
+    uint64_t timeout = -1;
+
+    if (ts) {
+      if (ts->tv_sec < 0 || ts->tv_nsec < 0 ||
+          (uint64_t)ts->tv_nsec >= NS_PER_SEC)
+        return -EINVAL;
+
+      timeout = ts->tv_sec * NS_PER_SEC + ts->tv_nsec;
+
+      // FUTEX_WAIT_BITSET takes a deadline, FUTEX_WAIT a duration
+      if (op == FUTEX_WAIT_BITSET) {
+        uint64_t now = Hal::get_monotonic_ns();
+
+        if (realtime)
+          now += charon().boot_time * NS_PER_SEC;
+
+        timeout = timeout > now ? timeout - now : 0;
+      }
+
+      // A zero timeout would mean no timeout at all
+      timeout = MAX(timeout, (uint64_t)1);
+    }
+
+    auto bitset = op == FUTEX_WAIT ? FUTEX_BITSET_MATCH_ANY : val3;
+    auto ret = futex_wait(address, val, bitset, timeout, shared);
+
+    return ret.is_ok() ? 0 : futex_errno(ret.error().value());
+  }
+  case FUTEX_WAKE:
+  case FUTEX_WAKE_BITSET: {
+    auto bitset = op == FUTEX_WAKE ? FUTEX_BITSET_MATCH_ANY : val3;
+    auto ret = futex_wake(address, val, bitset, shared);
+
+    return ret.is_ok() ? ret.unwrap() : futex_errno(ret.error().value());
+  }
+  case FUTEX_REQUEUE:
+  case FUTEX_CMP_REQUEUE: {
+    frg::optional<uint32_t> expected;
+
+    if (op == FUTEX_CMP_REQUEUE)
+      expected = val3;
+
+    auto ret = futex_requeue(address, val, target, val2, expected, shared);
+
+    return ret.is_ok() ? ret.unwrap() : futex_errno(ret.error().value());
+  }
+  default:
+    return -ENOSYS;
+  }
+}
+
+// Layout of Linux's struct sched_attr (SCHED_ATTR_SIZE_VER0)
+struct SchedAttr {
+  uint32_t size;
+  uint32_t sched_policy;
+  uint64_t sched_flags;
+  int32_t sched_nice;
+  uint32_t sched_priority;
+  uint64_t sched_runtime;
+  uint64_t sched_deadline;
+  uint64_t sched_period;
+};
+
+struct SchedParam {
+  int sched_priority;
+};
+
+// Returned locked, it can't exit until unlocked. Must be called at Ipl::HIGH.
+static Task *find_sched_target(pid_t pid) {
+  if (pid != 0)
+    return sched_lock_task(pid);
+
+  auto task = sched_curr()->task;
+
+  task->lock.lock();
+
+  if (task->has_exited) {
+    task->lock.unlock();
+    return nullptr;
+  }
+
+  return task;
+}
+
+// Call `fn` with the task `pid` refers to, locked. It must not touch user
+// memory. Unlike Linux, where they act on a single thread, the policy, param
+// and priority syscalls apply to the whole process: they take a pid, a tid
+// that isn't one isn't found. Only affinity is per thread.
+template <typename F> static uint64_t with_sched_target(pid_t pid, F fn) {
+  auto ipl = iplx(Ipl::HIGH);
+  auto task = find_sched_target(pid);
+
+  uint64_t ret = task && task->threads.size() ? fn(task) : -ESRCH;
+
+  if (task)
+    task->lock.unlock();
+
+  iplx(ipl);
+
+  return ret;
+}
+
+static bool valid_policy(uint32_t policy, uint32_t priority) {
+  switch ((SchedPolicy)policy) {
+  case SchedPolicy::OTHER:
+  case SchedPolicy::BATCH:
+  case SchedPolicy::IDLE:
+    return priority == 0;
+  case SchedPolicy::FIFO:
+  case SchedPolicy::RR:
+    return priority >= 1 && priority <= RT_PRIO_MAX;
+  default:
+    return false;
+  }
+}
+
+// Every thread of a task shares its scheduling parameters
+static uint64_t set_task_priority(pid_t pid, SchedPolicy policy, int nice,
+                                  int rt_priority) {
+  return with_sched_target(pid, [&](Task *task) {
+    for (auto thread : task->threads) {
+      sched_set_priority(thread, policy, nice, rt_priority);
+    }
+
+    return 0;
+  });
+}
+
+uint64_t sys_setpriority(SyscallParams params) {
+  int which = params.param1;
+  pid_t who = params.param2;
+  int prio = params.param3;
+
+  if (which != PRIO_PROCESS)
+    return -EINVAL;
+
+  return with_sched_target(who, [&](Task *task) {
+    for (auto thread : task->threads) {
+      sched_set_priority(thread, thread->policy, prio, thread->rt_priority);
+    }
+
+    return 0;
+  });
+}
+
+uint64_t sys_getpriority(SyscallParams params) {
+  int which = params.param1;
+  pid_t who = params.param2;
+
+  if (which != PRIO_PROCESS)
+    return -EINVAL;
+
+  // Like Linux, return 20 - nice so that the result is never negative
+  return with_sched_target(
+      who, [&](Task *task) { return 20 - task->threads[0]->nice; });
+}
+
+uint64_t sys_sched_setattr(SyscallParams params) {
+  pid_t pid = params.param1;
+  auto attr = (SchedAttr *)params.param2;
+  auto flags = params.param3;
+
+  if (!attr || flags || attr->size < sizeof(SchedAttr))
+    return -EINVAL;
+
+  if (!valid_policy(attr->sched_policy, attr->sched_priority))
+    return -EINVAL;
+
+  return set_task_priority(pid, (SchedPolicy)attr->sched_policy,
+                           attr->sched_nice, attr->sched_priority);
+}
+
+uint64_t sys_sched_getattr(SyscallParams params) {
+  pid_t pid = params.param1;
+  auto attr = (SchedAttr *)params.param2;
+  auto size = params.param3;
+  auto flags = params.param4;
+
+  if (!attr || flags || size < sizeof(SchedAttr))
+    return -EINVAL;
+
+  SchedAttr ret = {};
+
+  auto res = with_sched_target(pid, [&](Task *task) {
+    auto thread = task->threads[0];
+
+    ret.size = sizeof(SchedAttr);
+    ret.sched_policy = (uint32_t)thread->policy;
+    ret.sched_nice = thread->nice;
+    ret.sched_priority = thread->rt_priority;
+
+    return 0;
+  });
+
+  if (res == 0)
+    *attr = ret;
+
+  return res;
+}
+
+uint64_t sys_sched_setscheduler(SyscallParams params) {
+  pid_t pid = params.param1;
+  int policy = params.param2;
+  auto param = (SchedParam *)params.param3;
+
+  if (!param)
+    return -EINVAL;
+
+  int priority = param->sched_priority;
+
+  if (policy < 0 || !valid_policy(policy, priority))
+    return -EINVAL;
+
+  return with_sched_target(pid, [&](Task *task) {
+    for (auto thread : task->threads) {
+      sched_set_priority(thread, (SchedPolicy)policy, thread->nice, priority);
+    }
+
+    return 0;
+  });
+}
+
+uint64_t sys_sched_getscheduler(SyscallParams params) {
+  pid_t pid = params.param1;
+
+  return with_sched_target(
+      pid, [&](Task *task) { return (int)task->threads[0]->policy; });
+}
+
+uint64_t sys_sched_setparam(SyscallParams params) {
+  pid_t pid = params.param1;
+  auto param = (SchedParam *)params.param2;
+
+  if (!param)
+    return -EINVAL;
+
+  int priority = param->sched_priority;
+
+  return with_sched_target(pid, [&](Task *task) {
+    auto policy = task->threads[0]->policy;
+
+    if (!valid_policy((uint32_t)policy, priority))
+      return -EINVAL;
+
+    for (auto thread : task->threads) {
+      sched_set_priority(thread, policy, thread->nice, priority);
+    }
+
+    return 0;
+  });
+}
+
+uint64_t sys_sched_getparam(SyscallParams params) {
+  pid_t pid = params.param1;
+  auto param = (SchedParam *)params.param2;
+
+  if (!param)
+    return -EINVAL;
+
+  int priority = 0;
+
+  auto res = with_sched_target(pid, [&](Task *task) {
+    priority = task->threads[0]->rt_priority;
+    return 0;
+  });
+
+  if (res == 0)
+    param->sched_priority = priority;
+
+  return res;
+}
+
+uint64_t sys_sched_get_priority_max(SyscallParams params) {
+  auto policy = (SchedPolicy)params.param1;
+
+  if (policy == SchedPolicy::FIFO || policy == SchedPolicy::RR)
+    return RT_PRIO_MAX;
+
+  return valid_policy((uint32_t)policy, 0) ? 0 : -EINVAL;
+}
+
+uint64_t sys_sched_get_priority_min(SyscallParams params) {
+  auto policy = (SchedPolicy)params.param1;
+
+  if (policy == SchedPolicy::FIFO || policy == SchedPolicy::RR)
+    return 1;
+
+  return valid_policy((uint32_t)policy, 0) ? 0 : -EINVAL;
+}
+
+// Call `fn` with the user thread `tid` refers to, it can't exit while `fn` runs
+// since its task is locked. `fn` mustn't touch user memory.
+template <typename F> static uint64_t with_sched_thread(pid_t tid, F fn) {
+  auto ipl = iplx(Ipl::HIGH);
+  Thread *target = nullptr;
+
+  if (tid == 0) {
+    target = sched_curr();
+    target->task->lock.lock();
+
+    if (target->task->has_exited) {
+      target->task->lock.unlock();
+      target = nullptr;
+    }
+  } else {
+    target = sched_lock_thread(tid);
+  }
+
+  uint64_t ret = target ? fn(target) : -ESRCH;
+
+  if (target)
+    target->task->lock.unlock();
+
+  iplx(ipl);
+
+  return ret;
+}
+
+// Masks are a single word, bit n being CPU n
+uint64_t sys_sched_setaffinity(SyscallParams params) {
+  pid_t tid = params.param1;
+  size_t len = params.param2;
+  auto user_mask = (uint8_t *)params.param3;
+
+  if (!user_mask)
+    return -EINVAL;
+
+  uint64_t mask = 0;
+  memcpy(&mask, user_mask, len < sizeof(mask) ? len : sizeof(mask));
+
+  return with_sched_thread(tid, [&](Thread *thread) -> uint64_t {
+    if (sched_set_affinity(thread, mask).is_err())
+      return -EINVAL;
+
+    return 0;
+  });
+}
+
+uint64_t sys_sched_getaffinity(SyscallParams params) {
+  pid_t tid = params.param1;
+  size_t len = params.param2;
+  auto user_mask = (uint64_t *)params.param3;
+
+  if (!user_mask || len < sizeof(uint64_t) || len % sizeof(uint64_t))
+    return -EINVAL;
+
+  uint64_t mask = 0;
+
+  auto ret = with_sched_thread(tid, [&](Thread *thread) -> uint64_t {
+    mask = sched_get_affinity(thread);
+    return sizeof(uint64_t);
+  });
+
+  if (ret == sizeof(uint64_t))
+    *user_mask = mask;
+
+  return ret;
+}
+
 #if TRACE
 #define DO_TRACE(x) trace((x), num, params)
 #else
 #define DO_TRACE(x) (x)
 #endif
 
-uint64_t syscall(int num, SyscallParams params) {
+static uint64_t dispatch(int num, SyscallParams params) {
   switch (num) {
   case SYS_read:
     return DO_TRACE(sys_read(params));
@@ -726,8 +1427,13 @@ uint64_t syscall(int num, SyscallParams params) {
   case SYS_ioctl:
     return DO_TRACE(sys_ioctl(params));
   case SYS_exit:
+    return DO_TRACE(sys_exit(params));
   case SYS_exit_group:
     return DO_TRACE(sys_exit_group(params));
+  case SYS_gettid:
+    return DO_TRACE(sys_gettid(params));
+  case SYS_set_tid_address:
+    return DO_TRACE(sys_set_tid_address(params));
   case SYS_clone:
     return DO_TRACE(sys_clone(params));
   case SYS_execve:
@@ -752,8 +1458,40 @@ uint64_t syscall(int num, SyscallParams params) {
     return DO_TRACE(sys_getdents64(params));
   case SYS_clock_gettime:
     return DO_TRACE(sys_clock_gettime(params));
+  case SYS_clock_getres:
+    return DO_TRACE(sys_clock_getres(params));
   case SYS_nanosleep:
     return DO_TRACE(sys_nanosleep(params));
+  case SYS_getrusage:
+    return DO_TRACE(sys_getrusage(params));
+  case SYS_times:
+    return DO_TRACE(sys_times(params));
+  case SYS_setpriority:
+    return DO_TRACE(sys_setpriority(params));
+  case SYS_getpriority:
+    return DO_TRACE(sys_getpriority(params));
+  case SYS_sched_setattr:
+    return DO_TRACE(sys_sched_setattr(params));
+  case SYS_sched_getattr:
+    return DO_TRACE(sys_sched_getattr(params));
+  case SYS_sched_setscheduler:
+    return DO_TRACE(sys_sched_setscheduler(params));
+  case SYS_sched_getscheduler:
+    return DO_TRACE(sys_sched_getscheduler(params));
+  case SYS_sched_setparam:
+    return DO_TRACE(sys_sched_setparam(params));
+  case SYS_sched_getparam:
+    return DO_TRACE(sys_sched_getparam(params));
+  case SYS_sched_get_priority_max:
+    return DO_TRACE(sys_sched_get_priority_max(params));
+  case SYS_sched_get_priority_min:
+    return DO_TRACE(sys_sched_get_priority_min(params));
+  case SYS_sched_setaffinity:
+    return DO_TRACE(sys_sched_setaffinity(params));
+  case SYS_sched_getaffinity:
+    return DO_TRACE(sys_sched_getaffinity(params));
+  case SYS_futex:
+    return DO_TRACE(sys_futex(params));
   case SYS_faccessat:
     return 0;
   case SYS_fadvise64:
@@ -772,4 +1510,16 @@ uint64_t syscall(int num, SyscallParams params) {
   }
 }
 
+uint64_t syscall(int num, SyscallParams params) {
+  sched_account(CpuMode::USER, CpuMode::SYSTEM);
+  trace_event(TraceEvent::SYSCALL_ENTER, num, params.param1);
+
+  auto ret = dispatch(num, params);
+
+  trace_event(TraceEvent::SYSCALL_EXIT, num, ret);
+  sched_account(CpuMode::SYSTEM, CpuMode::USER);
+
+  return ret;
+}
+
 } // namespace Gaia
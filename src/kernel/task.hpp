@@ -8,10 +8,21 @@ namespace Gaia {
 struct Task : public Waitable {
   pid_t pid;
 
-  ListNode<Task> link;
+  ListNode<Task> link;      // Link in its parent's children or zombies
+  ListNode<Task> task_link; // Link in the list of all tasks
+  ListNode<Task> pid_link;  // Link in its pid hash bucket
 
   Vm::Vector<Thread *> threads;
+
+  // Protects threads, has_exited and stopping, threads can be created and exit
+  // on several CPUs at once
+  Spinlock lock;
+
+  // Protected by the task tree lock, like parent: children that exited are
+  // moved to zombies, in the order they exited, until they are reaped
   List<Task, &Task::link> children;
+  List<Task, &Task::link> zombies;
+  bool zombie = false;
 
   Fs::Vnode *cwd;
 
@@ -23,7 +34,60 @@ struct Task : public Waitable {
   int exit_code;
   bool has_exited = false;
 
+  // Set while a thread (exiting or exec'ing) stops the others: no thread can
+  // be created, and those that exit leave it to send them to death
+  bool stopping = false;
+
+  // Killed to free memory, see Vm::oom_kill. Set under tasks_lock.
+  bool oom_victim = false;
+
+  // CPU time of its threads that exited, see sched_task_times
+  CpuTimes exited_times;
+  uint64_t min_faults = 0;
+
+  // Usage of the children it reaped, theirs included. Protected by the task
+  // tree lock.
+  CpuTimes child_times;
+  uint64_t child_min_faults = 0;
+
   ~Task();
 };
 
+// Every task alive, walked at Ipl::HIGH with tasks_lock held
+List<Task, &Task::task_link> &sched_tasks();
+
+extern Spinlock tasks_lock;
+
+// O(1) lookup by pid, the task is only valid for as long as it can't be reaped
+Task *sched_find_task(pid_t pid);
+
+// Like sched_find_task, but the task is returned with its lock held, and only
+// if it hasn't exited. It can't be reaped until unlocked. Call at Ipl::HIGH.
+Task *sched_lock_task(pid_t pid);
+
+// The thread `tid` refers to, with its task locked, if neither has exited. Not
+// kernel threads. Call at Ipl::HIGH.
+Thread *sched_lock_thread(pid_t tid);
+
+/**
+ * @brief Reap an exited child of `parent`, waiting for one if needed
+ * @param pid The child to reap, -1 for the one that exited first
+ * @param nohang Return nullptr instead of waiting if none exited yet
+ * @return The child, which the caller deletes, or Error::NOT_FOUND if there is
+ * no such child
+ */
+Result<Task *, Error> sched_reap_child(Task *parent, pid_t pid, bool nohang);
+
+/// CPU time used by every thread of a task, including the ones that exited
+CpuTimes sched_task_times(Task *task);
+
+/// CPU time used by the children a task reaped, and their page faults
+CpuTimes sched_child_times(Task *task, uint64_t *min_faults);
+
+// Wait statuses, as reported by wait4
+constexpr int task_exit_status(int code) { return (code & 0xff) << 8; }
+constexpr int task_signal_status(int signal) { return signal & 0x7f; }
+
+constexpr int TASK_SIGKILL = 9;
+
 } // namespace Gaia
\ No newline at end of file
@@ -1,62 +1,291 @@
-#include <frg/pairing_heap.hpp>
+/* SPDX-License-Identifier: BSD-2-Clause */
+#include <hal/hal.hpp>
 #include <kernel/cpu.hpp>
+#include <kernel/ipl.hpp>
+#include <kernel/sched.hpp>
 #include <kernel/timer.hpp>
+#include <vm/heap.hpp>
 
 namespace Gaia {
 
-struct TimerComp {
-  bool operator()(const Timer *a, const Timer *b) const {
-    return a->deadline > b->deadline;
-  }
+/*
+ * Hierarchical timer wheels, one per CPU.
+ *
+ * Time is counted in ticks of 2^TICK_SHIFT ns (~1 us). Level 0 has a slot per
+ * tick for the next 64 ticks, level 1 a slot per 64 ticks for the next 64^2
+ * ticks, and so on. When the clock reaches the start of an upper slot, its
+ * timers are cascaded down to where they now belong.
+ *
+ * Arming and cancelling a timer is O(1). Bitmaps of the non-empty slots let
+ * us jump over idle periods and tell the scheduler when to arm the tick.
+ *
+ * Expired timers are moved to a list, which a DPC triggers outside of the
+ * wheel lock.
+ */
+
+static constexpr size_t TICK_SHIFT = 10;
+static constexpr size_t WHEEL_BITS = 6;
+static constexpr size_t WHEEL_SLOTS = 1 << WHEEL_BITS;
+static constexpr size_t WHEEL_LEVELS = 6;
+
+// Timers further away than that go in the last level, and are cascaded again
+static constexpr uint64_t WHEEL_SPAN = 1ull << (WHEEL_BITS * WHEEL_LEVELS);
+
+using TimerList = List<Timer, &Timer::link>;
+
+struct TimerWheel {
+  Spinlock lock;
+  uint64_t clock; // Tick up to which the wheel was processed
+  TimerList slots[WHEEL_LEVELS][WHEEL_SLOTS];
+  uint64_t bitmap[WHEEL_LEVELS]; // Which slots aren't empty
+  TimerList expired;
+  Dpc dpc;
 };
 
-static frg::pairing_heap<
-    Timer,
-    frg::locate_member<Timer, frg::pairing_heap_hook<Timer>, &Timer::hook>,
-    TimerComp>
-    timer_heap;
+static TimerWheel *wheels[MAX_CPUS];
 
-Result<Void, Error> timer_enqueue(Timer *timer) {
-  timer->state = Timer::PENDING;
-  timer->deadline = cpu_self()->ms + timer->timeout;
-  timer_heap.push(timer);
-  return Ok({});
-}
+static uint64_t to_ticks(uint64_t ns) { return ns >> TICK_SHIFT; }
 
-void timer_interrupt() {
-  cpu_self()->timer_lock.lock();
-  cpu_self()->ms++;
+// NOTE: the wheel lock must be held
+static void wheel_insert(TimerWheel &wheel, Timer *timer) {
+  // Rounded up, so that a timer never fires early
+  auto expires = to_ticks(timer->deadline + (1 << TICK_SHIFT) - 1);
+
+  if (expires <= wheel.clock) {
+    timer->expired = true;
+    wheel.expired.insert_tail(timer);
+    return;
+  }
+
+  auto delta = expires - wheel.clock;
+
+  if (delta >= WHEEL_SPAN) {
+    expires = wheel.clock + WHEEL_SPAN - 1;
+    delta = WHEEL_SPAN - 1;
+  }
+
+  size_t level = 0;
+
+  while (delta >= 1ull << (WHEEL_BITS * (level + 1)))
+    level++;
 
-  auto top = timer_heap.top();
+  size_t slot = (expires >> (WHEEL_BITS * level)) & (WHEEL_SLOTS - 1);
 
-  if (!top) {
-    cpu_self()->timer_lock.unlock();
+  timer->expired = false;
+  timer->level = level;
+  timer->slot = slot;
+
+  wheel.slots[level][slot].insert_tail(timer);
+  wheel.bitmap[level] |= 1ull << slot;
+}
+
+// NOTE: the wheel lock must be held
+static void wheel_remove(TimerWheel &wheel, Timer *timer) {
+  if (timer->expired) {
+    wheel.expired.remove(timer);
     return;
   }
 
-  if (top->state == Timer::CANCELLED) {
-    timer_heap.pop();
+  auto &slot = wheel.slots[timer->level][timer->slot];
+
+  slot.remove(timer);
+
+  if (!slot.head())
+    wheel.bitmap[timer->level] &= ~(1ull << timer->slot);
+}
+
+// First tick after the clock at which the wheel has something to do, either
+// a level 0 slot expiring or an upper slot being cascaded.
+// NOTE: the wheel lock must be held
+static uint64_t wheel_next_event(TimerWheel &wheel) {
+  uint64_t ret = UINT64_MAX;
+
+  for (size_t level = 0; level < WHEEL_LEVELS; level++) {
+    auto bitmap = wheel.bitmap[level];
+
+    if (!bitmap)
+      continue;
+
+    auto shift = WHEEL_BITS * level;
+    auto unit = (wheel.clock >> shift) + 1;
+    auto first = unit & (WHEEL_SLOTS - 1);
+
+    // Rotate the bitmap so that bit 0 is the slot right after the current one
+    if (first)
+      bitmap = (bitmap >> first) | (bitmap << (WHEEL_SLOTS - first));
+
+    auto tick = (unit + __builtin_ctzll(bitmap)) << shift;
+
+    if (tick < ret)
+      ret = tick;
+  }
+
+  return ret;
+}
+
+// Process every tick up to `now`. NOTE: the wheel lock must be held
+static void wheel_advance(TimerWheel &wheel, uint64_t now) {
+  while (true) {
+    auto tick = wheel_next_event(wheel);
+
+    if (tick > now)
+      break;
+
+    wheel.clock = tick;
+
+    // Upper slots starting at this tick, highest first so that their timers
+    // can be cascaded further down
+    for (size_t level = WHEEL_LEVELS - 1; level > 0; level--) {
+      auto shift = WHEEL_BITS * level;
+
+      if (tick & ((1ull << shift) - 1))
+        continue;
+
+      auto slot = (tick >> shift) & (WHEEL_SLOTS - 1);
+      auto &list = wheel.slots[level][slot];
+
+      wheel.bitmap[level] &= ~(1ull << slot);
+
+      while (auto timer = list.head()) {
+        list.remove(timer);
+        wheel_insert(wheel, timer);
+      }
+    }
+
+    auto slot = tick & (WHEEL_SLOTS - 1);
+    auto &list = wheel.slots[0][slot];
+
+    wheel.bitmap[0] &= ~(1ull << slot);
+
+    while (auto timer = list.head()) {
+      list.remove(timer);
+      timer->expired = true;
+      wheel.expired.insert_tail(timer);
+    }
   }
 
-  while (timer_heap.top()->deadline <= cpu_self()->ms) {
-    auto timer = timer_heap.top();
-    timer_heap.pop();
+  if (now > wheel.clock)
+    wheel.clock = now;
+}
+
+static void run_expired(void *arg) {
+  auto &wheel = *(TimerWheel *)arg;
 
-    ASSERT(timer->state == Timer::PENDING);
+  wheel.lock.lock();
 
-    timer->state = Timer::COMPLETED;
+  while (auto timer = wheel.expired.head()) {
+    wheel.expired.remove(timer);
+    timer->state = Timer::FIRING;
+
+    wheel.lock.unlock();
 
     if (timer->callback)
-      timer->callback();
+      timer->callback(timer->arg);
     timer->trigger_event().unwrap();
 
-    if (!timer_heap.top())
-      break;
+    __atomic_store_n(&timer->state, Timer::COMPLETED, __ATOMIC_RELEASE);
+
+    wheel.lock.lock();
   }
 
-  cpu_self()->timer_lock.unlock();
+  wheel.lock.unlock();
+}
+
+Result<Void, Error> timer_enqueue(Timer *timer) {
+  auto ipl = iplx(Ipl::HIGH);
+  auto cpu = cpu_self();
+  auto &wheel = *wheels[cpu->id];
+
+  wheel.lock.lock();
+
+  auto next = wheel_next_event(wheel);
+
+  timer->state = Timer::PENDING;
+  timer->cpu = cpu;
+  timer->deadline = Hal::get_monotonic_ns() + timer->timeout;
+  wheel_insert(wheel, timer);
+
+  // Our tick may be armed for later than that, or not at all
+  bool kick = timer->expired || wheel_next_event(wheel) < next;
+
+  wheel.lock.unlock();
+
+  if (kick)
+    sched_kick_cpu(cpu);
+
+  iplx(ipl);
+
+  return Ok({});
 }
 
-void timer_cancel(Timer *timer) { timer->state = Timer::CANCELLED; }
+void timer_interrupt() {
+  auto wheel = wheels[cpu_self()->id];
+
+  if (!wheel)
+    return;
+
+  wheel->lock.lock();
+
+  wheel_advance(*wheel, to_ticks(Hal::get_monotonic_ns()));
+  bool expired = wheel->expired.head() != nullptr;
+
+  wheel->lock.unlock();
+
+  if (expired)
+    dpc_enqueue(&wheel->dpc);
+}
+
+void timer_cancel(Timer *timer) {
+  auto ipl = iplx(Ipl::HIGH);
+
+  if (timer->cpu) {
+    auto &wheel = *wheels[timer->cpu->id];
+
+    wheel.lock.lock();
+
+    if (timer->state == Timer::PENDING) {
+      wheel_remove(wheel, timer);
+      timer->state = Timer::CANCELLED;
+    }
+
+    wheel.lock.unlock();
+  }
+
+  iplx(ipl);
+
+  // It is being triggered on its CPU, the caller may free it once we return
+  while (__atomic_load_n(&timer->state, __ATOMIC_ACQUIRE) == Timer::FIRING)
+    ;
+}
+
+uint64_t timer_next_deadline() {
+  auto wheel = wheels[cpu_self()->id];
+
+  if (!wheel)
+    return UINT64_MAX;
+
+  wheel->lock.lock();
+
+  auto tick = wheel->expired.head() ? 0 : wheel_next_event(*wheel);
+
+  wheel->lock.unlock();
+
+  return tick == UINT64_MAX ? UINT64_MAX : tick << TICK_SHIFT;
+}
+
+Result<Void, Error> timer_init_cpu() {
+  auto wheel = new (Vm::Subsystem::SCHED) TimerWheel();
+
+  if (!wheel)
+    return Err(Error::OUT_OF_MEMORY);
+
+  wheel->clock = to_ticks(Hal::get_monotonic_ns());
+  wheel->dpc.func = run_expired;
+  wheel->dpc.args = wheel;
+
+  wheels[cpu_self()->id] = wheel;
+
+  return Ok({});
+}
 
 } // namespace Gaia
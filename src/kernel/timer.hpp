@@ -1,30 +1,51 @@
 /* SPDX-License-Identifier: BSD-2-Clause */
 #pragma once
-#include <frg/pairing_heap.hpp>
 #include <kernel/wait.hpp>
+#include <lib/list.hpp>
 
 namespace Gaia {
 
+struct Cpu;
+
 struct Timer : public Waitable {
-  frg::pairing_heap_hook<Timer> hook;
+  ListNode<Timer> link; // Wheel slot or expired list
 
-  Timer(void (*callback)(), uint64_t ms) : callback(callback), timeout(ms) {}
+  /// `timeout` is in nanoseconds, `callback` is called with `arg` when the
+  /// timer expires
+  Timer(void (*callback)(void *arg), uint64_t timeout, void *arg = nullptr)
+      : callback(callback), arg(arg), timeout(timeout) {}
 
   enum {
     DISABLED,
     PENDING,
     CANCELLED,
+    FIRING, // Its callback and waiters are being run
     COMPLETED,
-  } state;
+  } state = DISABLED;
+
+  void (*callback)(void *arg);
+  void *arg;
+  uint64_t deadline = 0, timeout = 0; // In ns
 
-  void (*callback)();
-  uint64_t deadline = 0, timeout = 0;
+  // Where the timer is queued, so that it can be cancelled in O(1)
+  Cpu *cpu = nullptr;
+  uint8_t level = 0, slot = 0;
+  bool expired = false; // In the expired list instead of a slot
 };
 
+/// Arm a timer on the current CPU's wheel
 Result<Void, Error> timer_enqueue(Timer *timer);
 
+/// Take a pending timer out of its wheel, it is never triggered
 void timer_cancel(Timer *timer);
 
 void timer_interrupt();
 
+/// Time (in ns since boot) at which the current CPU's wheel has something to
+/// do next, UINT64_MAX if there is nothing
+uint64_t timer_next_deadline();
+
+/// Create the timer wheel of the calling CPU
+Result<Void, Error> timer_init_cpu();
+
 } // namespace Gaia
@@ -0,0 +1,227 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+#include <fs/devfs.hpp>
+#include <fs/vfs.hpp>
+#include <hal/hal.hpp>
+#include <kernel/cpu.hpp>
+#include <kernel/ipl.hpp>
+#include <kernel/sched.hpp>
+#include <kernel/trace.hpp>
+#include <sys/stat.h>
+#include <vm/heap.hpp>
+
+namespace Gaia {
+
+/*
+ * Scheduler event tracing, one ring of fixed-size records per CPU.
+ *
+ * Only a CPU writes to its own ring, with interrupts masked, so recording an
+ * event takes no lock. /dev/trace drains the rings while they're being written
+ * to: each record carries a sequence number that the CPU clears before
+ * overwriting it and sets again once done, records that changed while they
+ * were being copied are dropped. When a CPU goes around its ring faster than
+ * it is read, the oldest records are lost and a LOST record says how many.
+ *
+ * See scripts/trace_report.py to make sense of a dump.
+ */
+
+static constexpr size_t TRACE_RECORDS = 4096;
+
+struct TraceRing {
+  uint64_t head = 0; // Next record the CPU writes, only it changes this
+  uint64_t tail = 0; // Next record /dev/trace reads
+  uint64_t lost = 0; // Not reported yet
+  TraceRecord records[TRACE_RECORDS];
+};
+
+bool trace_enabled = false;
+
+// Allocated when tracing is first enabled, and kept afterwards
+static TraceRing *rings[MAX_CPUS];
+
+// Set while someone drains the rings
+static bool draining = false;
+
+void trace_record(TraceEvent type, uint32_t arg0, uint64_t arg1,
+                  uint64_t arg2) {
+  auto ipl = iplx(Ipl::HIGH);
+  auto cpu = cpu_self();
+  auto ring = __atomic_load_n(&rings[cpu->id], __ATOMIC_ACQUIRE);
+
+  if (ring) {
+    auto index = ring->head;
+    auto &rec = ring->records[index % TRACE_RECORDS];
+    auto thread = sched_curr();
+
+    __atomic_store_n(&rec.seq, 0, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    rec.time = Hal::get_monotonic_ns();
+    rec.type = type;
+    rec.cpu = cpu->id;
+    rec.tid = thread ? thread->tid : -1;
+    rec.arg0 = arg0;
+    rec.arg1 = arg1;
+    rec.arg2 = arg2;
+
+    __atomic_store_n(&rec.seq, (uint32_t)(index + 1), __ATOMIC_RELEASE);
+    __atomic_store_n(&ring->head, index + 1, __ATOMIC_RELEASE);
+  }
+
+  iplx(ipl);
+}
+
+// Copy up to `max` records of a CPU to `out`, returns how many were copied
+static size_t drain(size_t cpu, TraceRing *ring, uint8_t *out, size_t max) {
+  size_t count = 0;
+
+  if (ring->lost && max) {
+    auto rec = TraceRecord{};
+    rec.time = Hal::get_monotonic_ns();
+    rec.type = TraceEvent::LOST;
+    rec.cpu = cpu;
+    rec.tid = -1;
+    rec.arg1 = ring->lost;
+
+    memcpy(out, &rec, sizeof(rec));
+    ring->lost = 0;
+    count++;
+  }
+
+  while (count < max) {
+    auto head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+
+    // The CPU went around the ring since we last read it
+    if (head - ring->tail > TRACE_RECORDS) {
+      ring->lost += head - TRACE_RECORDS - ring->tail;
+      ring->tail = head - TRACE_RECORDS;
+    }
+
+    if (ring->tail == head)
+      break;
+
+    auto &rec = ring->records[ring->tail % TRACE_RECORDS];
+    auto seq = __atomic_load_n(&rec.seq, __ATOMIC_ACQUIRE);
+
+    memcpy(out + count * sizeof(TraceRecord), &rec, sizeof(TraceRecord));
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+    // Overwritten while we were copying it
+    if (seq != (uint32_t)(ring->tail + 1) ||
+        __atomic_load_n(&rec.seq, __ATOMIC_RELAXED) != seq) {
+      ring->lost++;
+      ring->tail++;
+      continue;
+    }
+
+    ring->tail++;
+    count++;
+  }
+
+  return count;
+}
+
+static Result<Void, Error> trace_start() {
+  for (size_t i = 0; i < cpu_count(); i++) {
+    if (__atomic_load_n(&rings[i], __ATOMIC_ACQUIRE))
+      continue;
+
+    auto ring = new (Vm::Subsystem::SCHED) TraceRing();
+
+    if (!ring)
+      return Err(Error::OUT_OF_MEMORY);
+
+    TraceRing *expected = nullptr;
+
+    // Someone else enabled tracing at the same time
+    if (!__atomic_compare_exchange_n(&rings[i], &expected, ring, false,
+                                     __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+      delete ring;
+  }
+
+  __atomic_store_n(&trace_enabled, true, __ATOMIC_RELEASE);
+
+  return Ok({});
+}
+
+// Binary device: reading it returns whole TraceRecords, until every ring is
+// empty. Writing 1 enables tracing and 0 disables it, the rings can still be
+// drained afterwards.
+class TraceDev : public Fs::DeviceOps {
+public:
+  Result<size_t, Error> read(dev_t minor, frg::span<uint8_t> buf,
+                             off_t off) override {
+    (void)minor;
+    (void)off;
+
+    auto max = buf.size() / sizeof(TraceRecord);
+
+    if (!max)
+      return Err(Error::INVALID_PARAMETERS);
+
+    if (__atomic_exchange_n(&draining, true, __ATOMIC_ACQUIRE))
+      return Err(Error::WOULD_BLOCK);
+
+    size_t count = 0;
+
+    for (size_t i = 0; i < cpu_count() && count < max; i++) {
+      auto ring = __atomic_load_n(&rings[i], __ATOMIC_ACQUIRE);
+
+      if (ring) {
+        count += drain(i, ring, buf.data() + count * sizeof(TraceRecord),
+                       max - count);
+      }
+    }
+
+    __atomic_store_n(&draining, false, __ATOMIC_RELEASE);
+
+    return Ok(count * sizeof(TraceRecord));
+  }
+
+  Result<size_t, Error> write(dev_t minor, frg::span<uint8_t> buf,
+                              off_t off) override {
+    (void)minor;
+    (void)off;
+
+    if (!buf.size())
+      return Err(Error::INVALID_PARAMETERS);
+
+    switch (buf.data()[0]) {
+    case '0':
+      __atomic_store_n(&trace_enabled, false, __ATOMIC_RELEASE);
+      break;
+    case '1':
+      TRY(trace_start());
+      break;
+    default:
+      return Err(Error::INVALID_PARAMETERS);
+    }
+
+    return Ok(buf.size());
+  }
+
+  Result<uint64_t, Error> ioctl(dev_t minor, uint64_t request,
+                                void *arg) override {
+    (void)minor;
+    (void)request;
+    (void)arg;
+    return Err(Error::INVALID_PARAMETERS);
+  }
+
+  Result<Fs::VnodeAttr, Error> getattr(dev_t minor) override {
+    (void)minor;
+    auto ret = Fs::VnodeAttr{};
+
+    ret.mode = S_IFCHR;
+
+    return Ok(ret);
+  }
+};
+
+void trace_create_dev() {
+  auto maj = Fs::dev_alloc_major(new TraceDev).unwrap();
+
+  Fs::vfs_find_and("/dev/trace", MAKEDEV(maj, 0), Fs::vfs_create_file)
+      .unwrap();
+}
+
+} // namespace Gaia
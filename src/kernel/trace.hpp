@@ -0,0 +1,51 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+#pragma once
+#include <lib/base.hpp>
+
+namespace Gaia {
+
+enum class TraceEvent : uint16_t {
+  SWITCH = 1,    ///< arg0: next tid, arg1: prev state, arg2: run queue length
+  WAKEUP,        ///< arg0: woken tid, arg1: target CPU or -1, arg2: its queue
+  WAIT,          ///< arg1: waitq, arg2: timeout
+  WAKE,          ///< arg0: threads woken up, arg1: waitq
+  SYSCALL_ENTER, ///< arg0: syscall number, arg1: first parameter
+  SYSCALL_EXIT,  ///< arg0: syscall number, arg1: return value
+  LOST,          ///< arg1: records overwritten before they could be read
+};
+
+/// Prev state of a SWITCH away from the idle thread
+constexpr uint64_t TRACE_IDLE = -1;
+
+/// What /dev/trace hands out, records of a CPU are in the order they were
+/// written but CPUs aren't merged together
+struct TraceRecord {
+  uint64_t time; ///< TSC-based, in ns since boot
+  uint32_t seq;  ///< Index in the CPU's ring plus one, written last
+  TraceEvent type;
+  uint16_t cpu;
+  int32_t tid; ///< Thread that was running
+  uint32_t arg0;
+  uint64_t arg1;
+  uint64_t arg2;
+};
+
+static_assert(sizeof(TraceRecord) == 40);
+
+extern bool trace_enabled;
+
+void trace_record(TraceEvent type, uint32_t arg0, uint64_t arg1,
+                  uint64_t arg2);
+
+/// Record an event in the current CPU's ring, does nothing unless tracing was
+/// enabled by writing 1 to /dev/trace
+inline void trace_event(TraceEvent type, uint32_t arg0, uint64_t arg1 = 0,
+                        uint64_t arg2 = 0) {
+  if (__atomic_load_n(&trace_enabled, __ATOMIC_RELAXED))
+    trace_record(type, arg0, arg1, arg2);
+}
+
+/// Create /dev/trace, reading it drains the rings of every CPU
+void trace_create_dev();
+
+} // namespace Gaia
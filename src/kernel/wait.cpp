@@ -1,47 +1,129 @@
 #include "kernel/ipl.hpp"
 #include "kernel/sched.hpp"
+#include <kernel/timer.hpp>
+#include <kernel/trace.hpp>
 #include <kernel/wait.hpp>
 
 using namespace Gaia;
 
-Result<Void, Error> Waitq::await(uint64_t timeout) {
-  ASSERT((int64_t)timeout <= 0 && "Not implemented!");
+// The wait timed out, unless a waker got to the thread first. The thread is
+// still in Waitq::await, which cancels the timer before returning.
+static void wait_timeout(void *arg) {
+  auto thread = (Thread *)arg;
+  auto wq = __atomic_load_n(&thread->waitq, __ATOMIC_ACQUIRE);
+
+  if (!wq)
+    return;
+
+  wq->lock.lock();
+
+  if (thread->waitq != wq || thread->wait_res != WaitResult::WAITING) {
+    wq->lock.unlock();
+    return;
+  }
+
+  wq->waiters.remove(thread);
+  thread->wait_res = WaitResult::TIMED_OUT;
+  __atomic_store_n(&thread->waitq, nullptr, __ATOMIC_RELEASE);
+
+  wq->lock.unlock();
+
+  sched_wake_thread(thread);
+}
+
+Result<Void, Error> Waitq::await(uint64_t timeout, Spinlock *interlock) {
+  bool timed = (int64_t)timeout > 0;
 
   auto ipl = iplx(Ipl::HIGH);
 
   auto thread = sched_curr();
+  Timer timer(wait_timeout, timeout, thread);
+
+  trace_event(TraceEvent::WAIT, 0, (uintptr_t)this, timeout);
+
   lock.lock();
+  thread->lock.lock();
+
+  // Killed before it could sleep, it never runs again
+  if (thread->state == Thread::EXITED) {
+    thread->lock.unlock();
+    lock.unlock();
 
+    if (interlock)
+      interlock->unlock();
+
+    sched_dequeue_and_die();
+  }
+
+  // The wait fields are only changed with our lock held, they're read by
+  // whoever takes the thread out of the queue (see sched_detach_thread)
   waiters.insert_tail(thread);
-  thread->waitq = this;
+  __atomic_store_n(&thread->waitq, this, __ATOMIC_RELEASE);
   thread->wait_res = WaitResult::WAITING;
+  thread->wait_timer = timed ? &timer : nullptr;
+
+  // Must be done before a waker on another CPU can see us
+  thread->state = Thread::SUSPENDED;
 
+  thread->lock.unlock();
   lock.unlock();
 
-  sched_suspend_thread(thread);
+  if (interlock)
+    interlock->unlock();
+
+  // The timer is armed on this CPU, it can't fire before we yield
+  if (timed)
+    timer_enqueue(&timer).unwrap();
+
+  sched_yield();
+
+  // Woken up by someone else, make sure the timer is gone before our stack is.
+  // This waits for the callback if it is running on another CPU.
+  if (timed) {
+    timer_cancel(&timer);
+
+    lock.lock();
+    thread->wait_timer = nullptr;
+    lock.unlock();
+  }
+
   iplx(ipl);
 
-  if (thread->wait_res != WaitResult::SUCCESS) {
+  switch (thread->wait_res) {
+  case WaitResult::SUCCESS:
+    return Ok({});
+  case WaitResult::TIMED_OUT:
+    return Err(Error::TIMED_OUT);
+  default:
     return Err(Error::UNKNOWN);
   }
-
-  return Ok({});
 }
 
 Result<Void, Error> Waitq::wake(int n) {
+  auto ipl = iplx(Ipl::HIGH);
+  lock.lock();
+
   if (n == -1) {
     n = waiters.length();
   }
 
   if (n > (int)waiters.length()) {
+    lock.unlock();
+    iplx(ipl);
     return Err(Error::INVALID_PARAMETERS);
   }
 
+  trace_event(TraceEvent::WAKE, n, (uintptr_t)this);
+
   for (int i = 0; i < n; i++) {
-    auto thread = TRY(waiters.remove_head());
+    auto thread = waiters.remove_head().unwrap();
     thread->wait_res = WaitResult::SUCCESS;
+    __atomic_store_n(&thread->waitq, nullptr, __ATOMIC_RELEASE);
     sched_wake_thread(thread);
   }
 
+  lock.unlock();
+  iplx(ipl);
+
   return Ok({});
 }
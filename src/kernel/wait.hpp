@@ -13,10 +13,13 @@ struct Waitq {
 
   /**
    * @brief Wait for the wait queue to be triggered
-   * @param timeout The timeout in microseconds, any value lower or equal to 0
+   * @param timeout The timeout in nanoseconds, any value lower or equal to 0
    * means no timeout
+   * @param interlock If set, a lock held by the caller which is released once
+   * we are in the queue, so that a wakeup can't be missed
+   * @return Error::TIMED_OUT if the timeout expired before we were woken up
    */
-  Result<Void, Error> await(uint64_t timeout);
+  Result<Void, Error> await(uint64_t timeout, Spinlock *interlock = nullptr);
 
   /**
    * @brief Wake one or more threads from the wait queue
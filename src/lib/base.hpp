@@ -63,6 +63,7 @@ template <typename T> static inline T volatile_read(T *address) {
 #define memcpy __builtin_memcpy
 extern "C" {
 void *memset(void *d, int c, size_t n);
+int memcmp(const void *s1, const void *s2, size_t n);
 size_t strlen(const char *s);
 }
 #endif
@@ -73,6 +73,7 @@ struct Charon {
   CharonModules modules;         ///< The bootloader modules
   CharonMemoryMap memory_map;    ///< The memory map
   int64_t boot_time;             ///< Seconds passed since epoch
+  const char *cmdline;           ///< Kernel command line, null if there's none
 };
 
 } // namespace Gaia
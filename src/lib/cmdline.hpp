@@ -0,0 +1,110 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/**
+ * @file cmdline.hpp
+ * @brief Kernel command line parsing
+ *
+ * The command line is a list of options separated by spaces, either `key` or
+ * `key=value`.
+ */
+#pragma once
+#include <frg/optional.hpp>
+#include <frg/string.hpp>
+#include <stddef.h>
+#include <stdint.h>
+
+namespace Gaia {
+
+/**
+ * @brief Look for an option on the command line
+ *
+ * @return The option's value, empty if it has none, or nothing if the option
+ * isn't there. The last occurrence of an option wins.
+ */
+inline frg::optional<frg::string_view> cmdline_get(frg::string_view cmdline,
+                                                   frg::string_view key) {
+  frg::optional<frg::string_view> ret;
+  size_t i = 0;
+
+  while (i < cmdline.size()) {
+    while (i < cmdline.size() && cmdline[i] == ' ')
+      i++;
+
+    size_t start = i;
+
+    while (i < cmdline.size() && cmdline[i] != ' ')
+      i++;
+
+    auto word = frg::string_view(cmdline.data() + start, i - start);
+    size_t eq = 0;
+
+    while (eq < word.size() && word[eq] != '=')
+      eq++;
+
+    if (frg::string_view(word.data(), eq) != key)
+      continue;
+
+    if (eq == word.size())
+      ret = frg::string_view(word.data() + eq, 0);
+    else
+      ret = frg::string_view(word.data() + eq + 1, word.size() - eq - 1);
+  }
+
+  return ret;
+}
+
+/**
+ * @brief Parse a CPU list such as `1,3-5` into a mask, bit n being CPU n
+ *
+ * @return Nothing if the list is malformed or names a CPU past 63
+ */
+inline frg::optional<uint64_t> parse_cpu_list(frg::string_view list) {
+  uint64_t mask = 0;
+  size_t i = 0;
+
+  auto number = [&]() -> frg::optional<size_t> {
+    size_t start = i, ret = 0;
+
+    while (i < list.size() && list[i] >= '0' && list[i] <= '9') {
+      ret = ret * 10 + (list[i++] - '0');
+
+      if (ret >= 64)
+        return frg::null_opt;
+    }
+
+    if (i == start)
+      return frg::null_opt;
+
+    return ret;
+  };
+
+  while (i < list.size()) {
+    auto first = number();
+
+    if (!first)
+      return frg::null_opt;
+
+    auto last = first;
+
+    if (i < list.size() && list[i] == '-') {
+      i++;
+      last = number();
+
+      if (!last || *last < *first)
+        return frg::null_opt;
+    }
+
+    for (size_t cpu = *first; cpu <= *last; cpu++)
+      mask |= 1ull << cpu;
+
+    if (i == list.size())
+      break;
+
+    // A separator has to be followed by another entry
+    if (list[i++] != ',' || i == list.size())
+      return frg::null_opt;
+  }
+
+  return mask;
+}
+
+} // namespace Gaia
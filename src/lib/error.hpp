@@ -29,6 +29,8 @@ enum class Error {
   INVALID_FILE,
   FULL,
   EMPTY,
+  TIMED_OUT,
+  WOULD_BLOCK,
 };
 
 /**
@@ -67,6 +69,10 @@ inline frg::string_view error_to_string(Error error) {
     return "Full";
   case Error::EMPTY:
     return "Empty";
+  case Error::TIMED_OUT:
+    return "Timed out";
+  case Error::WOULD_BLOCK:
+    return "Operation would block";
   }
 
   return "";
@@ -6,6 +6,7 @@
  */
 #pragma once
 #include <cstdint>
+#include <lib/base.hpp>
 #include <lib/error.hpp>
 #include <lib/result.hpp>
 
@@ -75,7 +76,141 @@ public:
     add_region(region);
   }
 
+  /**
+   * @brief Allocates `size` contiguous bytes aligned on `align`
+   *
+   * @param size The number of bytes to allocate, must be a multiple of quantum
+   * @param align The alignment of the allocation, must be a power of two
+   *
+   * @return The allocation on success, the error on failure.
+   */
+  Result<uintptr_t, Error> alloc_contiguous(size_t size, size_t align) {
+    Region *prev = nullptr;
+
+    for (auto region = head; region; prev = region, region = region->next) {
+      auto start = ALIGN_UP((uintptr_t)region, align);
+
+      if (start + size > (uintptr_t)region + region->size) {
+        continue;
+      }
+
+      carve(region, prev, start, size);
+
+      return Ok(start);
+    }
+
+    return Err(Error::OUT_OF_MEMORY);
+  }
+
+  /**
+   * @brief Frees `size` bytes from address, as a single region
+   *
+   * @param mem The address to free
+   * @param size The number of bytes to free
+   */
+  void free_range(uintptr_t mem, size_t size) {
+    auto region = reinterpret_cast<Region *>(mem);
+    region->size = size;
+    add_region(region);
+  }
+
+  /**
+   * @brief Takes every free byte of [start, start + size) out of the allocator
+   *
+   * @param fn Called with the address and size of every piece removed
+   *
+   * @return The number of bytes removed
+   */
+  template <typename F>
+  size_t remove_range(uintptr_t start, size_t size, F fn) {
+    auto end = start + size;
+    Region *prev = nullptr;
+    Region *kept = nullptr;
+    size_t removed = 0;
+
+    auto region = head;
+
+    while (region) {
+      auto next = region->next;
+      auto base = (uintptr_t)region;
+      auto top = base + region->size;
+
+      if (top <= start || base >= end) {
+        prev = region;
+        region = next;
+        continue;
+      }
+
+      auto from = MAX(base, start);
+      auto to = top < end ? top : end;
+
+      if (prev) {
+        prev->next = next;
+      } else {
+        head = next;
+      }
+
+      // Keep what lies outside the range aside, so that we don't walk it again
+      if (from > base) {
+        region->size = from - base;
+        region->next = kept;
+        kept = region;
+      }
+
+      if (to < top) {
+        auto tail = reinterpret_cast<Region *>(to);
+        tail->size = top - to;
+        tail->next = kept;
+        kept = tail;
+      }
+
+      fn(from, to - from);
+      removed += to - from;
+
+      region = next;
+    }
+
+    while (kept) {
+      auto next = kept->next;
+      add_region(kept);
+      kept = next;
+    }
+
+    return removed;
+  }
+
+  /**
+   * @brief Calls `fn(address, size)` for every free region
+   */
+  template <typename F> void for_each_region(F fn) {
+    for (auto region = head; region; region = region->next) {
+      fn((uintptr_t)region, region->size);
+    }
+  }
+
 private:
+  // Takes [start, start + size) out of `region`, which must contain it
+  void carve(Region *region, Region *prev, uintptr_t start, size_t size) {
+    auto base = (uintptr_t)region;
+    auto top = base + region->size;
+
+    if (prev) {
+      prev->next = region->next;
+    } else {
+      head = region->next;
+    }
+
+    region->next = nullptr;
+
+    if (start + size < top) {
+      free_range(start + size, top - (start + size));
+    }
+
+    if (start > base) {
+      free_range(base, start - base);
+    }
+  }
+
   Region *head = nullptr;
   size_t quantum = 0;
 };
@@ -0,0 +1,65 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/**
+ * @file rwlock.hpp
+ * @brief Spinning reader/writer lock
+ */
+#pragma once
+#include <stdint.h>
+
+namespace Gaia {
+
+/**
+ * @brief A reader/writer spinlock
+ *
+ * Any number of readers can hold the lock at the same time, a writer holds it
+ * alone. Readers are preferred: a writer waits until there are no readers
+ * left.
+ */
+class RwLock {
+public:
+  bool try_read_lock() {
+    auto state = __atomic_load_n(&_state, __ATOMIC_RELAXED);
+
+    if (state & WRITER) {
+      return false;
+    }
+
+    return __atomic_compare_exchange_n(&_state, &state, state + 1, false,
+                                       __ATOMIC_ACQUIRE, __ATOMIC_RELAXED);
+  }
+
+  void read_lock() {
+    while (!try_read_lock())
+      ;
+  }
+
+  void read_unlock() { __atomic_fetch_sub(&_state, 1, __ATOMIC_RELEASE); }
+
+  bool try_write_lock() {
+    uint32_t expected = 0;
+    return __atomic_compare_exchange_n(&_state, &expected, WRITER, false,
+                                       __ATOMIC_ACQUIRE, __ATOMIC_RELAXED);
+  }
+
+  void write_lock() {
+    while (!try_write_lock())
+      ;
+  }
+
+  void write_unlock() { __atomic_store_n(&_state, 0, __ATOMIC_RELEASE); }
+
+  /// Number of readers currently holding the lock
+  uint32_t readers() {
+    return __atomic_load_n(&_state, __ATOMIC_RELAXED) & ~WRITER;
+  }
+
+  bool is_write_locked() {
+    return __atomic_load_n(&_state, __ATOMIC_RELAXED) & WRITER;
+  }
+
+private:
+  static constexpr uint32_t WRITER = (1u << 31);
+  uint32_t _state = 0;
+};
+
+} // namespace Gaia
@@ -8,6 +8,7 @@ class Spinlock {
 public:
   void lock() { _lock.lock(); }
   void unlock() { _lock.unlock(); }
+  bool is_locked() { return _lock.is_locked(); }
 
 private:
   frg::simple_spinlock _lock;
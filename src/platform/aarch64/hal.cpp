@@ -14,6 +14,26 @@ void halt() {
 
 Time get_time_since_boot() { return {0, 0, 0, 0, 0}; }
 
+uint64_t get_monotonic_ns() { return 0; }
+
+void arm_timer(uint64_t ns) { (void)ns; }
+
+size_t idle_state_count() { return 1; }
+
+uint64_t idle_residency(size_t state) {
+  (void)state;
+  return 0;
+}
+
+bool idle_can_watch() { return false; }
+
+void idle_wait(uint32_t *watch, uint32_t value, size_t state) {
+  (void)watch;
+  (void)value;
+  (void)state;
+  asm volatile("wfi");
+}
+
 uintptr_t phys_to_virt(uintptr_t phys) { return phys + 0xffff800000000000; }
 uintptr_t virt_to_phys(uintptr_t virt) { return virt - 0xffff800000000000; }
 
@@ -12,7 +12,8 @@ extern char rodata_start_addr[], rodata_end_addr[];
 extern char data_start_addr[], data_end_addr[];
 }
 
-void Pagemap::map(uintptr_t va, uintptr_t pa, Prot prot, Flags flags) {
+Result<Void, Error> Pagemap::map(uintptr_t va, uintptr_t pa, Prot prot,
+                                 Flags flags) {
   (void)context;
   (void)va;
   (void)pa;
@@ -22,7 +23,10 @@ void Pagemap::map(uintptr_t va, uintptr_t pa, Prot prot, Flags flags) {
   panic("Todo: Pagemap::Map");
 }
 
-void Pagemap::init(bool kernel) { (void)kernel; }
+Result<Void, Error> Pagemap::init(bool kernel) {
+  (void)kernel;
+  return Ok({});
+}
 
 void Pagemap::activate() {}
 
@@ -39,4 +43,8 @@ Result<uintptr_t, Error> Pagemap::get_mapping(uintptr_t virt) {
 
 void init() { panic("Todo: aarch64 mmu"); }
 
+// Single CPU, nothing to shoot down
+void flush_stale() {}
+void poll_shootdowns() {}
+
 } // namespace Gaia::Hal::Vm
\ No newline at end of file
@@ -1,6 +1,7 @@
 /* SPDX-License-Identifier: BSD-2-Clause */
 #include <amd64/apic.hpp>
 #include <amd64/asm.hpp>
+#include <amd64/cpuid.hpp>
 #include <amd64/timer.hpp>
 #include <dev/acpi/acpi.hpp>
 #include <kernel/cpu.hpp>
@@ -35,8 +36,15 @@ constexpr auto LAPIC_SPURIOUS_ALL = 0xFF;
 constexpr auto LAPIC_SPURIOUS_ENABLE = (1 << 8);
 constexpr auto LAPIC_TIMER_IRQ = 0x20;
 constexpr auto LAPIC_TIMER_PERIODIC = (1 << 17);
+constexpr auto LAPIC_TIMER_TSC_DEADLINE = (2 << 17);
 constexpr auto LAPIC_TIMER_MASKED = (1 << 16);
 
+constexpr auto IA32_TSC_DEADLINE = 0x6e0;
+
+// Whether the timer fires when the TSC reaches a deadline instead of counting
+// down bus ticks, which saves the conversion and is much more precise
+static bool tsc_deadline = false;
+
 static uintptr_t lapic_address = 0;
 static List<IoApic, &IoApic::link> ioapics;
 static List<Iso, &Iso::link> isos;
@@ -60,11 +68,28 @@ static inline uint32_t lapic_read(uint32_t reg) {
       reinterpret_cast<uint32_t *>(Hal::phys_to_virt(addr) + reg));
 }
 
-void lapic_send_ipi(uint8_t vector) {
-  lapic_write(LapicReg::ICR1, (0) << 24);
+constexpr auto LAPIC_ICR_PENDING = (1 << 12);
+constexpr auto LAPIC_ICR_SELF = (1 << 18);
+
+static void lapic_wait_icr() {
+  while (lapic_read(LapicReg::ICR0) & LAPIC_ICR_PENDING) {
+    asm volatile("pause");
+  }
+}
+
+void lapic_send_ipi(uint32_t lapic_id, uint8_t vector) {
+  lapic_wait_icr();
+  lapic_write(LapicReg::ICR1, lapic_id << 24);
   lapic_write(LapicReg::ICR0, vector);
 }
 
+void lapic_send_ipi_self(uint8_t vector) {
+  lapic_wait_icr();
+  lapic_write(LapicReg::ICR0, vector | LAPIC_ICR_SELF);
+}
+
+uint32_t lapic_id() { return lapic_read(LapicReg::ID) >> 24; }
+
 size_t lapic_calibrate() {
   lapic_write(LapicReg::LVT_TIMER, LAPIC_TIMER_MASKED);
   lapic_write(LapicReg::TIMER_INIT_COUNT, (uint32_t)-1);
@@ -80,11 +105,26 @@ size_t lapic_calibrate() {
   return ticks_in_10ms / 10;
 }
 
+// The timer runs in one-shot mode, the scheduler re-arms it on every tick for
+// its next event. This fires the first tick.
+static void lapic_start_timer() {
+  lapic_write(LapicReg::SPURIOUS_VECTOR, lapic_read(LapicReg::SPURIOUS_VECTOR) |
+                                             LAPIC_SPURIOUS_ALL |
+                                             LAPIC_SPURIOUS_ENABLE);
+
+  if (tsc_deadline)
+    lapic_write(LapicReg::LVT_TIMER,
+                LAPIC_TIMER_IRQ | LAPIC_TIMER_TSC_DEADLINE);
+
+  lapic_one_shot(1000000);
+}
+
 void lapic_init() {
 
   lapic_write(LapicReg::TIMER_DIVIDE_CONFIG, ApicTimerDivide::BY_16);
 
   cpu_self()->data.lapic_freq = 0;
+  cpu_self()->data.lapic_id = lapic_id();
 
   constexpr size_t calibration_runs = 5;
 
@@ -92,25 +132,47 @@ void lapic_init() {
     cpu_self()->data.lapic_freq += lapic_calibrate() / calibration_runs;
   }
 
-  lapic_write(LapicReg::LVT_TIMER, LAPIC_TIMER_IRQ | LAPIC_TIMER_PERIODIC);
-  lapic_write(LapicReg::TIMER_INIT_COUNT, cpu_self()->data.lapic_freq);
-  lapic_write(LapicReg::SPURIOUS_VECTOR, lapic_read(LapicReg::SPURIOUS_VECTOR) |
-                                             LAPIC_SPURIOUS_ALL |
-                                             LAPIC_SPURIOUS_ENABLE);
+  tsc_deadline = Cpuid::has_ecx_feature(Cpuid::Feature::ECX_TSC);
+
+  if (tsc_deadline)
+    log("LAPIC timer using TSC-deadline mode");
+
+  lapic_start_timer();
+}
+
+void lapic_init_secondary(uint64_t freq) {
+  lapic_write(LapicReg::TIMER_DIVIDE_CONFIG, ApicTimerDivide::BY_16);
+
+  // Every LAPIC timer runs off the same bus clock, no need to calibrate again
+  cpu_self()->data.lapic_freq = freq;
+  cpu_self()->data.lapic_id = lapic_id();
+
+  lapic_start_timer();
 }
 
 uint64_t lapic_read_count() {
   return lapic_read(LapicReg::TIMER_CURRENT_COUNT);
 }
 
-void lapic_one_shot(uint64_t us) {
+void lapic_one_shot(uint64_t ns) {
+  // Writing 0 disarms the timer in both modes
+  if (tsc_deadline) {
+    wrmsr(IA32_TSC_DEADLINE, ns ? rdtsc() + ns_to_tsc(ns) : 0);
+    return;
+  }
+
   lapic_write(LapicReg::TIMER_INIT_COUNT, 0);
-  lapic_write(LapicReg::LVT_TIMER, LAPIC_TIMER_MASKED);
 
-  auto ticks = us * (cpu_self()->data.lapic_freq / 1000);
+  if (!ns)
+    return;
+
+  // lapic_freq is in ticks per ms, with the divider set to 16
+  auto ticks = ns * cpu_self()->data.lapic_freq / 1000000;
+
+  ticks = ticks ? ticks : 1;
+  ticks = ticks > UINT32_MAX ? UINT32_MAX : ticks;
 
   lapic_write(LapicReg::LVT_TIMER, LAPIC_TIMER_IRQ);
-  lapic_write(LapicReg::TIMER_DIVIDE_CONFIG, ApicTimerDivide::BY_2);
   lapic_write(LapicReg::TIMER_INIT_COUNT, ticks);
 }
 
@@ -10,16 +10,23 @@ namespace Gaia::Amd64 {
 void ioapic_init(Dev::AcpiPc *pc);
 
 void lapic_init();
+
+/// Start the LAPIC timer of an AP, with the frequency measured on the BSP
+void lapic_init_secondary(uint64_t freq);
 void lapic_eoi();
 
-void lapic_send_ipi(uint8_t vector);
+uint32_t lapic_id();
+void lapic_send_ipi(uint32_t lapic_id, uint8_t vector);
+void lapic_send_ipi_self(uint8_t vector);
 
 void ioapic_handle_gsi(uint32_t gsi, Hal::InterruptHandler *handler, void *arg,
                        bool lopol, bool edge, Ipl ipl,
                        Hal::InterruptEntry *entry);
 
 uint64_t lapic_read_count();
-void lapic_one_shot(uint64_t us);
+
+/// Fire the LAPIC timer interrupt once in `ns` nanoseconds, 0 stops the timer
+void lapic_one_shot(uint64_t ns);
 
 void ioapic_redirect_irq(uint8_t irq, uint8_t vector);
 
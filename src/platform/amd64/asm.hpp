@@ -45,6 +45,18 @@ static inline void hlt(void) { asm volatile("hlt"); }
 
 static inline void sti(void) { asm volatile("sti"); }
 
+// STI only takes effect after the next instruction, so an interrupt can't come
+// in between and be missed
+static inline void sti_hlt(void) { asm volatile("sti; hlt"); }
+
+static inline void monitor(const void *addr) {
+  asm volatile("monitor" ::"a"(addr), "c"(0), "d"(0));
+}
+
+static inline void sti_mwait(uint32_t hint) {
+  asm volatile("sti; mwait" ::"a"(hint), "c"(0));
+}
+
 #define ASM_MAKE_CRN(N)                                                        \
   static inline uint64_t read_cr##N(void) {                                    \
     uint64_t value = 0;                                                        \
@@ -104,6 +116,24 @@ static inline void xrstor(uint8_t *region) {
                : "memory");
 }
 
+static inline void xsaveopt(uint8_t *region) {
+  asm volatile("xsaveopt %0" ::"m"(*region), "a"(~(uintptr_t)0),
+               "d"(~(uintptr_t)0)
+               : "memory");
+}
+
+static inline void xsaves(uint8_t *region) {
+  asm volatile("xsaves %0" ::"m"(*region), "a"(~(uintptr_t)0),
+               "d"(~(uintptr_t)0)
+               : "memory");
+}
+
+static inline void xrstors(uint8_t *region) {
+  asm volatile("xrstors %0" ::"m"(*region), "a"(~(uintptr_t)0),
+               "d"(~(uintptr_t)0)
+               : "memory");
+}
+
 static inline void fxsave(void *region) {
   asm volatile("fxsave (%0)" ::"a"(region));
 }
@@ -114,6 +144,8 @@ static inline void fxrstor(void *region) {
 
 static inline void fninit(void) { asm volatile("fninit"); }
 
+static inline void clts(void) { asm volatile("clts"); }
+
 static inline void set_kernel_gs_base(void *addr) {
   wrmsr(0xc0000102, (uint64_t)addr);
 }
@@ -1,24 +1,48 @@
 #include "kernel/sched.hpp"
 #include <amd64/asm.hpp>
+#include <amd64/gdt.hpp>
 #include <amd64/limine.h>
 #include <hal/cpu.hpp>
 #include <kernel/cpu.hpp>
 
 namespace Gaia::Amd64 {
 
-static void idlefn() { Hal::halt(); }
-
 void cpu_init(Cpu *cpu) {
-  (void)cpu;
-  (void)idlefn;
+  cpu->data.self = cpu;
+  set_gs_base(cpu);
 }
 
 } // namespace Gaia::Amd64
 
+namespace Gaia {
+
+Cpu *cpu_self() {
+  Cpu *ret;
+  asm volatile("mov %%gs:0x10, %0" : "=r"(ret));
+  return ret;
+}
+
+} // namespace Gaia
+
 namespace Gaia::Hal {
 
-Thread *get_current_thread() { return (Thread *)Amd64::get_gs_base(); };
+// A single GS-relative load, so that we can't migrate halfway through
+Thread *get_current_thread() {
+  Thread *ret;
+  asm volatile("mov %%gs:%c1, %0"
+               : "=r"(ret)
+               : "i"(__builtin_offsetof(Cpu, current_thread)));
+  return ret;
+}
+
+void set_current_thread(Thread *thread) {
+  auto cpu = cpu_self();
 
-void set_current_thread(Thread *thread) { Amd64::set_gs_base(thread); }
+  cpu->current_thread = thread;
+
+  // Syscalls and interrupts from userspace land on the thread's kernel stack
+  cpu->data.syscall_kernel_stack = thread->ctx.info.syscall_kernel_stack;
+  Amd64::gdt_set_kernel_stack(thread->ctx.info.syscall_kernel_stack);
+}
 
 } // namespace Gaia::Hal
@@ -1,8 +1,15 @@
 /* SPDX-License-Identifier: BSD-2-Clause */
+#pragma once
 #include <stdint.h>
 
 namespace Gaia::Hal {
+// GS points to the Cpu structure, which starts with this
 struct CpuData {
+  uintptr_t syscall_kernel_stack; // [gs:0x0], see syscall.asm
+  uintptr_t syscall_user_stack;   // [gs:0x8]
+  void *self;                     // [gs:0x10], the Cpu itself
   uint64_t lapic_freq;
+  uint32_t lapic_id;
+  void *tables; // GDT and TSS of this CPU
 };
 } // namespace Gaia::Hal
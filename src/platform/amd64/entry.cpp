@@ -32,6 +32,12 @@ volatile static struct limine_boot_time_request boot_time_request = {
     .response = nullptr,
 };
 
+volatile static struct limine_kernel_file_request kernel_file_request = {
+    .id = LIMINE_KERNEL_FILE_REQUEST,
+    .revision = 0,
+    .response = nullptr,
+};
+
 static Result<CharonMmapEntryType, Error>
 limine_mmap_type_to_charon(uint64_t type) {
   switch (type) {
@@ -113,6 +119,10 @@ Charon make_charon() {
 
   charon.boot_time = boot_time_request.response->boot_time;
 
+  if (kernel_file_request.response != NULL) {
+    charon.cmdline = kernel_file_request.response->kernel_file->cmdline;
+  }
+
   return charon;
 }
 
@@ -121,7 +131,8 @@ extern void (*__init_array_end[])();
 
 namespace Gaia::Amd64 {
 Cpu _cpu{};
-}
+void cpu_init(Cpu *cpu);
+} // namespace Gaia::Amd64
 
 extern "C" void _start() {
   for (std::size_t i = 0; &__init_array[i] != __init_array_end; i++) {
@@ -130,11 +141,12 @@ extern "C" void _start() {
 
   log("Hello from Amd64");
 
+  cpu_init(&_cpu);
+  sched_register_cpu(&_cpu);
+
   gdt_init();
   idt_init();
 
-  sched_register_cpu(&_cpu);
-
   auto charon = make_charon();
   auto ret = main(charon);
 
@@ -1,6 +1,8 @@
 #include "vm/vm_kernel.hpp"
 #include <amd64/gdt.hpp>
 #include <cstdint>
+#include <kernel/cpu.hpp>
+#include <vm/heap.hpp>
 #include <vm/phys.hpp>
 #include <vm/vm.hpp>
 
@@ -53,21 +55,26 @@ struct [[gnu::packed]] Tss {
   uint16_t iopb_offset;
 };
 
-static Gdt gdt = {{{0x0000, 0, 0, 0x00, 0x00, 0},       // NULL
-                   {0xFFFF, 0, 0, 0x9A, 0x00, 0},       // 16 Bit code
-                   {0xFFFF, 0, 0, 0x92, 0x00, 0},       // 16 Bit data
-                   {0xFFFF, 0, 0, 0x9A, 0xCF, 0},       // 32 Bit code
-                   {0xFFFF, 0, 0, 0x92, 0xCF, 0},       // 32 Bit data
-                   {0x0000, 0, 0, 0x9A, 0x20, 0},       // 64 Bit code
-                   {0x0000, 0, 0, 0x92, 0x00, 0},       // 64 Bit data
-                   {0x0000, 0, 0, 0xF2, 0x00, 0},       // User data
-                   {0x0000, 0, 0, 0xFA, 0x20, 0}},      // User code
-                  {0x0000, 0, 0, 0x89, 0x00, 0, 0, 0}}; // TSS
+struct CpuTables {
+  Gdt gdt;
+  GdtDescriptor pointer;
+  Tss tss;
+};
 
-static GdtDescriptor gdt_pointer = {.limit = sizeof(gdt) - 1,
-                                    .base = (uint64_t)&gdt};
+static const Gdt gdt_template = {
+    {{0x0000, 0, 0, 0x00, 0x00, 0},  // NULL
+     {0xFFFF, 0, 0, 0x9A, 0x00, 0},  // 16 Bit code
+     {0xFFFF, 0, 0, 0x92, 0x00, 0},  // 16 Bit data
+     {0xFFFF, 0, 0, 0x9A, 0xCF, 0},  // 32 Bit code
+     {0xFFFF, 0, 0, 0x92, 0xCF, 0},  // 32 Bit data
+     {0x0000, 0, 0, 0x9A, 0x20, 0},  // 64 Bit code
+     {0x0000, 0, 0, 0x92, 0x00, 0},  // 64 Bit data
+     {0x0000, 0, 0, 0xF2, 0x00, 0},  // User data
+     {0x0000, 0, 0, 0xFA, 0x20, 0}}, // User code
+    {0x0000, 0, 0, 0x89, 0x00, 0, 0, 0}}; // TSS
 
-static Tss tss = {};
+// The BSP's tables can't be allocated, the heap isn't up yet
+static CpuTables bsp_tables = {};
 
 extern "C" void gdt_load(GdtDescriptor *pointer);
 extern "C" void tss_reload(void);
@@ -85,14 +92,34 @@ static TssDescriptor make_tss_entry(uintptr_t addr) {
   };
 }
 
+static CpuTables *cpu_tables() {
+  return (CpuTables *)cpu_self()->data.tables;
+}
+
 void gdt_init() {
-  tss.iopb_offset = sizeof(Tss);
-  gdt.tss = make_tss_entry((uintptr_t)&tss);
+  auto tables = cpu_self()->data.tables
+                    ? (CpuTables *)cpu_self()->data.tables
+                    : &bsp_tables;
+
+  cpu_self()->data.tables = tables;
+
+  tables->gdt = gdt_template;
+  tables->tss.iopb_offset = sizeof(Tss);
+  tables->gdt.tss = make_tss_entry((uintptr_t)&tables->tss);
 
-  gdt_load(&gdt_pointer);
+  tables->pointer = {.limit = sizeof(Gdt) - 1, .base = (uint64_t)&tables->gdt};
+
+  gdt_load(&tables->pointer);
   tss_reload();
 }
 
-void gdt_init_tss() { tss.rsp0 = (uintptr_t)Vm::vm_kernel_alloc(6) + 0x6000; }
+void *gdt_alloc_tables() { return new (Vm::Subsystem::VM) CpuTables{}; }
+
+void gdt_init_tss() {
+  cpu_tables()->tss.rsp0 = (uintptr_t)Vm::vm_kernel_alloc(6) + 0x6000;
+  cpu_tables()->tss.ist1 = (uintptr_t)Vm::vm_kernel_alloc(4) + 0x4000;
+}
+
+void gdt_set_kernel_stack(uintptr_t stack) { cpu_tables()->tss.rsp0 = stack; }
 
 } // namespace Gaia::Amd64
@@ -1,7 +1,16 @@
 /* SPDX-License-Identifier: BSD-2-Clause */
 #pragma once
+#include <stdint.h>
 
 namespace Gaia::Amd64 {
+/// Load the GDT and TSS of the current CPU, allocated with gdt_alloc_tables()
+/// unless we are the BSP
 void gdt_init();
+void *gdt_alloc_tables();
+
+/// Allocate the interrupt stacks of this CPU, IST1 is used for context switches
 void gdt_init_tss();
+
+/// Stack used when an interrupt comes from userspace on this CPU
+void gdt_set_kernel_stack(uintptr_t stack);
 } // namespace Gaia::Amd64
@@ -3,6 +3,8 @@
 #include <amd64/asm.hpp>
 #include <amd64/cpuid.hpp>
 #include <amd64/gdt.hpp>
+#include <amd64/idle.hpp>
+#include <amd64/smp.hpp>
 #include <amd64/syscall.hpp>
 #include <amd64/timer.hpp>
 #include <dev/acpi/acpi.hpp>
@@ -13,9 +15,7 @@
 using namespace Gaia::Amd64;
 
 namespace Gaia::Amd64 {
-void cpu_init(Cpu *cpu);
 uintptr_t get_tsc_ms();
-extern Cpu _cpu;
 } // namespace Gaia::Amd64
 
 namespace Gaia::Hal {
@@ -44,17 +44,22 @@ Time get_time_since_boot() {
   return {0, 0, seconds, left, 0};
 }
 
+uint64_t get_monotonic_ns() { return get_tsc_ns(); }
+
+void arm_timer(uint64_t ns) { lapic_one_shot(ns); }
+
 uintptr_t phys_to_virt(uintptr_t phys) { return phys + 0xffff800000000000; }
 uintptr_t virt_to_phys(uintptr_t virt) { return virt - 0xffff800000000000; }
 
 void init_devices(Dev::AcpiPc *pc) {
-  Amd64::cpu_init(&Amd64::_cpu);
   Amd64::timer_init(pc);
   Amd64::simd_init();
+  Amd64::idle_init();
   log("CPU is {}", Cpuid::branding().brand);
   Amd64::ioapic_init(pc);
   Amd64::gdt_init_tss();
   Amd64::syscall_init();
+  Amd64::smp_init();
 }
 
 Ipl get_ipl() { return (Ipl)read_cr8(); }
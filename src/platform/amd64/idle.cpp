@@ -0,0 +1,109 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+#include <amd64/asm.hpp>
+#include <amd64/cpuid.hpp>
+#include <amd64/idle.hpp>
+#include <hal/hal.hpp>
+#include <lib/log.hpp>
+
+/*
+ * Idle states. With MONITOR/MWAIT, an idle CPU also wakes up when the word it
+ * watches is written to, which is much cheaper for whoever wakes it up than an
+ * IPI. MWAIT can also enter the deeper C-states enumerated by CPUID leaf 5,
+ * while HLT only ever enters C1.
+ *
+ * The LAPIC timer stops in C-states deeper than C1 unless it is always running
+ * (ARAT). Nothing would wake the CPU up for its next timer then, so without
+ * ARAT we stay in C1.
+ */
+
+#define CPUID_MONITOR_MWAIT 5
+#define CPUID_THERMAL_POWER 6
+
+// CPUID.05h:ECX, EDX enumerates the C-states
+static constexpr uint32_t MWAIT_EXTENSIONS = 1 << 0;
+
+// CPUID.06h:EAX
+static constexpr uint32_t THERMAL_ARAT = 1 << 2;
+
+static constexpr size_t MAX_IDLE_STATES = 7;
+
+struct IdleState {
+  uint32_t hint; // MWAIT hint, C-state - 1 in bits 7:4
+  uint64_t residency;
+};
+
+// Rough target residencies (in ns) of C1 to C7, the real ones are in ACPI's
+// _CST which we don't parse
+static constexpr uint64_t residencies[MAX_IDLE_STATES] = {
+    0, 20000, 100000, 400000, 800000, 1600000, 3200000};
+
+static IdleState states[MAX_IDLE_STATES] = {{0, 0}};
+static size_t nr_states = 1;
+static bool use_mwait = false;
+
+namespace Gaia::Amd64 {
+
+void idle_init() {
+  if (!Cpuid::has_ecx_feature(Cpuid::Feature::ECX_MONITOR)) {
+    log("idle: using hlt");
+    return;
+  }
+
+  auto leaf = Cpuid::cpuid(CPUID_MONITOR_MWAIT);
+
+  if (leaf.is_err()) {
+    log("idle: using hlt");
+    return;
+  }
+
+  use_mwait = true;
+
+  auto thermal = Cpuid::cpuid(CPUID_THERMAL_POWER);
+  bool arat = thermal.is_ok() && (thermal.unwrap().eax & THERMAL_ARAT);
+
+  if (!arat)
+    log("idle: no always running APIC timer, staying in C1");
+
+  // Number of sub-states of each C-state in EDX, 4 bits each from C0
+  if (arat && (leaf.unwrap().ecx & MWAIT_EXTENSIONS)) {
+    auto edx = leaf.unwrap().edx;
+
+    for (uint32_t c = 2; c <= MAX_IDLE_STATES; c++) {
+      if (!((edx >> (4 * c)) & 0xf))
+        continue;
+
+      states[nr_states++] = {(c - 1) << 4, residencies[c - 1]};
+    }
+  }
+
+  log("idle: using mwait, {} C-states", nr_states);
+}
+
+} // namespace Gaia::Amd64
+
+namespace Gaia::Hal {
+
+size_t idle_state_count() { return nr_states; }
+
+uint64_t idle_residency(size_t state) { return states[state].residency; }
+
+bool idle_can_watch() { return use_mwait; }
+
+void idle_wait(uint32_t *watch, uint32_t value, size_t state) {
+  if (!use_mwait) {
+    Amd64::sti_hlt();
+    return;
+  }
+
+  Amd64::monitor(watch);
+
+  // Written to before the monitor was armed
+  if (__atomic_load_n(watch, __ATOMIC_ACQUIRE) != value) {
+    Amd64::sti();
+    return;
+  }
+
+  Amd64::sti_mwait(states[state < nr_states ? state : nr_states - 1].hint);
+}
+
+} // namespace Gaia::Hal
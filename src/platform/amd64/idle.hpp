@@ -0,0 +1,9 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+#pragma once
+
+namespace Gaia::Amd64 {
+
+/// Find out which idle states the CPU supports
+void idle_init();
+
+} // namespace Gaia::Amd64
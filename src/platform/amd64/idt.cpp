@@ -47,7 +47,7 @@ static void install_isrs() {
 
 static IdtDescriptor idtr = {};
 
-static void idt_reload() {
+void idt_reload() {
   idtr.size = sizeof(idt) - 1;
   idtr.addr = (uintptr_t)idt;
 
@@ -65,6 +65,10 @@ void idt_init() {
 
   idt[0x20] = idt_make_entry((uintptr_t)timer_interrupt, INTGATE, 0);
 
+  // The context switch runs on its own stack, so that the thread we switch
+  // away from can be picked up by another CPU right away
+  idt[0xf0].ist = 1;
+
   // Disable PIC
   outb(PIC2_DATA, 0xff);
   outb(PIC1_DATA, 0xff);
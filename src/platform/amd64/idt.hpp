@@ -55,48 +55,100 @@ struct [[gnu::packed]] Gaia::Hal::CpuContext {
   void *fpu_regs = nullptr;
   bool user = true;
 
-  void load(InterruptFrame *regs) {
-    if (user) {
-      Amd64::simd_restore_state(fpu_regs);
-    }
+  // Where the thread's stack was left by switch_context, 0 if it was
+  // interrupted instead (its registers are in `regs` then)
+  uintptr_t kernel_rsp = 0;
+
+  // Whether the SIMD state is in the registers, in which case it is saved when
+  // switching out. Otherwise it is loaded by the first SIMD instruction, which
+  // traps as CR0.TS is set.
+  bool fpu_live = false;
+
+  // Switches in a row after which the thread used SIMD, it wraps around so
+  // that a thread that stopped using it goes back to lazy loading
+  uint8_t fpu_counter = 0;
 
-    // Amd64::set_gs_base(&info);
+  // Threads that used SIMD this many times in a row get it loaded when
+  // switched in, instead of taking a trap every time
+  static constexpr uint8_t FPU_EAGER_SWITCHES = 5;
 
-    if (user && gs_base != nullptr) {
+  void load_state() {
+    if (user) {
+      if (fpu_counter >= FPU_EAGER_SWITCHES) {
+        Amd64::simd_enable();
+        Amd64::simd_restore_state(fpu_regs);
+        fpu_live = true;
+      } else {
+        Amd64::simd_disable();
+        fpu_live = false;
+      }
+
+      // GS always points to the Cpu in the kernel, this is what userspace gets
+      // after swapgs
       Amd64::set_kernel_gs_base(gs_base);
-    } else if (!user)
-      Amd64::set_kernel_gs_base(&info);
+    }
 
     Amd64::set_fs_base(fs_base);
+  }
 
-    memcpy(regs, &this->regs, sizeof(this->regs));
+  void save_state() {
+    if (user) {
+      if (fpu_live) {
+        Amd64::simd_save_state(fpu_regs);
+        fpu_counter++;
+      } else {
+        fpu_counter = 0;
+      }
+
+      fpu_live = false;
+    }
+
+    this->gs_base = Amd64::get_kernel_gs_base();
+    this->fs_base = Amd64::get_fs_base();
   }
 
-  void save(InterruptFrame *regs) {
+  /// Called on #NM, when the thread uses SIMD for the first time since it was
+  /// switched in
+  void load_fpu() {
+    Amd64::simd_enable();
+    Amd64::simd_restore_state(fpu_regs);
+    fpu_live = true;
+  }
 
-    if (user)
-      Amd64::simd_save_state(fpu_regs);
+  /// Give a new user context its initial SIMD state
+  Result<Void, Error> alloc_fpu() {
+    fpu_regs = TRY(Amd64::simd_alloc_area());
+    Amd64::simd_init_context(fpu_regs);
+    return Ok({});
+  }
 
+  /// Copy the SIMD state to another thread's area
+  void copy_fpu(void *area) {
+    if (fpu_live)
+      Amd64::simd_save_state(area);
+    else
+      Amd64::simd_copy_state(area, fpu_regs);
+  }
+
+  void load(InterruptFrame *regs) {
+    load_state();
+
+    memcpy(regs, &this->regs, sizeof(this->regs));
+  }
+
+  void save(InterruptFrame *regs) {
     ASSERT(regs != nullptr);
 
-    this->gs_base = Amd64::get_kernel_gs_base();
-    this->fs_base = Amd64::get_fs_base();
+    save_state();
 
     this->regs = *regs;
   }
 
   CpuContext() : user(false) {}
 
+  /// A user context has no SIMD area until alloc_fpu is called
   CpuContext(uintptr_t rip, uintptr_t kstack, uintptr_t ustack, bool user)
       : user(user) {
-
-    if (user) {
-      fpu_regs = (void *)Hal::phys_to_virt(
-          (uintptr_t)::Gaia::Vm::phys_alloc(true).unwrap());
-
-      Amd64::simd_init_context(fpu_regs);
-    }
-
     regs = {};
 
     regs.rsp = user ? ustack : kstack;
@@ -107,7 +159,7 @@ struct [[gnu::packed]] Gaia::Hal::CpuContext {
     regs.ss = user ? 0x3b : 0x30;
     regs.cs = user ? 0x43 : 0x28;
 
-    gs_base = user ? nullptr : &info;
+    gs_base = nullptr;
     fs_base = nullptr;
   }
 };
@@ -115,4 +167,7 @@ struct [[gnu::packed]] Gaia::Hal::CpuContext {
 namespace Gaia::Amd64 {
 void idt_init();
 
+/// Load the IDT on an AP
+void idt_reload();
+
 }
@@ -8,16 +8,71 @@
 #include <kernel/sched.hpp>
 #include <kernel/task.hpp>
 #include <kernel/timer.hpp>
+#include <vm/reclaim.hpp>
+#include <vm/vm_kernel.hpp>
 
 namespace Gaia::Amd64 {
 
 static List<Hal::InterruptEntry, &Hal::InterruptEntry::link> handlers[256];
 
+extern "C" void context_switch(uintptr_t *prev_rsp, uintptr_t next_rsp);
+extern "C" void context_enter_frame();
+
+extern "C" void context_finish_switch() { sched_finish_switch(); }
+
+// Stack pointer to give context_switch to resume a thread
+static uintptr_t resume_stack(Hal::CpuContext *ctx) {
+  if (auto rsp = ctx->kernel_rsp) {
+    ctx->kernel_rsp = 0;
+    ctx->load_state();
+    return rsp;
+  }
+
+  // It was interrupted: put its frame on its own stack, under where it was
+  // interrupted (or on top of its kernel stack if it was in userspace), and
+  // return to code that irets to it
+  auto top = ctx->regs.cs == 0x43 ? ctx->info.syscall_kernel_stack
+                                  : ctx->regs.rsp;
+  auto frame = (Hal::InterruptFrame *)ALIGN_DOWN(
+      top - sizeof(Hal::InterruptFrame), 16);
+
+  ctx->load(frame);
+
+  auto stack = (uintptr_t *)frame;
+
+  *--stack = (uintptr_t)context_enter_frame;
+
+  // rbp, rbx, r12-r15
+  for (size_t i = 0; i < 6; i++)
+    *--stack = 0;
+
+  return (uintptr_t)stack;
+}
+
+// What the thread the frame returns to was doing. Nested interrupts are seen
+// as system time, like the handler they interrupted.
+static CpuMode frame_mode(Hal::InterruptFrame *frame) {
+  return frame->cs & 3 ? CpuMode::USER : CpuMode::SYSTEM;
+}
+
+// The tick may have switched to another thread, which is charged for what's
+// left of the handler
+static void account_exit(Hal::InterruptFrame *frame) {
+  if (sched_curr())
+    sched_account(sched_curr()->cpu_mode, frame_mode(frame));
+}
+
 /* Faster dispatching this way */
 extern "C" uint64_t intr_timer_handler(uint64_t rsp) {
+  auto frame = (Hal::InterruptFrame *)rsp;
+
+  sched_account(frame_mode(frame), CpuMode::IRQ);
+
   timer_interrupt();
-  sched_tick((Hal::InterruptFrame *)rsp);
+  sched_tick(frame);
   lapic_eoi();
+
+  account_exit(frame);
   return (uintptr_t)(rsp);
 }
 
@@ -28,18 +83,49 @@ extern "C" uint64_t interrupts_handler(uint64_t rsp) {
   auto _ipl = ipl();
   bool should_panic = true;
 
+  // Exceptions are caused by the thread itself, unlike interrupts
+  sched_account(frame_mode(stack_frame),
+                stack_frame->intno < 32 ? CpuMode::SYSTEM : CpuMode::IRQ);
+
   // if pagefault, try resolving it
   if (stack_frame->intno == 0xe && sched_curr()) {
     auto space = sched_curr()->task->space;
 
     sched_curr()->in_fault = true;
 
-    should_panic =
-        !space->fault(read_cr2(), (Vm::Space::FaultFlags)stack_frame->err);
+    auto res =
+        space->fault(read_cr2(), (Vm::Space::FaultFlags)stack_frame->err);
+
+    // Free memory by killing a task and retry the access, we may be the one
+    // that gets killed. While a task killed elsewhere is still being torn
+    // down, the access is just retried. With nothing left to kill, the faulting
+    // task has to go (if it's already being torn down, that only gets this
+    // thread out of the way), unless it's the kernel.
+    if (res.is_err() && res.error().value() == Error::OUT_OF_MEMORY) {
+      should_panic = false;
+
+      if (Vm::oom_kill() == Vm::OomResult::NOTHING) {
+        if (space == Vm::kernel_space)
+          should_panic = true;
+        else
+          sched_exit_task(sched_curr()->task,
+                          task_signal_status(TASK_SIGKILL));
+      }
+    } else {
+      should_panic = res.is_err();
+    }
 
-    if (!should_panic) {
+    if (!should_panic)
       sched_curr()->in_fault = false;
-    }
+
+    if (res.is_ok())
+      __atomic_fetch_add(&sched_curr()->task->min_faults, 1, __ATOMIC_RELAXED);
+  }
+
+  // Device not available, the thread's SIMD state isn't loaded yet
+  if (stack_frame->intno == 7 && sched_curr() && sched_curr()->ctx.user) {
+    sched_curr()->ctx.load_fpu();
+    should_panic = false;
   }
 
   if (stack_frame->intno < 32 && should_panic) {
@@ -86,12 +172,15 @@ extern "C" uint64_t interrupts_handler(uint64_t rsp) {
     if (stack_frame->intno >= 32)
       lapic_eoi();
 
-    // This kinda sucks but who cares
+    // The interrupted thread's frame was saved, so this stack is left behind
+    // and the switch is finished on the next thread's
     if (stack_frame->intno == 240 && sched_curr()) {
-      sched_curr()->ctx.load(stack_frame);
+      uintptr_t unused;
+      context_switch(&unused, resume_stack(&sched_curr()->ctx));
     }
 
     iplx(_ipl);
+    account_exit(stack_frame);
     return rsp;
   }
 
@@ -110,6 +199,7 @@ extern "C" uint64_t interrupts_handler(uint64_t rsp) {
   }
 
   iplx(_ipl);
+  account_exit(stack_frame);
   return rsp;
 }
 
@@ -155,4 +245,9 @@ register_interrupt_handler(int vector, Hal::InterruptHandler *handler,
 
 void do_context_switch() { asm volatile("int $240"); }
 
+void switch_context(CpuContext *prev, CpuContext *next) {
+  prev->save_state();
+  Amd64::context_switch(&prev->kernel_rsp, Amd64::resume_stack(next));
+}
+
 } // namespace Gaia::Hal
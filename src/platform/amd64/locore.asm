@@ -145,6 +145,46 @@ _end2:
     iretq
 
 
+; void context_switch(uintptr_t *prev_rsp, uintptr_t next_rsp)
+; Save the callee-saved registers on the current stack, store the stack pointer
+; in prev_rsp and return on next_rsp's stack
+global context_switch
+context_switch:
+    push rbp
+    push rbx
+    push r12
+    push r13
+    push r14
+    push r15
+
+    mov [rdi], rsp
+    mov rsp, rsi
+
+    pop r15
+    pop r14
+    pop r13
+    pop r12
+    pop rbx
+    pop rbp
+
+    ret
+
+extern context_finish_switch
+
+; Where context_switch returns to for a thread that was interrupted, its frame
+; is right above
+global context_enter_frame
+context_enter_frame:
+    call context_finish_switch
+
+    popaq
+
+    add rsp, 16 ; pop errcode and int number
+    cmp qword [rsp+8], 0x43
+    jne _end3
+    swapgs
+_end3:
+    iretq
 
 INTERRUPT_NOERR 0
 INTERRUPT_NOERR 1
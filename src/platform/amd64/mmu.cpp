@@ -1,10 +1,14 @@
 #include "lib/error.hpp"
+#include <amd64/apic.hpp>
 #include <amd64/asm.hpp>
 #include <amd64/cpuid.hpp>
+#include <amd64/idt.hpp>
 #include <amd64/limine.h>
 #include <amd64/mmu.hpp>
 #include <hal/hal.hpp>
+#include <hal/int.hpp>
 #include <hal/mmu.hpp>
+#include <kernel/cpu.hpp>
 #include <vm/phys.hpp>
 #include <vm/vm.hpp>
 
@@ -24,6 +28,73 @@ extern const char data_start_addr[], data_end_addr[];
 static volatile struct limine_kernel_address_request kaddr_request = {
     .id = LIMINE_KERNEL_ADDRESS_REQUEST, .revision = 0, .response = nullptr};
 
+/*
+ * TLB shootdowns.
+ *
+ * Changing a PTE only invalidates it on the CPU doing it. The other CPUs that
+ * have the pagemap loaded are added to the current thread's tlb_stale, and are
+ * sent an IPI by flush_stale, which waits for all of them to have flushed.
+ *
+ * A CPU waiting for acks handles the flushes asked of it meanwhile, so that two
+ * CPUs flushing at the same time don't wait on each other forever.
+ */
+static constexpr uint8_t SHOOTDOWN_VECTOR = 0xf1;
+
+// Tables each CPU last loaded, other than the kernel's. They may be gone since,
+// the CPU then gets flushes it didn't need.
+static void *loaded[MAX_CPUS];
+
+// Flushes asked of each CPU, and the last one it did. A CPU is done with a
+// request once its done count caught up with the value the request got.
+static uint64_t flushes_requested[MAX_CPUS];
+static uint64_t flushes_done[MAX_CPUS];
+
+static InterruptEntry shootdown_entry;
+
+// NOTE: called from the IPI or at Ipl::HIGH, so that it can't nest
+static void do_shootdowns() {
+  auto id = cpu_self()->id;
+  auto requested = __atomic_load_n(&flushes_requested[id], __ATOMIC_ACQUIRE);
+
+  if (__atomic_load_n(&flushes_done[id], __ATOMIC_RELAXED) == requested)
+    return;
+
+  // Drops every translation that isn't global, user ones never are
+  write_cr3(read_cr3());
+
+  __atomic_store_n(&flushes_done[id], requested, __ATOMIC_RELEASE);
+}
+
+// Remember the other CPUs that may cache a translation of `context` we just
+// changed. NOTE: the pagemap's lock is held
+static void mark_stale(void *context) {
+  auto thread = Hal::get_current_thread();
+  auto self = cpu_self()->id;
+
+  // Pairs with the store in Pagemap::activate: a CPU we don't see there loads
+  // CR3 after our PTE write, and walks the new tables
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+  for (size_t i = 0; i < cpu_count(); i++) {
+    if (i != self && __atomic_load_n(&loaded[i], __ATOMIC_RELAXED) == context)
+      thread->tlb_stale |= 1ull << i;
+  }
+}
+
+// Whether a CPU caching `old` could do something `pte` doesn't allow
+static bool pte_downgraded(uint64_t old, uint64_t pte) {
+  if (!PTE_IS_PRESENT(old))
+    return false;
+
+  return !PTE_IS_PRESENT(pte) || PTE_GET_ADDR(old) != PTE_GET_ADDR(pte) ||
+         (PTE_IS_WRITABLE(old) && !PTE_IS_WRITABLE(pte)) ||
+         (!PTE_IS_NOT_EXECUTABLE(old) && PTE_IS_NOT_EXECUTABLE(pte));
+}
+
+static void invlpg(uintptr_t va) {
+  asm volatile("invlpg %0" : : "m"(*(const char *)va) : "memory");
+}
+
 static uint64_t *get_next_level(uint64_t *table, size_t index, bool allocate) {
 
   // If the entry is already present, just return it.
@@ -39,7 +110,13 @@ static uint64_t *get_next_level(uint64_t *table, size_t index, bool allocate) {
   }
 
   /* Otherwise, we allocate a new entry */
-  auto new_table = Gaia::Vm::phys_alloc(true).unwrap();
+  auto new_table_res = Gaia::Vm::phys_alloc(true);
+
+  if (new_table_res.is_err()) {
+    return nullptr;
+  }
+
+  auto new_table = new_table_res.unwrap();
 
   table[index] = (uintptr_t)new_table | PTE_PRESENT | PTE_USER | PTE_WRITABLE;
 
@@ -80,7 +157,8 @@ void Pagemap::copy(Pagemap *dest) {
   ASSERT(false);
 }
 
-void Pagemap::map(uintptr_t va, uintptr_t pa, Prot prot, Flags flags) {
+Result<Void, Error> Pagemap::map(uintptr_t va, uintptr_t pa, Prot prot,
+                                 Flags flags) {
 
   lock.lock();
 
@@ -99,44 +177,59 @@ void Pagemap::map(uintptr_t va, uintptr_t pa, Prot prot, Flags flags) {
   auto *pml3 = get_next_level((uint64_t *)Hal::phys_to_virt((uintptr_t)context),
                               level4, true);
 
+  if (!pml3) {
+    lock.unlock();
+    return Err(Error::OUT_OF_MEMORY);
+  }
+
   // If we're mapping 1G pages, we don't care about the rest of the mapping,
   // only the pml3.
   if (cpu_supports_1gb_pages && huge) {
     pml3[level3] = mmu_flags;
     lock.unlock();
-    return;
+    return Ok({});
   }
 
   // If we're mapping 2M pages, we don't care about the rest of the mapping,
   // only the pml2.
   auto *pml2 = get_next_level(pml3, level3, true);
 
+  if (!pml2) {
+    lock.unlock();
+    return Err(Error::OUT_OF_MEMORY);
+  }
+
   if (large) {
     pml2[level2] = mmu_flags;
     lock.unlock();
-    return;
+    return Ok({});
   }
 
   auto *pml1 = get_next_level(pml2, level2, true);
 
+  if (!pml1) {
+    lock.unlock();
+    return Err(Error::OUT_OF_MEMORY);
+  }
+
+  auto prev = pml1[level1];
+
   pml1[level1] = mmu_flags;
-  lock.unlock();
-}
 
-void Pagemap::remap(uintptr_t virt, Prot prot, Flags flags) {
+  // Copy-on-write and KSM replace pages that are mapped
+  if (PTE_IS_PRESENT(prev))
+    invlpg(va);
 
-  auto mapping = get_mapping(virt);
+  if (user && pte_downgraded(prev, mmu_flags))
+    mark_stale(context);
 
-  if (mapping.is_ok()) {
+  lock.unlock();
 
-    unmap(virt);
-    map(virt, mapping.unwrap().address, prot, flags);
-    asm volatile("invlpg %0" : : "m"(*((const char *)virt)) : "memory");
-  }
+  return Ok({});
 }
 
-void Pagemap::unmap(uintptr_t va) {
-  lock.lock();
+// The entry mapping `va`, at whatever level it is, nullptr if there is none
+static uint64_t *find_pte(void *context, uintptr_t va) {
   size_t level4 = PML_ENTRY(va, 39);
   size_t level3 = PML_ENTRY(va, 30);
   size_t level2 = PML_ENTRY(va, 21);
@@ -145,33 +238,71 @@ void Pagemap::unmap(uintptr_t va) {
   auto *pml3 = get_next_level((uint64_t *)Hal::phys_to_virt((uintptr_t)context),
                               level4, false);
 
+  if (!pml3)
+    return nullptr;
+
+  if (PTE_IS_HUGE(PTE_GET_FLAGS(pml3[level3])))
+    return &pml3[level3];
+
   auto *pml2 = get_next_level(pml3, level3, false);
+
+  if (!pml2)
+    return nullptr;
+
+  if (PTE_IS_HUGE(PTE_GET_FLAGS(pml2[level2])))
+    return &pml2[level2];
+
   auto *pml1 = get_next_level(pml2, level2, false);
 
-  uint64_t *pml = nullptr;
-  size_t level = 0;
+  if (!pml1)
+    return nullptr;
+
+  return &pml1[level1];
+}
 
-  if (PTE_IS_HUGE(PTE_GET_FLAGS(pml3[level3]))) {
-    pml = pml3;
-    level = level3;
-  } else if (PTE_IS_HUGE(PTE_GET_FLAGS(pml2[level2]))) {
-    pml = pml2;
-    level = level2;
-  } else {
-    pml = pml1;
-    level = level1;
+void Pagemap::remap(uintptr_t virt, Prot prot, Flags flags) {
+  lock.lock();
+
+  // Changed in place, so that a fault can't see the page unmapped meanwhile
+  auto pte = find_pte(context, virt);
+
+  if (pte && PTE_IS_PRESENT(*pte)) {
+    auto prev = *pte;
+
+    *pte = PTE_GET_ADDR(prev) | vm_prot_to_mmu(prot) |
+           (flags & Flags::USER ? PTE_USER : 0) | (prev & PTE_HUGE);
+
+    invlpg(virt);
+
+    if (user && pte_downgraded(prev, *pte))
+      mark_stale(context);
   }
 
-  ASSERT(pml != nullptr);
+  lock.unlock();
+}
+
+void Pagemap::unmap(uintptr_t va) {
+  lock.lock();
+
+  auto pte = find_pte(context, va);
+
+  ASSERT(pte != nullptr);
+
+  auto prev = *pte;
+
+  *pte = 0;
+
+  invlpg(va);
 
-  pml[level] = 0;
+  if (user && PTE_IS_PRESENT(prev))
+    mark_stale(context);
 
-  asm volatile("invlpg %0" : : "m"(va) : "memory");
   lock.unlock();
 }
 
-void Pagemap::init(bool kernel) {
-  context = (Gaia::Vm::phys_alloc(true).unwrap());
+Result<Void, Error> Pagemap::init(bool kernel) {
+  context = TRY(Gaia::Vm::phys_alloc(true));
+  user = !kernel;
 
   if (kernel) {
     for (int i = 256; i < 512; i++) {
@@ -244,9 +375,17 @@ void Pagemap::init(bool kernel) {
       pml4[i] = kern_pml4[i];
     }
   }
+
+  return Ok({});
 }
 
-void Pagemap::activate() { write_cr3((uintptr_t)context); }
+void Pagemap::activate() {
+  // The kernel pagemap is loaded before the CPU is set up, and never shot down
+  if (context != Gaia::Vm::kernel_pagemap.context)
+    __atomic_store_n(&loaded[cpu_self()->id], context, __ATOMIC_SEQ_CST);
+
+  write_cr3((uintptr_t)context);
+}
 
 static void destroy_intern(uint64_t *table, int depth) {
   for (int i = 0; i < (depth == 3 ? 255 : 512); ++i) {
@@ -308,6 +447,53 @@ void init() {
   } else {
     log("Using 2mb pages for direct map");
   }
+
+  register_interrupt_handler(
+      SHOOTDOWN_VECTOR, [](InterruptFrame *, void *) { do_shootdowns(); },
+      nullptr, &shootdown_entry)
+      .unwrap();
+}
+
+void flush_stale() {
+  auto thread = Hal::get_current_thread();
+
+  if (!thread || !thread->tlb_stale)
+    return;
+
+  // Keeps us on this CPU, and our ICR writes from being interleaved
+  auto ipl = iplx(Ipl::HIGH);
+  auto self = cpu_self()->id;
+  auto cpus = thread->tlb_stale;
+  uint64_t wanted[MAX_CPUS];
+
+  thread->tlb_stale = 0;
+
+  for (size_t i = 0; i < cpu_count(); i++) {
+    // We may have moved to one of them since, switching to us flushed it
+    if (i == self || !(cpus & (1ull << i)))
+      continue;
+
+    wanted[i] = __atomic_add_fetch(&flushes_requested[i], 1, __ATOMIC_SEQ_CST);
+    lapic_send_ipi(cpu_get(i)->data.lapic_id, SHOOTDOWN_VECTOR);
+  }
+
+  for (size_t i = 0; i < cpu_count(); i++) {
+    if (i == self || !(cpus & (1ull << i)))
+      continue;
+
+    while (__atomic_load_n(&flushes_done[i], __ATOMIC_ACQUIRE) < wanted[i]) {
+      do_shootdowns();
+      asm volatile("pause");
+    }
+  }
+
+  iplx(ipl);
+}
+
+void poll_shootdowns() {
+  auto ipl = iplx(Ipl::HIGH);
+  do_shootdowns();
+  iplx(ipl);
 }
 
 Pagemap get_current_map() { return Pagemap{(void *)read_cr3()}; }
@@ -1,7 +1,9 @@
 #include <amd64/asm.hpp>
 #include <amd64/cpuid.hpp>
 #include <amd64/simd.hpp>
+#include <kernel/ipl.hpp>
 #include <lib/log.hpp>
+#include <lib/spinlock.hpp>
 #include <vm/heap.hpp>
 #include <vm/phys.hpp>
 
@@ -10,6 +12,18 @@ static void (*simd_restore)(void *) = NULL;
 static size_t simd_buffer_size = 0;
 static uint8_t *initial_context = NULL;
 
+// Save areas are carved out of pages and kept in a free list, rounded up to
+// the 64 bytes alignment XSAVE needs
+static constexpr size_t SIMD_AREA_ALIGN = 64;
+
+struct FreeArea {
+  FreeArea *next;
+};
+
+static size_t area_size = 0;
+static FreeArea *free_areas = nullptr;
+static Gaia::Spinlock area_lock;
+
 using namespace Gaia::Amd64;
 using namespace Gaia;
 
@@ -17,13 +31,53 @@ static void simd_xsave(void *buffer) { xsave((uint8_t *)buffer); }
 
 static void simd_xrstor(void *buffer) { xrstor((uint8_t *)buffer); }
 
+static void simd_xsaveopt(void *buffer) { xsaveopt((uint8_t *)buffer); }
+
+static void simd_xsaves(void *buffer) { xsaves((uint8_t *)buffer); }
+
+static void simd_xrstors(void *buffer) { xrstors((uint8_t *)buffer); }
+
 static void simd_fxsave(void *buffer) { fxsave(buffer); }
 
 static void simd_fxrstor(void *buffer) { fxrstor(buffer); }
 
+// CPUID.(EAX=0Dh,ECX=1):EAX
+static constexpr uint32_t XSAVE_FEATURE_XSAVEOPT = 1 << 0;
+static constexpr uint32_t XSAVE_FEATURE_XSAVES = 1 << 3;
+
+static constexpr uint32_t MSR_IA32_XSS = 0xda0;
+
+// All three AVX-512 components must be enabled together
+static constexpr uint64_t XCR0_AVX512 =
+    XCR0_AVX512_ENABLE | XCR0_ZMM0_15_ENABLE | XCR0_ZMM16_32_ENABLE;
+
+static uint32_t xsave_features() {
+  if (!Cpuid::has_ecx_feature(Cpuid::Feature::ECX_XSAVE))
+    return 0;
+
+  return Cpuid::cpuid(CPUID_PROC_EXTENDED_STATE_ENUMERATION, 1).unwrap().eax;
+}
+
+// User state components to enable, out of the ones the CPU supports. MPX is
+// deprecated, and AMX would need much bigger save areas.
+static uint64_t xcr0_mask() {
+  auto leaf = Cpuid::cpuid(CPUID_PROC_EXTENDED_STATE_ENUMERATION).unwrap();
+  uint64_t supported = leaf.eax | ((uint64_t)leaf.edx << 32);
+  uint64_t xcr0 = XCR0_XSAVE_SAVE_X87 | XCR0_XSAVE_SAVE_SSE;
+
+  if (supported & XCR0_AVX_ENABLE) {
+    xcr0 |= XCR0_AVX_ENABLE;
+
+    if ((supported & XCR0_AVX512) == XCR0_AVX512)
+      xcr0 |= XCR0_AVX512;
+  }
+
+  return xcr0;
+}
+
 namespace Gaia::Amd64 {
 
-void simd_init(void) {
+void simd_init_cpu(void) {
   uint64_t cr0 = read_cr0();
 
   cr0 &= ~((uint64_t)CR0_EMULATION);
@@ -36,18 +90,42 @@ void simd_init(void) {
   write_cr4(read_cr4() | CR4_SIMD_EXCEPTION_SUPPORT);
 
   if (Cpuid::has_ecx_feature(Cpuid::Feature::ECX_XSAVE)) {
-    log("CPU supports xsave");
     write_cr4(read_cr4() | CR4_XSAVE_ENABLE);
 
-    uint64_t xcr0 = 0;
-    xcr0 |= XCR0_XSAVE_SAVE_X87;
-    xcr0 |= XCR0_XSAVE_SAVE_SSE;
-    write_xcr(0, xcr0);
+    write_xcr(0, xcr0_mask());
+
+    // No supervisor state components
+    if (xsave_features() & XSAVE_FEATURE_XSAVES)
+      wrmsr(MSR_IA32_XSS, 0);
+  }
+
+  fninit();
+}
+
+void simd_init(void) {
+  simd_init_cpu();
+
+  auto features = xsave_features();
+
+  // XSAVEOPT and XSAVES skip the components that are in their initial state or
+  // weren't modified since they were restored, XSAVES also uses the compacted
+  // format
+  // The sizes reported are for the components enabled in XCR0
+  if (features & XSAVE_FEATURE_XSAVES) {
+    log("CPU supports xsaves");
+
+    auto cpu = Cpuid::cpuid(CPUID_PROC_EXTENDED_STATE_ENUMERATION, 1).unwrap();
+    simd_save = simd_xsaves;
+    simd_restore = simd_xrstors;
+    simd_buffer_size = cpu.ebx;
+  } else if (Cpuid::has_ecx_feature(Cpuid::Feature::ECX_XSAVE)) {
+    log("CPU supports xsave{}",
+        features & XSAVE_FEATURE_XSAVEOPT ? ", xsaveopt" : "");
 
     auto cpu = Cpuid::cpuid(CPUID_PROC_EXTENDED_STATE_ENUMERATION).unwrap();
-    simd_save = simd_xsave;
+    simd_save = features & XSAVE_FEATURE_XSAVEOPT ? simd_xsaveopt : simd_xsave;
     simd_restore = simd_xrstor;
-    simd_buffer_size = cpu.ecx;
+    simd_buffer_size = cpu.ebx;
   } else {
     log("Using legacy fxsave");
     simd_save = simd_fxsave;
@@ -55,13 +133,64 @@ void simd_init(void) {
     simd_buffer_size = 512;
   }
 
-  fninit();
+  if (Cpuid::has_ecx_feature(Cpuid::Feature::ECX_XSAVE))
+    log("xcr0={:x}, {} bytes of SIMD state", read_xcr(0), simd_buffer_size);
 
-  initial_context = (uint8_t *)Hal::phys_to_virt(
-      (uintptr_t)::Gaia::Vm::phys_alloc(true).unwrap());
+  area_size = ALIGN_UP(simd_buffer_size, SIMD_AREA_ALIGN);
+  ASSERT(area_size <= Hal::PAGE_SIZE);
+
+  initial_context = (uint8_t *)simd_alloc_area().unwrap();
   simd_save(initial_context);
 }
 
+Result<void *, Error> simd_alloc_area() {
+  auto ipl = iplx(Ipl::HIGH);
+  area_lock.lock();
+
+  if (!free_areas) {
+    auto page = ::Gaia::Vm::phys_alloc();
+
+    if (page.is_err()) {
+      area_lock.unlock();
+      iplx(ipl);
+      return Err(Error::OUT_OF_MEMORY);
+    }
+
+    auto base = Hal::phys_to_virt((uintptr_t)page.unwrap());
+
+    for (size_t off = 0; off + area_size <= Hal::PAGE_SIZE; off += area_size) {
+      auto area = (FreeArea *)(base + off);
+      area->next = free_areas;
+      free_areas = area;
+    }
+  }
+
+  auto area = free_areas;
+  free_areas = area->next;
+
+  area_lock.unlock();
+  iplx(ipl);
+
+  // XSAVE doesn't write the reserved bytes of the XSAVE header, and XRSTOR
+  // faults unless they are zero. Areas saved to right away (e.g. when a thread
+  // is cloned) would otherwise keep whatever was there before.
+  memset(area, 0, area_size);
+
+  return Ok((void *)area);
+}
+
+void simd_free_area(void *area) {
+  auto ipl = iplx(Ipl::HIGH);
+  area_lock.lock();
+
+  auto entry = (FreeArea *)area;
+  entry->next = free_areas;
+  free_areas = entry;
+
+  area_lock.unlock();
+  iplx(ipl);
+}
+
 void simd_save_state(void *state) { simd_save(state); }
 
 void simd_restore_state(void *state) { simd_restore(state); }
@@ -69,4 +198,17 @@ void simd_restore_state(void *state) { simd_restore(state); }
 void simd_init_context(void *state) {
   memcpy(state, initial_context, simd_buffer_size);
 }
+
+void simd_copy_state(void *dst, const void *src) {
+  memcpy(dst, src, simd_buffer_size);
+}
+
+void simd_enable() { clts(); }
+
+void simd_disable() {
+  auto cr0 = read_cr0();
+
+  if (!(cr0 & CR0_TASK_SWITCHED))
+    write_cr0(cr0 | CR0_TASK_SWITCHED);
+}
 } // namespace Gaia::Amd64
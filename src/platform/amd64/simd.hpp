@@ -1,10 +1,28 @@
 /* SPDX-License-Identifier: BSD-2-Clause */
 #pragma once
+#include <lib/error.hpp>
+#include <lib/result.hpp>
 
 namespace Gaia::Amd64 {
 
 void simd_init();
+
+/// Enable FPU and SIMD instructions on the calling CPU
+void simd_init_cpu();
 void simd_save_state(void *state);
 void simd_restore_state(void *state);
 void simd_init_context(void *state);
+
+/// Allocate a save area sized for the state components the CPU has enabled,
+/// it must be initialized with simd_init_context or simd_copy_state
+Result<void *, Error> simd_alloc_area();
+void simd_free_area(void *area);
+
+void simd_copy_state(void *dst, const void *src);
+
+/// Allow SIMD instructions until the next simd_disable
+void simd_enable();
+
+/// Make the next SIMD instruction raise #NM, by setting CR0.TS
+void simd_disable();
 } // namespace Gaia::Amd64
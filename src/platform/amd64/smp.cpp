@@ -0,0 +1,86 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+#include <amd64/apic.hpp>
+#include <amd64/gdt.hpp>
+#include <amd64/idt.hpp>
+#include <amd64/limine.h>
+#include <amd64/simd.hpp>
+#include <amd64/smp.hpp>
+#include <amd64/syscall.hpp>
+#include <hal/hal.hpp>
+#include <kernel/cpu.hpp>
+#include <lib/log.hpp>
+#include <vm/heap.hpp>
+#include <vm/vm.hpp>
+
+namespace Gaia::Amd64 {
+
+void cpu_init(Cpu *cpu);
+
+volatile static struct limine_smp_request smp_request = {
+    .id = LIMINE_SMP_REQUEST, .revision = 0, .response = nullptr, .flags = 0};
+
+static size_t cpus_online = 1;
+
+static void ap_entry(struct limine_smp_info *info) {
+  auto cpu = (Cpu *)info->extra_argument;
+
+  // We're still on the bootloader's page tables
+  Vm::kernel_pagemap.activate();
+
+  cpu_init(cpu);
+  gdt_init();
+  idt_reload();
+  gdt_init_tss();
+  simd_init_cpu();
+  syscall_init();
+  lapic_init_secondary(cpu_get(0)->data.lapic_freq);
+
+  sched_init_cpu().unwrap();
+
+  __atomic_fetch_add(&cpus_online, 1, __ATOMIC_RELEASE);
+
+  // Wait for the first tick to pick something to run
+  Hal::enable_interrupts();
+  Hal::halt();
+}
+
+void smp_init() {
+  auto smp = smp_request.response;
+
+  if (!smp) {
+    log("Bootloader didn't start other CPUs, running on the BSP only");
+    return;
+  }
+
+  size_t started = 1;
+
+  for (size_t i = 0; i < smp->cpu_count; i++) {
+    auto info = smp->cpus[i];
+
+    if (info->lapic_id == smp->bsp_lapic_id)
+      continue;
+
+    if (cpu_count() >= MAX_CPUS) {
+      log("Ignoring CPUs past the first {}", MAX_CPUS);
+      break;
+    }
+
+    auto cpu = new (Vm::Subsystem::SCHED) Cpu{};
+    cpu->data.tables = gdt_alloc_tables();
+
+    sched_register_cpu(cpu);
+
+    info->extra_argument = (uint64_t)cpu;
+    __atomic_store_n(&info->goto_address, ap_entry, __ATOMIC_RELEASE);
+
+    started++;
+  }
+
+  while (__atomic_load_n(&cpus_online, __ATOMIC_ACQUIRE) != started) {
+    asm volatile("pause");
+  }
+
+  log("{} CPUs online", started);
+}
+
+} // namespace Gaia::Amd64
@@ -0,0 +1,9 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+#pragma once
+
+namespace Gaia::Amd64 {
+
+/// Start every AP reported by the bootloader, once the BSP is fully set up
+void smp_init();
+
+} // namespace Gaia::Amd64
@@ -13,6 +13,9 @@ namespace Gaia::Amd64 {
 
 uint64_t tsc_freq = 0;
 
+// The TSC isn't reset, so that it stays in sync between CPUs
+static uint64_t tsc_boot = 0;
+
 static inline uint16_t pit_read() {
   outb(0x43, 0);
   uint8_t lo = inb(0x40);
@@ -34,8 +37,7 @@ static void pit_sleep(uint32_t ms) {
 
 void timer_init(Dev::AcpiPc *acpi) {
 
-  // Reset TSC count
-  wrmsr(0x10, 0);
+  tsc_boot = rdtsc();
 
   // Try with CPUID first as it is the most precise option
   auto cpuid_result = Cpuid::cpuid(0x15);
@@ -84,7 +86,17 @@ void timer_init(Dev::AcpiPc *acpi) {
 uint64_t get_tsc_ms() {
   if (!tsc_freq)
     return 0;
-  return rdtsc() / tsc_freq;
+  return (rdtsc() - tsc_boot) / tsc_freq;
+}
+
+uint64_t get_tsc_ns() {
+  if (!tsc_freq)
+    return 0;
+  return (unsigned __int128)(rdtsc() - tsc_boot) * 1000000 / tsc_freq;
+}
+
+uint64_t ns_to_tsc(uint64_t ns) {
+  return (unsigned __int128)ns * tsc_freq / 1000000;
 }
 
 void timer_sleep(uint64_t ms) {
@@ -7,4 +7,10 @@ namespace Gaia::Amd64 {
 void timer_init(Dev::AcpiPc *acpi);
 void timer_sleep(uint64_t ms);
 
+/// Nanoseconds since boot
+uint64_t get_tsc_ns();
+
+/// Number of TSC ticks in `ns` nanoseconds
+uint64_t ns_to_tsc(uint64_t ns);
+
 } // namespace Gaia::Amd64
@@ -18,6 +18,13 @@ void debug_output(char c);
 
 Time get_time_since_boot();
 
+/// Nanoseconds since boot, never goes backwards
+uint64_t get_monotonic_ns();
+
+/// Fire the timer interrupt of the current CPU once in `ns` nanoseconds,
+/// replacing the previous deadline. 0 stops the timer.
+void arm_timer(uint64_t ns);
+
 void init_devices(Dev::AcpiPc *pc);
 
 uintptr_t phys_to_virt(uintptr_t phys);
@@ -26,6 +33,24 @@ uintptr_t virt_to_phys(uintptr_t virt);
 void disable_interrupts();
 void enable_interrupts();
 
+/// Number of idle states idle_wait can enter, 0 being the shallowest
+size_t idle_state_count();
+
+/// Shortest time (in ns) a CPU has to stay idle for `state` to be worth
+/// entering
+uint64_t idle_residency(size_t state);
+
+/// Whether idle_wait returns when the watched word is written to, otherwise
+/// only interrupts wake the CPU up
+bool idle_can_watch();
+
+/**
+ * @brief Sleep until an interrupt comes in or `*watch` stops being `value`
+ * @param state The idle state to enter, see idle_state_count
+ * Called with interrupts disabled, they are enabled when it returns.
+ */
+void idle_wait(uint32_t *watch, uint32_t value, size_t state);
+
 struct CpuContext;
 
 } // namespace Gaia::Hal
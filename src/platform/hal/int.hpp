@@ -7,6 +7,7 @@
 namespace Gaia::Hal {
 struct InterruptFrame;
 struct InterruptEntry;
+struct CpuContext;
 
 using InterruptHandler = void(InterruptFrame *, void *arg);
 Result<uint8_t, Error> allocate_interrupt(Ipl ipl, InterruptHandler *handler,
@@ -23,6 +24,11 @@ uint64_t get_time_of_day();
 
 void do_context_switch();
 
+/// Switch from `prev` to `next` without going through an interrupt, only the
+/// callee-saved registers and stack pointer of `prev` are kept. Returns once
+/// `prev` is switched back to.
+void switch_context(CpuContext *prev, CpuContext *next);
+
 Ipl get_ipl();
 void set_ipl(Ipl ipl);
 } // namespace Gaia::Hal
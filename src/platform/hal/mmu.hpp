@@ -24,7 +24,8 @@ enum Flags {
 
 class Pagemap {
 public:
-  void map(uintptr_t virt, uintptr_t phys, Prot prot, Flags flags);
+  Result<Void, Error> map(uintptr_t virt, uintptr_t phys, Prot prot,
+                          Flags flags);
   void remap(uintptr_t virt, Prot prot, Flags flags);
   void unmap(uintptr_t virt);
   void activate();
@@ -37,7 +38,7 @@ public:
 
   Result<Mapping, Error> get_mapping(uintptr_t virt);
 
-  void init(bool kernel);
+  Result<Void, Error> init(bool kernel);
 
   Pagemap() : context(nullptr){};
 
@@ -55,10 +56,30 @@ private:
 #endif
 
   frg::simple_spinlock lock;
+
+  // Only user pagemaps are shot down, see flush_stale
+  bool user = false;
 };
 
 void init();
 Pagemap get_current_map();
 
+/**
+ * @brief Make sure no other CPU still uses a translation the current thread
+ * removed or downgraded
+ *
+ * Unmapping or write-protecting a page only invalidates it on the local CPU,
+ * this is to be called before the page is freed or reused, and before relying
+ * on nobody being able to write to it.
+ *
+ * NOTE: no spinlock may be held, the CPUs we wait for may be spinning on it
+ * with interrupts disabled
+ */
+void flush_stale();
+
+/// Handle the flushes other CPUs asked of us, for loops that wait on another
+/// CPU with interrupts disabled
+void poll_shootdowns();
+
 } // namespace Vm
 } // namespace Gaia::Hal
@@ -23,6 +23,10 @@ inline Errno error_to_errno(Error error) {
     return ENOSYS;
   case Error::NOT_A_TTY:
     return ENOTTY;
+  case Error::TIMED_OUT:
+    return ETIMEDOUT;
+  case Error::WOULD_BLOCK:
+    return EAGAIN;
   default:
     return -1;
   }
@@ -107,8 +107,20 @@ Result<size_t, Error> TTY::Ops::read(dev_t minor, frg::span<uint8_t> buf,
     return Ok(0ul);
   }
 
+  // In non-canonical mode, VTIME (in tenths of a second) bounds how long we
+  // wait for input. We return as soon as something is there, so this is also
+  // the inter-byte timer when VMIN is set.
+  uint64_t timeout = -1;
+
+  if (!tty->is_lflag_set(ICANON) && tty->termios.c_cc[VTIME])
+    timeout = tty->termios.c_cc[VTIME] * 100000000ul;
+
   while (tty->buffer.size() == 0) {
-    tty->await_event(-1);
+    auto res = tty->await_event(timeout);
+
+    if (res.is_err() && res.error().value() == Error::TIMED_OUT &&
+        tty->buffer.size() == 0)
+      return Ok(0ul);
   }
 
   if (nbyte > tty->buffer.size()) {
@@ -10,12 +10,14 @@ AnonMap *AnonMap::copy() {
 
   for (auto entry : entries) {
 #if VM_ENABLE_COW
-    entry->anon->refcnt++;
-    new_amap->insert_anon(entry->anon);
+    entry->anon->retain();
+    new_amap->insert_anon(entry->anon, entry->offset);
 #else
+    auto page = phys_alloc().unwrap();
     entry->anon->lock.lock();
-    new_amap->insert_anon(entry->anon->copy());
+    auto new_anon = entry->anon->copy(page);
     entry->anon->lock.unlock();
+    new_amap->insert_anon(new_anon, entry->offset);
 #endif
   }
 
@@ -23,34 +25,100 @@ AnonMap *AnonMap::copy() {
 }
 
 void AnonMap::release() {
-  for (auto entry : entries) {
+  while (auto entry = entries.head()) {
+    entries.remove(entry);
+
+    rmap_lock.lock();
+    entry->anon->refs.remove(entry);
+    rmap_lock.unlock();
+
     entry->anon->release();
     delete entry;
   }
 
-  entries.reset();
-
   delete this;
 }
 
 frg::optional<AnonMap::Entry *> AnonMap::anon_at(uintptr_t off) {
   for (auto entry : entries) {
-    if (entry->anon->offset == off)
+    if (entry->offset == off)
       return entry;
   }
 
   return frg::null_opt;
 }
 
-void AnonMap::insert_anon(Anon *anon) {
+void AnonMap::insert_anon(Anon *anon, size_t offset) {
   auto entry = new (Vm::Subsystem::VM) Entry;
   entry->anon = anon;
+  entry->offset = offset;
+  entry->amap = this;
   entries.insert_tail(entry);
+
+  rmap_lock.lock();
+  anon->refs.insert_tail(entry);
+  rmap_lock.unlock();
+}
+
+void AnonMap::replace_anon(Entry *entry, Anon *anon) {
+  rmap_lock.lock();
+  entry->anon->refs.remove(entry);
+  entry->anon = anon;
+  anon->refs.insert_tail(entry);
+  rmap_lock.unlock();
+}
+
+void Anon::unmap_all() {
+  for_each_mapping([&](Space *space, uintptr_t address) {
+    auto mapping = space->pagemap->get_mapping(address);
+
+    if (mapping.is_ok() && mapping.unwrap().address == (uintptr_t)physpage)
+      space->pagemap->unmap(address);
+  });
+}
+
+void Anon::write_protect_all() {
+  for_each_mapping([&](Space *space, uintptr_t address) {
+    auto mapping = space->pagemap->get_mapping(address);
+
+    if (mapping.is_err() || mapping.unwrap().address != (uintptr_t)physpage)
+      return;
+
+    auto prot = mapping.unwrap().prot;
+
+    if (prot & Hal::Vm::Prot::WRITE) {
+      space->pagemap->remap(address, (Hal::Vm::Prot)(prot & ~Hal::Vm::WRITE),
+                            Hal::Vm::USER);
+    }
+  });
+}
+
+void Anon::remap_all() {
+  for_each_mapping([&](Space *space, uintptr_t address) {
+    auto mapping = space->pagemap->get_mapping(address);
+
+    if (mapping.is_err() || mapping.unwrap().address == (uintptr_t)physpage)
+      return;
+
+    space->pagemap->unmap(address);
+    space->pagemap->map(address, (uintptr_t)physpage, mapping.unwrap().prot,
+                        Hal::Vm::USER);
+  });
+}
+
+void Anon::retain() {
+  lock.lock();
+  refcnt++;
+  lock.unlock();
 }
 
 void Anon::release() {
+  lock.lock();
+  auto left = --refcnt;
+  lock.unlock();
+
   // If still referenced, don't free
-  if (--refcnt > 0)
+  if (left > 0)
     return;
 
   phys_free(physpage);
@@ -59,15 +127,13 @@ void Anon::release() {
   delete this;
 }
 
-Anon *Anon::copy() {
+Anon *Anon::copy(void *page) {
   ASSERT(lock.is_locked());
   ASSERT(this->physpage != nullptr);
 
-  auto newanon =
-      new (Vm::Subsystem::VM) Anon(phys_alloc(true).unwrap(), offset);
+  auto newanon = new (Vm::Subsystem::VM) Anon(page);
 
   newanon->refcnt = 1;
-  newanon->offset = offset;
 
   memcpy((void *)Hal::phys_to_virt((uintptr_t)newanon->physpage),
          (void *)Hal::phys_to_virt((uintptr_t)this->physpage), 0x1000);
@@ -0,0 +1,401 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+#include <frg/formatting.hpp>
+#include <fs/devfs.hpp>
+#include <fs/vfs.hpp>
+#include <hal/hal.hpp>
+#include <kernel/ipl.hpp>
+#include <kernel/main.hpp>
+#include <lib/log.hpp>
+#include <sys/stat.h>
+#include <vm/compact.hpp>
+#include <vm/heap.hpp>
+#include <vm/phys.hpp>
+#include <vm/vm.hpp>
+
+namespace Gaia::Vm {
+
+/*
+ * Memory compaction.
+ *
+ * Every page of a run is either free, movable or pinned. Only anons mapped by
+ * user spaces are movable: everything else (page tables, kernel heap, ...) is
+ * referenced by physical address from places we can't track.
+ *
+ * Compacting a run works in three steps:
+ *   1. the free pages of the run are taken out of the allocator, so nothing
+ *      can be allocated there while we work
+ *   2. every anon living in the run gets a new page outside of it, and the
+ *      PTEs mapping the old page are found through the reverse map and
+ *      pointed to the new one
+ *   3. the whole run goes back to the allocator as a single region
+ */
+
+// Set while a compaction is running, two of them could pick the same run
+static bool compacting = false;
+
+static struct {
+  size_t runs_freed;
+  size_t runs_failed;
+  size_t pages_migrated;
+} stats = {};
+
+static bool test_page(uint64_t *bitmap, uintptr_t phys) {
+  auto page = phys / Hal::PAGE_SIZE;
+  return bitmap[page / 64] & (1ull << (page % 64));
+}
+
+static void set_page(uint64_t *bitmap, uintptr_t phys) {
+  auto page = phys / Hal::PAGE_SIZE;
+  bitmap[page / 64] |= (1ull << (page % 64));
+}
+
+static void clear_page(uint64_t *bitmap, uintptr_t phys) {
+  auto page = phys / Hal::PAGE_SIZE;
+  bitmap[page / 64] &= ~(1ull << (page % 64));
+}
+
+static uint64_t *alloc_bitmap() {
+  auto words = DIV_CEIL(phys_highest_usable_page() / Hal::PAGE_SIZE, 64);
+  auto bitmap = new (Vm::Subsystem::VM) uint64_t[words];
+
+  if (bitmap) {
+    memset(bitmap, 0, words * sizeof(uint64_t));
+  }
+
+  return bitmap;
+}
+
+static void mark_movable(uint64_t *movable) {
+  user_spaces_lock.lock();
+
+  for (auto space : user_spaces()) {
+    space->for_each_anon([&](AnonMap::Entry *aent, uintptr_t) {
+      set_page(movable, (uintptr_t)aent->anon->physpage);
+    });
+  }
+
+  user_spaces_lock.unlock();
+}
+
+// Find the run aligned to `align` that needs the fewest migrations. A window of
+// the run's size slides over each free region of the memory map, counting the
+// pages that would have to move and the ones that can't.
+static Result<uintptr_t, Error> pick_run(size_t size, size_t align,
+                                         uint64_t *free, uint64_t *movable) {
+  uintptr_t best = 0;
+  size_t best_cost = SIZE_MAX;
+
+  for (auto entry : charon().memory_map) {
+    if (entry.type != FREE)
+      continue;
+
+    // Pages in [lo, hi) are counted
+    uintptr_t lo = ALIGN_UP(entry.base, align), hi = lo;
+    size_t cost = 0, pinned = 0;
+
+    auto count = [&](uintptr_t page, int n) {
+      if (test_page(free, page))
+        return;
+
+      if (test_page(movable, page))
+        cost += n;
+      else
+        pinned += n;
+    };
+
+    for (auto base = lo; base + size <= entry.base + entry.size;
+         base += align) {
+      for (; lo < base; lo += Hal::PAGE_SIZE) {
+        if (lo < hi)
+          count(lo, -1);
+      }
+
+      hi = MAX(hi, base);
+
+      for (; hi < base + size; hi += Hal::PAGE_SIZE)
+        count(hi, 1);
+
+      if (!pinned && cost < best_cost) {
+        best = base;
+        best_cost = cost;
+      }
+    }
+  }
+
+  if (best_cost == SIZE_MAX) {
+    return Err(Error::OUT_OF_MEMORY);
+  }
+
+  return Ok(best);
+}
+
+// Move `anon` to `page`. The caller holds a reference on it, which makes a
+// write fault copy the page instead of making it writable again: once every
+// mapping is read-only and no CPU has a writable TLB entry left, the content
+// can't change under us and is copied with no lock held.
+static void migrate_anon(Anon *anon, void *page) {
+  auto ipl = iplx(Ipl::HIGH);
+
+  anon->lock.lock();
+  anon->write_protect_all();
+
+  auto old = anon->physpage;
+
+  anon->lock.unlock();
+  iplx(ipl);
+
+  Hal::Vm::flush_stale();
+
+  memcpy((void *)Hal::phys_to_virt((uintptr_t)page),
+         (void *)Hal::phys_to_virt((uintptr_t)old), Hal::PAGE_SIZE);
+
+  ipl = iplx(Ipl::HIGH);
+  anon->lock.lock();
+
+  // Only compaction moves pages, and only one runs at a time
+  ASSERT(anon->physpage == old);
+
+  anon->physpage = page;
+  anon->remap_all();
+
+  anon->lock.unlock();
+  iplx(ipl);
+
+  // The old page may still be in another CPU's TLB
+  Hal::Vm::flush_stale();
+}
+
+// Move every anon out of [base, base + size), `moved` gets the bit of every
+// page that was vacated. Returns false if we ran out of memory on the way.
+// Only the walk and each page's bookkeeping run at Ipl::HIGH.
+static bool migrate_run(uintptr_t base, size_t size, uint64_t *moved) {
+  auto in_run = [&](uintptr_t phys) {
+    return phys >= base && phys < base + size;
+  };
+
+  // Every page of the run is backing at most one anon
+  auto anons = new (Vm::Subsystem::VM) Anon *[size / Hal::PAGE_SIZE];
+  size_t count = 0;
+
+  if (!anons)
+    return false;
+
+  // Moving a page means waiting for the other CPUs, which can't be done with
+  // the walk's locks held, so the anons are collected first
+  auto ipl = iplx(Ipl::HIGH);
+  user_spaces_lock.lock();
+
+  for (auto space : user_spaces()) {
+    space->for_each_anon([&](AnonMap::Entry *aent, uintptr_t) {
+      auto anon = aent->anon;
+      auto old = (uintptr_t)anon->physpage;
+
+      // Shared anons are seen once per sharer, but only moved once
+      if (!in_run(old) || test_page(moved, old))
+        return;
+
+      anon->retain();
+      anons[count++] = anon;
+      set_page(moved, old);
+    });
+  }
+
+  user_spaces_lock.unlock();
+  iplx(ipl);
+
+  bool ok = true;
+
+  for (size_t i = 0; i < count; i++) {
+    auto anon = anons[i];
+
+    if (ok) {
+      ipl = iplx(Ipl::HIGH);
+      auto page = phys_alloc();
+      iplx(ipl);
+
+      if (page.is_ok()) {
+        migrate_anon(anon, page.unwrap());
+        stats.pages_migrated++;
+      } else {
+        ok = false;
+      }
+    }
+
+    ipl = iplx(Ipl::HIGH);
+
+    // Not vacated after all
+    if (!ok)
+      clear_page(moved, (uintptr_t)anon->physpage);
+
+    // If every sharer went away meanwhile, this frees the new page
+    anon->release();
+
+    iplx(ipl);
+  }
+
+  delete[] anons;
+
+  return ok;
+}
+
+static Result<Void, Error> compact(size_t nblocks, size_t align) {
+  auto size = nblocks * COMPACT_BLOCK_SIZE;
+
+  auto free = alloc_bitmap();
+  auto movable = alloc_bitmap();
+
+  if (!free || !movable) {
+    delete[] free;
+    delete[] movable;
+    return Err(Error::OUT_OF_MEMORY);
+  }
+
+  // A snapshot, pages allocated or freed meanwhile are checked when the run is
+  // isolated
+  auto ipl = iplx(Ipl::HIGH);
+
+  phys_free_bitmap(free);
+  mark_movable(movable);
+
+  iplx(ipl);
+
+  auto run = pick_run(size, align, free, movable);
+
+  if (run.is_err()) {
+    delete[] free;
+    delete[] movable;
+    return Err(Error::OUT_OF_MEMORY);
+  }
+
+  auto base = run.unwrap();
+
+  // From now on, `free` holds the pages of the run we own
+  memset(free, 0, DIV_CEIL(phys_highest_usable_page() / Hal::PAGE_SIZE, 64) *
+                      sizeof(uint64_t));
+
+  ipl = iplx(Ipl::HIGH);
+  auto isolated = phys_isolate(base, size / Hal::PAGE_SIZE, free);
+  iplx(ipl);
+
+  auto migrated = migrate_run(base, size, free);
+
+  bool complete = true;
+
+  for (auto page = base; page < base + size; page += Hal::PAGE_SIZE) {
+    if (!test_page(free, page)) {
+      complete = false;
+      break;
+    }
+  }
+
+  ipl = iplx(Ipl::HIGH);
+
+  if (complete) {
+    phys_free_contiguous((void *)base, size / Hal::PAGE_SIZE);
+  } else {
+    // Something got in the way, give back what we took
+    for (auto page = base; page < base + size; page += Hal::PAGE_SIZE) {
+      if (test_page(free, page))
+        phys_free((void *)page);
+    }
+  }
+
+  iplx(ipl);
+
+  log("compact: {} run at {:x}, {} pages were free, migration {}",
+      complete ? "freed" : "failed to free", base, isolated,
+      migrated ? "done" : "ran out of memory");
+
+  delete[] free;
+  delete[] movable;
+
+  if (!complete) {
+    return Err(Error::OUT_OF_MEMORY);
+  }
+
+  return Ok({});
+}
+
+Result<Void, Error> compact_memory(size_t nblocks, size_t align) {
+  if (__atomic_exchange_n(&compacting, true, __ATOMIC_ACQUIRE))
+    return Err(Error::OUT_OF_MEMORY);
+
+  auto ret = compact(nblocks, MAX(align, COMPACT_BLOCK_SIZE));
+
+  if (ret.is_ok())
+    stats.runs_freed++;
+  else
+    stats.runs_failed++;
+
+  __atomic_store_n(&compacting, false, __ATOMIC_RELEASE);
+
+  return ret;
+}
+
+// Reading gives the counters, writing a number of blocks compacts memory until
+// a run of that many blocks is free
+class CompactDev : public Fs::DeviceOps {
+public:
+  Result<size_t, Error> read(dev_t minor, frg::span<uint8_t> buf,
+                             off_t off) override {
+    (void)minor;
+
+    Vm::String text = "runs_freed runs_failed pages_migrated\n";
+
+    frg::output_to(text) << frg::fmt("{} {} {}\n", stats.runs_freed,
+                                     stats.runs_failed, stats.pages_migrated);
+
+    if ((size_t)off >= text.size())
+      return Ok((size_t)0);
+
+    size_t left = text.size() - off;
+    auto count = buf.size() < left ? buf.size() : left;
+    memcpy(buf.data(), text.data() + off, count);
+
+    return Ok(count);
+  }
+
+  Result<size_t, Error> write(dev_t minor, frg::span<uint8_t> buf,
+                              off_t off) override {
+    (void)minor;
+    (void)off;
+
+    size_t nblocks = 0, i = 0;
+
+    while (i < buf.size() && buf.data()[i] >= '0' && buf.data()[i] <= '9')
+      nblocks = nblocks * 10 + (buf.data()[i++] - '0');
+
+    if (i == 0 || nblocks == 0)
+      return Err(Error::INVALID_PARAMETERS);
+
+    TRY(compact_memory(nblocks));
+
+    return Ok(buf.size());
+  }
+
+  Result<uint64_t, Error> ioctl(dev_t minor, uint64_t request,
+                                void *arg) override {
+    (void)minor;
+    (void)request;
+    (void)arg;
+    return Err(Error::INVALID_PARAMETERS);
+  }
+
+  Result<Fs::VnodeAttr, Error> getattr(dev_t minor) override {
+    (void)minor;
+    auto ret = Fs::VnodeAttr{};
+
+    ret.mode = S_IFCHR;
+
+    return Ok(ret);
+  }
+};
+
+void compact_create_dev() {
+  auto maj = Fs::dev_alloc_major(new CompactDev).unwrap();
+
+  Fs::vfs_find_and("/dev/compact", MAKEDEV(maj, 0), Fs::vfs_create_file)
+      .unwrap();
+}
+
+} // namespace Gaia::Vm
@@ -0,0 +1,26 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+#pragma once
+#include <lib/base.hpp>
+#include <lib/error.hpp>
+#include <lib/result.hpp>
+
+namespace Gaia::Vm {
+
+/// Granularity at which memory is compacted, the size of a large page
+constexpr size_t COMPACT_BLOCK_SIZE = MIB(2);
+
+/**
+ * @brief Migrate movable pages until a free run of blocks is available
+ *
+ * @param nblocks The number of contiguous COMPACT_BLOCK_SIZE blocks to free
+ * @param align The alignment of the run in bytes, at least COMPACT_BLOCK_SIZE
+ *
+ * @return Ok if the run was freed, OUT_OF_MEMORY if no run could be freed
+ */
+Result<Void, Error> compact_memory(size_t nblocks = 1,
+                                   size_t align = COMPACT_BLOCK_SIZE);
+
+/// Create /dev/compact
+void compact_create_dev();
+
+} // namespace Gaia::Vm
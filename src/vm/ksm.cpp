@@ -0,0 +1,694 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+#include <frg/formatting.hpp>
+#include <fs/devfs.hpp>
+#include <fs/vfs.hpp>
+#include <kernel/ipl.hpp>
+#include <kernel/sched.hpp>
+#include <kernel/timer.hpp>
+#include <lib/log.hpp>
+#include <sys/stat.h>
+#include <vm/heap.hpp>
+#include <vm/ksm.hpp>
+#include <vm/reclaim.hpp>
+#include <vm/vm.hpp>
+
+namespace Gaia::Vm {
+
+/*
+ * Same-page merging, loosely modeled after Linux's KSM.
+ *
+ * The scanner walks every anon of every user space in small batches. A page
+ * only becomes a merge candidate once its checksum stayed the same for two
+ * passes, so pages that are constantly being written to don't get merged (and
+ * immediately copied back on the next write fault).
+ *
+ * Candidates are looked up in two tables:
+ *   - the stable table holds anons that are already shared read-only, KSM
+ *     keeps a reference to each of them so they can't go away under us
+ *   - the unstable table holds candidates seen during the current pass, it is
+ *     only a hint and every entry is revalidated before being used
+ *
+ * Merged pages are mapped read-only, writing to one goes through the regular
+ * copy-on-write path in Object::fault.
+ */
+
+struct KsmNode {
+  uint64_t checksum;
+
+  // Stable nodes
+  Anon *anon = nullptr;
+
+  // Unstable nodes
+  Space *space = nullptr;
+  uintptr_t address = 0;
+
+  ListNode<KsmNode> link;
+};
+
+using KsmTable = List<KsmNode, &KsmNode::link>;
+
+static constexpr size_t KSM_BUCKETS = 256;
+
+// Pages walked over at Ipl::HIGH at once, they're hashed once the walk is done
+static constexpr size_t KSM_CHUNK = 16;
+
+// The shrinker prunes the stable table from the pagedaemon, the unstable one is
+// only ever touched by the scanner
+static Spinlock table_lock;
+static KsmTable stable_table[KSM_BUCKETS];
+static KsmTable unstable_table[KSM_BUCKETS];
+
+static size_t pages_per_batch = 0;
+static uint64_t batch_sleep_ms = 0;
+static KsmStats stats = {};
+
+// Where the last batch stopped: the space, the mapping's start and the amap
+// entry. The entry's owner is retained so the entry stays valid.
+static struct {
+  uint64_t space_id;
+  uintptr_t start;
+  Object *owner;
+  AnonMap::Entry *aent;
+} cursor = {};
+
+static uint64_t page_checksum(void *physpage) {
+  auto words = (uint64_t *)Hal::phys_to_virt((uintptr_t)physpage);
+
+  // FNV-1a, over 64-bit words instead of bytes
+  uint64_t hash = 0xcbf29ce484222325;
+  for (size_t i = 0; i < Hal::PAGE_SIZE / sizeof(uint64_t); i++) {
+    hash ^= words[i];
+    hash *= 0x100000001b3;
+  }
+
+  return hash;
+}
+
+static bool same_content(void *a, void *b) {
+  return memcmp((void *)Hal::phys_to_virt((uintptr_t)a),
+                (void *)Hal::phys_to_virt((uintptr_t)b), Hal::PAGE_SIZE) == 0;
+}
+
+// NOTE: user_spaces_lock is held
+static bool space_alive(Space *space) {
+  for (auto s : user_spaces()) {
+    if (s == space)
+      return true;
+  }
+
+  return false;
+}
+
+// A page whose content didn't change since the last pass. Its amap entry stays
+// valid while we hold a reference on the object owning it.
+struct Candidate {
+  Space *space;
+  uintptr_t address;
+  Object *owner;
+  AnonMap::Entry *aent;
+  uint64_t checksum;
+};
+
+static void lock_owners(Object *a, Object *b) {
+  a->lock.lock();
+
+  if (b && b != a)
+    b->lock.lock();
+}
+
+static void unlock_owners(Object *a, Object *b) {
+  if (b && b != a)
+    b->lock.unlock();
+
+  a->lock.unlock();
+}
+
+// The anon lock keeps compaction from moving the page under us
+static void write_protect(Anon *anon) {
+  anon->lock.lock();
+  anon->write_protect_all();
+  anon->lock.unlock();
+}
+
+static void *physpage_of(Anon *anon) {
+  anon->lock.lock();
+  auto ret = anon->physpage;
+  anon->lock.unlock();
+
+  return ret;
+}
+
+// Dropping a reference may free the page, which is done at Ipl::HIGH like every
+// other VM operation
+static void release_anon(Anon *anon) {
+  auto ipl = iplx(Ipl::HIGH);
+  anon->release();
+  iplx(ipl);
+}
+
+static void release_owner(Object *owner) {
+  auto ipl = iplx(Ipl::HIGH);
+  owner->release();
+  iplx(ipl);
+}
+
+/*
+ * Merge the candidate's page into `target`, if they have the same content.
+ * `other` is the candidate `target` was found as if it isn't stable yet, its
+ * owner has to be locked as well to keep it from being written to. The caller
+ * holds a reference on `target`.
+ *
+ * Both pages are write-protected first, and only compared once the other CPUs
+ * dropped their TLB entries for them: a stale writable entry would let a write
+ * land after the comparison. The reference we hold on the candidate's anon
+ * meanwhile makes a write fault copy the page instead of making it writable
+ * again, so it's enough to check that neither page was copied away.
+ *
+ * The pages are compared with no lock held, at the thread's IPL. Compaction
+ * may move either of them meanwhile, so the merge is off if one did.
+ *
+ * KSM is the only one holding two object (or anon) locks, there is no order to
+ * respect between them.
+ */
+static bool try_merge(Candidate &cand, Anon *target, Candidate *other) {
+  auto other_owner = other ? other->owner : nullptr;
+  void *page = nullptr, *target_page = nullptr;
+
+  auto ipl = iplx(Ipl::HIGH);
+
+  lock_owners(cand.owner, other_owner);
+
+  auto anon = cand.aent->anon;
+
+  bool ok = anon != target && anon->refcnt == 1 &&
+            (!other || (other->aent->anon == target && target->refcnt == 2));
+
+  if (ok) {
+    anon->retain();
+    write_protect(anon);
+    write_protect(target);
+  }
+
+  unlock_owners(cand.owner, other_owner);
+  iplx(ipl);
+
+  if (!ok)
+    return false;
+
+  Hal::Vm::flush_stale();
+
+  auto still_there = [&] {
+    return cand.aent->anon == anon && anon->refcnt == 2 &&
+           (!other || (other->aent->anon == target && target->refcnt == 2));
+  };
+
+  ipl = iplx(Ipl::HIGH);
+  lock_owners(cand.owner, other_owner);
+
+  ok = still_there();
+
+  if (ok) {
+    page = physpage_of(anon);
+    target_page = physpage_of(target);
+  }
+
+  unlock_owners(cand.owner, other_owner);
+  iplx(ipl);
+
+  ok = ok && same_content(page, target_page);
+
+  if (ok) {
+    ipl = iplx(Ipl::HIGH);
+    lock_owners(cand.owner, other_owner);
+
+    ok = still_there();
+
+    if (ok) {
+      anon->lock.lock();
+      target->lock.lock();
+
+      ok = anon->physpage == page && target->physpage == target_page;
+
+      if (ok) {
+        // The old page was write-protected before being compared, so are the
+        // new mappings
+        target->refcnt++;
+        cand.aent->amap->replace_anon(cand.aent, target);
+        target->remap_all();
+      }
+
+      target->lock.unlock();
+      anon->lock.unlock();
+    }
+
+    unlock_owners(cand.owner, other_owner);
+    iplx(ipl);
+  }
+
+  if (ok) {
+    // The old page may still be in another CPU's TLB
+    Hal::Vm::flush_stale();
+    release_anon(anon);
+  }
+
+  release_anon(anon);
+
+  return ok;
+}
+
+// Checksum collisions are rare enough that only the first match is tried
+static bool try_stable(Candidate &cand) {
+  Anon *stable = nullptr;
+
+  auto ipl = iplx(Ipl::HIGH);
+  table_lock.lock();
+
+  for (auto node : stable_table[cand.checksum % KSM_BUCKETS]) {
+    if (node->checksum == cand.checksum) {
+      stable = node->anon;
+      stable->retain();
+      break;
+    }
+  }
+
+  table_lock.unlock();
+  iplx(ipl);
+
+  if (!stable)
+    return false;
+
+  bool merged = try_merge(cand, stable, nullptr);
+
+  release_anon(stable);
+
+  return merged;
+}
+
+// Find the unstable candidate at `node`, it may have been unmapped or written
+// to since it was seen
+static bool resolve(KsmNode *node, Candidate &other) {
+  bool found = false;
+
+  auto ipl = iplx(Ipl::HIGH);
+  user_spaces_lock.lock();
+
+  if (space_alive(node->space)) {
+    auto aent = node->space->anon_at(node->address, other.owner);
+
+    if (aent.has_value()) {
+      other.space = node->space;
+      other.address = node->address;
+      other.aent = aent.value();
+      other.checksum = node->checksum;
+      found = true;
+    }
+  }
+
+  user_spaces_lock.unlock();
+  iplx(ipl);
+
+  return found;
+}
+
+static bool try_unstable(Candidate &cand) {
+  auto &bucket = unstable_table[cand.checksum % KSM_BUCKETS];
+
+  for (auto node : bucket) {
+    Candidate other;
+
+    if (node->checksum != cand.checksum || !resolve(node, other))
+      continue;
+
+    auto ipl = iplx(Ipl::HIGH);
+    other.owner->lock.lock();
+
+    auto other_anon = other.aent->anon;
+    bool same = other_anon->checksum == cand.checksum;
+
+    if (same)
+      other_anon->retain();
+
+    other.owner->lock.unlock();
+    iplx(ipl);
+
+    bool merged = same && try_merge(cand, other_anon, &other);
+
+    release_owner(other.owner);
+
+    if (!same)
+      continue;
+
+    if (!merged) {
+      release_anon(other_anon);
+      continue;
+    }
+
+    // The other page moves to the stable table, along with our reference
+    bucket.remove(node);
+
+    node->anon = other_anon;
+    node->space = nullptr;
+    node->address = 0;
+
+    ipl = iplx(Ipl::HIGH);
+    table_lock.lock();
+    stable_table[cand.checksum % KSM_BUCKETS].insert_tail(node);
+    table_lock.unlock();
+    iplx(ipl);
+
+    return true;
+  }
+
+  auto node = new (Vm::Subsystem::VM) KsmNode;
+  node->checksum = cand.checksum;
+  node->space = cand.space;
+  node->address = cand.address;
+  bucket.insert_tail(node);
+
+  return false;
+}
+
+// A page picked by the walk, hashed once every lock is dropped
+struct ScanItem {
+  Candidate cand;
+  Anon *anon;
+  void *physpage;
+};
+
+// Whether a page that was just hashed is worth trying to merge. The page may
+// have been moved or copied away since it was picked, the checksum is only kept
+// if it wasn't.
+static bool check_page(ScanItem &item) {
+  auto &cand = item.cand;
+  bool ok = false;
+
+  auto ipl = iplx(Ipl::HIGH);
+  cand.owner->lock.lock();
+
+  auto anon = cand.aent->anon;
+
+  if (anon == item.anon && anon->refcnt == 1 &&
+      physpage_of(anon) == item.physpage) {
+    stats.pages_scanned++;
+
+    // Page changed since last pass, it's too volatile to be merged
+    ok = cand.checksum == anon->checksum;
+    anon->checksum = cand.checksum;
+  }
+
+  cand.owner->lock.unlock();
+  iplx(ipl);
+
+  return ok;
+}
+
+// Looking for a page to merge into means locking other objects, so candidates
+// are merged once the walk is done
+static void merge_candidate(Candidate &cand) {
+  if (!try_stable(cand))
+    try_unstable(cand);
+
+  release_owner(cand.owner);
+}
+
+// Drop the stable nodes nobody maps anymore, returns the number of pages freed
+static size_t prune_stable(size_t target) {
+  size_t freed = 0;
+
+  table_lock.lock();
+
+  for (auto &bucket : stable_table) {
+    auto node = bucket.head();
+
+    while (node && freed < target) {
+      auto next = node->link.next;
+
+      // Only our reference is left
+      if (node->anon->refcnt == 1) {
+        bucket.remove(node);
+        node->anon->release();
+        delete node;
+        freed++;
+      }
+
+      node = next;
+    }
+  }
+
+  table_lock.unlock();
+
+  return freed;
+}
+
+static Shrinker ksm_shrinker = {.shrink = prune_stable, .link = {}};
+
+static void end_pass() {
+  size_t shared = 0, sharing = 0;
+
+  auto ipl = iplx(Ipl::HIGH);
+
+  prune_stable(-1);
+
+  table_lock.lock();
+
+  for (auto &bucket : stable_table) {
+    for (auto node : bucket) {
+      shared++;
+      sharing += node->anon->refcnt - 2;
+    }
+  }
+
+  table_lock.unlock();
+  iplx(ipl);
+
+  for (auto &bucket : unstable_table) {
+    while (auto node = bucket.head()) {
+      bucket.remove(node);
+      delete node;
+    }
+  }
+
+  stats.pages_shared = shared;
+  stats.pages_sharing = sharing;
+  stats.full_scans++;
+
+  if (sharing) {
+    log("ksm: pass {} done, {} pages shared, {} pages saved", stats.full_scans,
+        shared, sharing);
+  }
+}
+
+// Pick the next pages worth hashing, up to KSM_CHUNK of them, resuming the walk
+// at the cursor. `visited` counts every page walked over. Returns how many were
+// picked, `done` is set once the pass is over.
+static size_t pick_pages(ScanItem *items, size_t batch, size_t &visited,
+                         bool &done) {
+  size_t walked = 0, n = 0;
+  bool stop = false;
+  auto prev = cursor.owner;
+
+  auto ipl = iplx(Ipl::HIGH);
+  user_spaces_lock.lock();
+
+  for (auto space : user_spaces()) {
+    if (space->id < cursor.space_id)
+      continue;
+
+    auto visit = [&](AnonMap::Entry *aent, uintptr_t address) {
+      auto owner = aent->amap->owner;
+      auto anon = aent->anon;
+
+      // Either already merged or shared copy-on-write, nothing to gain
+      if (anon->refcnt == 1) {
+        // We hold its lock
+        owner->refcnt++;
+
+        items[n++] = {{space, address, owner, aent, 0}, anon,
+                      physpage_of(anon)};
+      }
+
+      walked++;
+      visited++;
+
+      if (walked == KSM_CHUNK || visited >= batch) {
+        owner->refcnt++;
+
+        cursor = {space->id, address - aent->offset * Hal::PAGE_SIZE, owner,
+                  aent};
+        stop = true;
+      }
+
+      return !stop;
+    };
+
+    if (space->id == cursor.space_id)
+      space->for_each_anon_from(cursor.start, cursor.owner, cursor.aent,
+                                visit);
+    else
+      space->for_each_anon_from(0, nullptr, nullptr, visit);
+
+    if (stop)
+      break;
+  }
+
+  user_spaces_lock.unlock();
+
+  if (prev)
+    prev->release();
+
+  if (!stop)
+    cursor = {};
+
+  iplx(ipl);
+
+  done = !stop;
+
+  return n;
+}
+
+// Scan the next batch of pages, returns true when the pass is over. Only the
+// walk and the checks that follow the hashing run at Ipl::HIGH, a chunk at a
+// time. Hashing and comparing pages is done at the thread's IPL.
+static bool scan_batch() {
+  auto batch = __atomic_load_n(&pages_per_batch, __ATOMIC_RELAXED);
+  size_t visited = 0;
+  ScanItem items[KSM_CHUNK];
+
+  while (visited < batch) {
+    bool done;
+    auto n = pick_pages(items, batch, visited, done);
+
+    for (size_t i = 0; i < n; i++) {
+      auto &item = items[i];
+
+      item.cand.checksum = page_checksum(item.physpage);
+
+      if (check_page(item))
+        merge_candidate(item.cand);
+      else
+        release_owner(item.cand.owner);
+    }
+
+    if (done)
+      return true;
+  }
+
+  return false;
+}
+
+static void ksm_thread() {
+  while (true) {
+    if (scan_batch())
+      end_pass();
+
+    auto sleep_ms = __atomic_load_n(&batch_sleep_ms, __ATOMIC_RELAXED);
+
+    Timer timer(nullptr, sleep_ms * 1000000);
+    timer_enqueue(&timer).unwrap();
+    timer.await_event(-1).unwrap();
+  }
+}
+
+Result<Void, Error> ksm_start(size_t pages_to_scan, uint64_t sleep_ms) {
+  ksm_set_rate(pages_to_scan, sleep_ms);
+
+  reclaim_register(&ksm_shrinker);
+
+  TRY(sched_new_worker_thread("ksm", (uintptr_t)ksm_thread));
+
+  return Ok({});
+}
+
+void ksm_set_rate(size_t pages_to_scan, uint64_t sleep_ms) {
+  __atomic_store_n(&pages_per_batch, pages_to_scan ? pages_to_scan : 1,
+                   __ATOMIC_RELAXED);
+  __atomic_store_n(&batch_sleep_ms, sleep_ms, __ATOMIC_RELAXED);
+}
+
+KsmStats ksm_stats() { return stats; }
+
+// Parse a decimal number at `i`, after any spaces
+static bool parse_number(frg::span<uint8_t> buf, size_t &i, uint64_t &ret) {
+  while (i < buf.size() && buf.data()[i] == ' ')
+    i++;
+
+  size_t start = i;
+  ret = 0;
+
+  while (i < buf.size() && buf.data()[i] >= '0' && buf.data()[i] <= '9')
+    ret = ret * 10 + (buf.data()[i++] - '0');
+
+  return i > start;
+}
+
+// Reading gives the rate and the counters, writing "pages_to_scan sleep_ms"
+// changes the rate
+class KsmDev : public Fs::DeviceOps {
+public:
+  Result<size_t, Error> read(dev_t minor, frg::span<uint8_t> buf,
+                             off_t off) override {
+    (void)minor;
+
+    auto pages = __atomic_load_n(&pages_per_batch, __ATOMIC_RELAXED);
+    auto sleep_ms = __atomic_load_n(&batch_sleep_ms, __ATOMIC_RELAXED);
+    auto cur = ksm_stats();
+
+    Vm::String text = "pages_to_scan sleep_ms pages_shared pages_sharing "
+                      "pages_scanned full_scans\n";
+
+    frg::output_to(text) << frg::fmt("{} {} {} {} {} {}\n", pages, sleep_ms,
+                                     cur.pages_shared, cur.pages_sharing,
+                                     cur.pages_scanned, cur.full_scans);
+
+    if ((size_t)off >= text.size())
+      return Ok((size_t)0);
+
+    size_t left = text.size() - off;
+    auto count = buf.size() < left ? buf.size() : left;
+    memcpy(buf.data(), text.data() + off, count);
+
+    return Ok(count);
+  }
+
+  Result<size_t, Error> write(dev_t minor, frg::span<uint8_t> buf,
+                              off_t off) override {
+    (void)minor;
+    (void)off;
+
+    size_t i = 0;
+    uint64_t pages, sleep_ms;
+
+    if (!parse_number(buf, i, pages) || !parse_number(buf, i, sleep_ms) ||
+        pages == 0)
+      return Err(Error::INVALID_PARAMETERS);
+
+    ksm_set_rate(pages, sleep_ms);
+
+    return Ok(buf.size());
+  }
+
+  Result<uint64_t, Error> ioctl(dev_t minor, uint64_t request,
+                                void *arg) override {
+    (void)minor;
+    (void)request;
+    (void)arg;
+    return Err(Error::INVALID_PARAMETERS);
+  }
+
+  Result<Fs::VnodeAttr, Error> getattr(dev_t minor) override {
+    (void)minor;
+    auto ret = Fs::VnodeAttr{};
+
+    ret.mode = S_IFCHR;
+
+    return Ok(ret);
+  }
+};
+
+void ksm_create_dev() {
+  auto maj = Fs::dev_alloc_major(new KsmDev).unwrap();
+
+  Fs::vfs_find_and("/dev/ksm", MAKEDEV(maj, 0), Fs::vfs_create_file).unwrap();
+}
+
+} // namespace Gaia::Vm
@@ -0,0 +1,37 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+#pragma once
+#include <lib/base.hpp>
+#include <lib/error.hpp>
+#include <lib/result.hpp>
+
+namespace Gaia::Vm {
+
+struct KsmStats {
+  size_t pages_shared;  ///< Number of merged pages KSM is keeping around
+  size_t pages_sharing; ///< Number of pages saved by merging
+  size_t pages_scanned; ///< Number of pages hashed since boot
+  size_t full_scans;    ///< Number of complete passes over every user space
+};
+
+/**
+ * @brief Start the same-page merging scanner thread
+ *
+ * @param pages_to_scan How many pages are hashed before the scanner sleeps
+ * @param sleep_ms How long the scanner sleeps between two batches
+ */
+Result<Void, Error> ksm_start(size_t pages_to_scan, uint64_t sleep_ms);
+
+/**
+ * @brief Change the scan rate of a running scanner
+ *
+ * @param pages_to_scan How many pages are hashed before the scanner sleeps
+ * @param sleep_ms How long the scanner sleeps between two batches
+ */
+void ksm_set_rate(size_t pages_to_scan, uint64_t sleep_ms);
+
+KsmStats ksm_stats();
+
+/// Create /dev/ksm
+void ksm_create_dev();
+
+} // namespace Gaia::Vm
@@ -8,10 +8,14 @@
 namespace Gaia::Vm {
 
 Object *Object::copy() {
+  lock.lock();
+
   auto newobj = new (Vm::Subsystem::VM) Object(size, anon.amap->copy());
 
   refcnt++;
 
+  lock.unlock();
+
   // !: do not assume anon?
   newobj->anon.parent = this;
 
@@ -19,8 +23,11 @@ Object *Object::copy() {
 }
 
 void Object::release() {
+  lock.lock();
+  auto left = --refcnt;
+  lock.unlock();
 
-  if (--refcnt > 0)
+  if (left > 0)
     return;
 
   // ! Check type!!
@@ -30,12 +37,17 @@ void Object::release() {
   delete this;
 }
 
-void Object::retain() { refcnt++; }
+void Object::retain() {
+  lock.lock();
+  refcnt++;
+  lock.unlock();
+}
 
-bool Object::fault(Space *map, uintptr_t address, size_t off,
-                   Space::FaultFlags flags, Hal::Vm::Prot prot) {
-
-  bool write = flags & Space::WRITE;
+Object::FaultResult Object::fault_locked(Space *map, uintptr_t address,
+                                         size_t off, bool write,
+                                         Hal::Vm::Prot prot, void *&page,
+                                         Anon *&replaced) {
+  ASSERT(lock.is_locked());
 
   Anon *anon = nullptr;
   auto aent = this->anon.amap->anon_at(off);
@@ -49,39 +61,62 @@ bool Object::fault(Space *map, uintptr_t address, size_t off,
 
       // Write fault and refcnt > 1, copy
       if (write && anon->refcnt > 1) {
+        if (!page) {
+          anon->lock.unlock();
+          return FaultResult::NEED_PAGE;
+        }
 
-        auto new_anon = anon->copy();
-        anon->refcnt--;
-        aent.value()->anon = new_anon;
+        auto new_anon = anon->copy(page);
+        page = nullptr;
 
         anon->lock.unlock();
 
+        this->anon.amap->replace_anon(aent.value(), new_anon);
+        replaced = anon;
+
         anon = new_anon;
 
-        map->pagemap->map(address + (off * Hal::PAGE_SIZE),
-                          (uintptr_t)anon->physpage, Hal::Vm::Prot::ALL,
-                          Hal::Vm::Flags::USER);
+        if (map->pagemap
+                ->map(address + (off * Hal::PAGE_SIZE),
+                      (uintptr_t)anon->physpage, Hal::Vm::Prot::ALL,
+                      Hal::Vm::Flags::USER)
+                .is_err())
+          return FaultResult::NO_MEMORY;
+
+        return FaultResult::RESOLVED;
+      }
+
+      // We're the only user left (e.g. KSM write-protected the page), just
+      // make it writable again. The anon stays locked so compaction can't move
+      // the page before it's mapped.
+      else if (write) {
+        auto res = map->pagemap->map(address + (off * Hal::PAGE_SIZE),
+                                     (uintptr_t)anon->physpage,
+                                     (Hal::Vm::Prot)(prot),
+                                     Hal::Vm::Flags::USER);
+
+        anon->lock.unlock();
 
-        return true;
+        return res.is_err() ? FaultResult::NO_MEMORY : FaultResult::RESOLVED;
       }
 
       // Is there any other way to handle this?
-      else if (!write) {
+      else {
         error("non-write fault on anon with refcnt>1");
         anon->lock.unlock();
-        return false;
+        return FaultResult::FAILED;
       }
     }
 
-    auto parent_aent = this->anon.parent->anon.amap->anon_at(off);
-
-    if (!parent_aent.has_value()) {
-      anon = new (Vm::Subsystem::VM) Anon(phys_alloc(true).unwrap(), off);
-      this->anon.parent->anon.amap->insert_anon(anon);
+    // Never touched by either us or our parent since the copy, it's
+    // zero-filled either way
+    if (!page) {
+      return FaultResult::NEED_PAGE;
     }
-    auto new_anon = anon->copy();
-    anon = new_anon;
-    this->anon.amap->insert_anon(anon);
+
+    anon = new (Vm::Subsystem::VM) Anon(page);
+    page = nullptr;
+    this->anon.amap->insert_anon(anon, off);
   }
 
   else {
@@ -89,40 +124,100 @@ bool Object::fault(Space *map, uintptr_t address, size_t off,
 
     // Allocate anon on-demand
     if (!aent.has_value()) {
-      anon = new (Vm::Subsystem::VM) Anon(phys_alloc(true).unwrap(), off);
-      this->anon.amap->insert_anon(anon);
+      if (!page) {
+        return FaultResult::NEED_PAGE;
+      }
+
+      anon = new (Vm::Subsystem::VM) Anon(page);
+      page = nullptr;
+      this->anon.amap->insert_anon(anon, off);
     }
 
     // Anon was written to and refcnt>1, copy
     else if (anon && anon->refcnt > 1 && write) {
+      if (!page) {
+        return FaultResult::NEED_PAGE;
+      }
+
       anon->lock.lock();
 
-      auto newanon = anon->copy();
+      auto newanon = anon->copy(page);
+      page = nullptr;
 
-      anon->refcnt--;
       anon->lock.unlock();
 
+      this->anon.amap->replace_anon(aent.value(), newanon);
+      replaced = anon;
+
       anon = newanon;
-      aent.value()->anon = anon;
     }
   }
 
   ASSERT(anon != nullptr);
 
-  // Map the anon page with its mapping's protection
-  map->pagemap->map(address + (off * Hal::PAGE_SIZE), (uintptr_t)anon->physpage,
-                    (Hal::Vm::Prot)(prot), Hal::Vm::Flags::USER);
+  // Map the anon page with its mapping's protection. If the page tables can't
+  // be allocated, the anon stays in the amap and the next fault maps it.
+  // Shared pages (merged by KSM, or being migrated) are mapped read-only so
+  // that writing to one goes through copy-on-write, and the anon stays locked
+  // so compaction can't move the page before it's mapped.
+  anon->lock.lock();
+
+  if (anon->refcnt > 1)
+    prot = (Hal::Vm::Prot)(prot & ~Hal::Vm::Prot::WRITE);
+
+  auto res = map->pagemap->map(address + (off * Hal::PAGE_SIZE),
+                               (uintptr_t)anon->physpage, (Hal::Vm::Prot)(prot),
+                               Hal::Vm::Flags::USER);
+
+  anon->lock.unlock();
+
+  return res.is_err() ? FaultResult::NO_MEMORY : FaultResult::RESOLVED;
+}
+
+Result<Void, Error> Object::fault(Space *map, uintptr_t address, size_t off,
+                                  Space::FaultFlags flags, Hal::Vm::Prot prot,
+                                  Anon *&replaced) {
+
+  bool write = flags & Space::WRITE;
 
-  return true;
+  // Allocating (and zeroing) a page is the slow part of a fault, so it is done
+  // without the object lock held. If another thread resolved the fault while
+  // we were allocating, the page is simply given back.
+  void *page = nullptr;
+
+  while (true) {
+    lock.lock();
+    auto res = fault_locked(map, address, off, write, prot, page, replaced);
+    lock.unlock();
+
+    if (res != FaultResult::NEED_PAGE) {
+      if (page) {
+        phys_free(page);
+      }
+
+      switch (res) {
+      case FaultResult::RESOLVED:
+        return Ok({});
+      case FaultResult::NO_MEMORY:
+        return Err(Error::OUT_OF_MEMORY);
+      default:
+        return Err(Error::INVALID_PARAMETERS);
+      }
+    }
+
+    page = TRY(phys_alloc(true));
+  }
 }
 
 Object::Object(size_t size) : refcnt(1), size(size) {
   anon.amap = new AnonMap;
+  anon.amap->owner = this;
   anon.parent = nullptr;
 }
 
 Object::Object(size_t size, AnonMap *amap) : refcnt(1), size(size) {
   anon.amap = amap;
+  anon.amap->owner = this;
   anon.parent = nullptr;
 }
 
@@ -6,7 +6,9 @@
 #include <frg/manual_box.hpp>
 #include <lib/base.hpp>
 #include <lib/freelist.hpp>
+#include <vm/compact.hpp>
 #include <vm/phys.hpp>
+#include <vm/reclaim.hpp>
 
 namespace Gaia::Vm {
 
@@ -17,6 +19,10 @@ static uintptr_t highest_usable_page = 0;
 static uintptr_t highest_mappable_page = 0;
 static frg::manual_box<frg::simple_spinlock> lock;
 
+// Below `low`, the pagedaemon is woken up and reclaims until `high` is reached.
+// Below `min`, it starts killing tasks.
+static size_t watermarks[3];
+
 static constexpr inline const char *
 mmap_entry_type_to_string(CharonMmapEntryType type) {
   switch (type) {
@@ -70,17 +76,39 @@ void phys_init(Charon charon) {
 
   log("{} MiB of usable physical memory ({} pages)",
       (usable_pages * Hal::PAGE_SIZE) / 1024 / 1024, usable_pages);
+
+  auto min = MAX(usable_pages / 256, (size_t)32);
+
+  watermarks[(int)Watermark::MIN] = min;
+  watermarks[(int)Watermark::LOW] = min + min / 4;
+  watermarks[(int)Watermark::HIGH] = min + min / 2;
 }
 
+size_t phys_watermark(Watermark mark) { return watermarks[(int)mark]; }
+
 Result<void *, Error> phys_alloc(bool zero) {
   lock->lock();
   void *ret = nullptr;
-  auto addr = TRY(freelist->alloc());
+  auto alloc = freelist->alloc();
+
+  if (alloc.is_err()) {
+    lock->unlock();
+    reclaim_wake();
+    return Err(alloc.error().value());
+  }
+
+  auto addr = alloc.unwrap();
 
   usable_pages--;
 
+  bool low = usable_pages < watermarks[(int)Watermark::LOW];
+
   lock->unlock();
 
+  if (low) {
+    reclaim_wake();
+  }
+
   ret = reinterpret_cast<void *>(Hal::virt_to_phys(addr));
 
   if (zero) {
@@ -99,4 +127,80 @@ void phys_free(void *page) {
   lock->unlock();
 }
 
+Result<void *, Error> phys_alloc_contiguous(size_t npages, size_t align,
+                                            bool zero) {
+  auto size = npages * Hal::PAGE_SIZE;
+  bool low = false;
+
+  auto try_alloc = [&]() {
+    lock->lock();
+    auto ret = freelist->alloc_contiguous(size, align);
+
+    if (ret.is_ok()) {
+      usable_pages -= npages;
+      low = usable_pages < watermarks[(int)Watermark::LOW];
+    }
+
+    lock->unlock();
+    return ret;
+  };
+
+  auto addr = try_alloc();
+
+  // Free memory is too fragmented, try to make room and retry once
+  if (addr.is_err()) {
+    TRY(compact_memory(DIV_CEIL(size, COMPACT_BLOCK_SIZE), align));
+  }
+
+  auto virt = addr.is_ok() ? addr.unwrap() : TRY(try_alloc());
+
+  if (low) {
+    reclaim_wake();
+  }
+
+  if (zero) {
+    memset(reinterpret_cast<void *>(virt), 0, size);
+  }
+
+  return Ok(reinterpret_cast<void *>(Hal::virt_to_phys(virt)));
+}
+
+void phys_free_contiguous(void *base, size_t npages) {
+  uintptr_t addr = Hal::phys_to_virt(reinterpret_cast<uintptr_t>(base));
+
+  lock->lock();
+  freelist->free_range(addr, npages * Hal::PAGE_SIZE);
+  usable_pages += npages;
+  lock->unlock();
+}
+
+static void set_pages(uint64_t *bitmap, uintptr_t virt, size_t size) {
+  auto first = Hal::virt_to_phys(virt) / Hal::PAGE_SIZE;
+
+  for (size_t i = first; i < first + size / Hal::PAGE_SIZE; i++) {
+    bitmap[i / 64] |= (1ull << (i % 64));
+  }
+}
+
+void phys_free_bitmap(uint64_t *bitmap) {
+  lock->lock();
+  freelist->for_each_region(
+      [&](uintptr_t start, size_t size) { set_pages(bitmap, start, size); });
+  lock->unlock();
+}
+
+size_t phys_isolate(uintptr_t base, size_t npages, uint64_t *bitmap) {
+  lock->lock();
+
+  auto removed = freelist->remove_range(
+      Hal::phys_to_virt(base), npages * Hal::PAGE_SIZE,
+      [&](uintptr_t start, size_t size) { set_pages(bitmap, start, size); });
+
+  usable_pages -= removed / Hal::PAGE_SIZE;
+
+  lock->unlock();
+
+  return removed / Hal::PAGE_SIZE;
+}
+
 } // namespace Gaia::Vm
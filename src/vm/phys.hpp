@@ -11,6 +11,36 @@ Result<void *, Error> phys_alloc(bool zero = false);
 
 void phys_free(void *page);
 
+/**
+ * @brief Allocate physically contiguous pages, compacting memory if needed
+ *
+ * @param npages The number of pages to allocate
+ * @param align The alignment of the allocation in bytes
+ * @param zero Whether the pages should be zeroed
+ */
+Result<void *, Error> phys_alloc_contiguous(size_t npages, size_t align,
+                                            bool zero = false);
+
+void phys_free_contiguous(void *base, size_t npages);
+
+// Used by compaction, bitmaps are indexed by physical page number
+
+/// Set the bit of every free page in `bitmap`
+void phys_free_bitmap(uint64_t *bitmap);
+
+/// Take the free pages of [base, base + npages) out of the allocator and set
+/// their bit in `bitmap`, returns the number of pages isolated
+size_t phys_isolate(uintptr_t base, size_t npages, uint64_t *bitmap);
+
+enum class Watermark {
+  MIN,
+  LOW,
+  HIGH,
+};
+
+/// Number of free pages at which the given watermark lies
+size_t phys_watermark(Watermark mark);
+
 size_t phys_usable_pages();
 uintptr_t phys_highest_usable_page();
 uintptr_t phys_highest_mappable_page();
@@ -0,0 +1,153 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+#include <kernel/ipl.hpp>
+#include <kernel/sched.hpp>
+#include <kernel/task.hpp>
+#include <kernel/wait.hpp>
+#include <lib/log.hpp>
+#include <vm/phys.hpp>
+#include <vm/reclaim.hpp>
+#include <vm/vm.hpp>
+#include <vm/vm_kernel.hpp>
+
+namespace Gaia::Vm {
+
+/*
+ * Page reclaim.
+ *
+ * Once free memory drops below the low watermark, the physical allocator wakes
+ * up the pagedaemon, which asks every registered shrinker to give pages back
+ * until the high watermark is reached again. If that isn't enough and we are
+ * below the min watermark, the biggest task is killed.
+ *
+ * Page faults that can't get a page kill a task themselves and retry, so a
+ * task running out of memory never takes the whole kernel down with it.
+ */
+
+static List<Shrinker, &Shrinker::link> shrinkers;
+static Spinlock shrinkers_lock;
+static Waitq pagedaemon_wq;
+
+void reclaim_register(Shrinker *shrinker) {
+  shrinkers_lock.lock();
+  shrinkers.insert_tail(shrinker);
+  shrinkers_lock.unlock();
+}
+
+void reclaim_wake() { pagedaemon_wq.wake(-1).unwrap(); }
+
+static size_t run_shrinkers(size_t target) {
+  size_t freed = 0;
+
+  shrinkers_lock.lock();
+
+  for (auto shrinker : shrinkers) {
+    if (freed >= target)
+      break;
+
+    freed += shrinker->shrink(target - freed);
+  }
+
+  shrinkers_lock.unlock();
+
+  return freed;
+}
+
+OomResult oom_kill() {
+  auto ipl = iplx(Ipl::HIGH);
+
+  Task *victim = nullptr;
+  size_t victim_pages = 0;
+
+  tasks_lock.lock();
+
+  for (auto task : sched_tasks()) {
+    // Killing another one before the last victim let go of its space would
+    // kill two tasks for one shortage
+    if (task->oom_victim && __atomic_load_n(&task->space, __ATOMIC_ACQUIRE)) {
+      tasks_lock.unlock();
+      iplx(ipl);
+      return OomResult::BUSY;
+    }
+
+    if (task->space == kernel_space)
+      continue;
+
+    // Its space is released once it has exited
+    task->lock.lock();
+
+    if (task->has_exited) {
+      task->lock.unlock();
+      continue;
+    }
+
+    auto pages = task->space->resident_pages();
+
+    task->lock.unlock();
+
+    // Init is only killed if it's the only task left
+    if (!victim || (victim->pid == 1 && task->pid != 1) ||
+        (pages > victim_pages && task->pid != 1)) {
+      victim = task;
+      victim_pages = pages;
+    }
+  }
+
+  // It can't go away before it's torn down, but it may have exited meanwhile
+  bool killed =
+      victim && sched_begin_exit(victim, task_signal_status(TASK_SIGKILL));
+
+  if (killed)
+    victim->oom_victim = true;
+
+  tasks_lock.unlock();
+
+  if (!killed) {
+    iplx(ipl);
+    return victim ? OomResult::BUSY : OomResult::NOTHING;
+  }
+
+  error("Out of memory: killing task {} ({} pages resident)", victim->pid,
+        victim_pages);
+
+  // If we're the victim, we never come back from here
+  if (victim == sched_curr()->task)
+    iplx(ipl);
+
+  sched_finish_exit(victim);
+
+  iplx(ipl);
+
+  return OomResult::KILLED;
+}
+
+static void pagedaemon() {
+  while (true) {
+    pagedaemon_wq.await(-1).unwrap();
+
+    while (phys_usable_pages() < phys_watermark(Watermark::HIGH)) {
+      auto ipl = iplx(Ipl::HIGH);
+
+      auto freed =
+          run_shrinkers(phys_watermark(Watermark::HIGH) - phys_usable_pages());
+
+      bool killed = false;
+
+      // Memory is on its way back if someone else is killing a task
+      if (!freed && phys_usable_pages() < phys_watermark(Watermark::MIN))
+        killed = oom_kill() == OomResult::KILLED;
+
+      iplx(ipl);
+
+      if (!freed && !killed)
+        break;
+    }
+  }
+}
+
+Result<Void, Error> reclaim_init() {
+  TRY(sched_new_worker_thread("pagedaemon", (uintptr_t)pagedaemon));
+
+  return Ok({});
+}
+
+} // namespace Gaia::Vm
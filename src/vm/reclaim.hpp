@@ -0,0 +1,43 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+#pragma once
+#include <lib/base.hpp>
+#include <lib/error.hpp>
+#include <lib/list.hpp>
+#include <lib/result.hpp>
+
+namespace Gaia::Vm {
+
+/// A cache that can give pages back when memory runs low
+struct Shrinker {
+  /// Free up to `target` pages, returns the number of pages freed. Called at
+  /// Ipl::HIGH from the pagedaemon.
+  size_t (*shrink)(size_t target);
+
+  ListNode<Shrinker> link;
+};
+
+void reclaim_register(Shrinker *shrinker);
+
+/// Wake up the pagedaemon, called by the physical allocator when the number of
+/// free pages drops below the low watermark
+void reclaim_wake();
+
+enum class OomResult {
+  KILLED,  // A task was killed, its memory is free
+  BUSY,    // A task killed by someone else is still being torn down
+  NOTHING, // There was nothing left to kill
+};
+
+/**
+ * @brief Kill the task using the most memory
+ *
+ * Only one task is killed at a time: until the last victim gave its memory
+ * back, callers get OomResult::BUSY and should retry later. If the current task
+ * is picked, this function does not return.
+ */
+OomResult oom_kill();
+
+/// Start the pagedaemon thread
+Result<Void, Error> reclaim_init();
+
+} // namespace Gaia::Vm
@@ -8,11 +8,131 @@ namespace Gaia::Vm {
 
 Hal::Vm::Pagemap kernel_pagemap;
 
+Spinlock rmap_lock;
+Spinlock user_spaces_lock;
+
+List<Space, &Space::link> &user_spaces() {
+  static List<Space, &Space::link> spaces;
+  return spaces;
+}
+
+Result<Space *, Error> Space::create(const char *name, bool user) {
+  auto pagemap = new (Vm::Subsystem::VM) Hal::Vm::Pagemap();
+
+  if (!pagemap)
+    return Err(Error::OUT_OF_MEMORY);
+
+  auto res = pagemap->init(!user);
+
+  if (res.is_err()) {
+    delete pagemap;
+    return Err(res.error().value());
+  }
+
+  auto space = new (Vm::Subsystem::VM) Space(name, user, pagemap);
+
+  if (!space) {
+    pagemap->destroy();
+    delete pagemap;
+    return Err(Error::OUT_OF_MEMORY);
+  }
+
+  return Ok(space);
+}
+
+Space::Space(const char *name, bool user, Hal::Vm::Pagemap *pagemap)
+    : pagemap(pagemap), user(user) {
+  vmem_init(&vmem, name, (void *)0x80000000000, 0x100000000, 0x1000, 0, 0, 0,
+            0, 0);
+
+  if (user) {
+    static uint64_t next_id = 1;
+
+    user_spaces_lock.lock();
+    id = next_id++;
+    user_spaces().insert_tail(this);
+    user_spaces_lock.unlock();
+  }
+}
+
+Space::Entry *Space::find_entry(uintptr_t address) {
+  for (auto entry : entries) {
+    if (address >= entry->start && address < entry->start + entry->size) {
+      return entry;
+    }
+  }
+
+  return nullptr;
+}
+
+Space::Entry *Space::entry_from(uintptr_t address, bool inclusive) {
+  Entry *ret = nullptr;
+
+  // Entries are kept in the order they were mapped in
+  for (auto entry : entries) {
+    if (entry->start < address || (!inclusive && entry->start == address))
+      continue;
+
+    if (!ret || entry->start < ret->start)
+      ret = entry;
+  }
+
+  return ret;
+}
+
+frg::optional<AnonMap::Entry *> Space::anon_at(uintptr_t address,
+                                                Object *&owner) {
+  lock.read_lock();
+
+  auto ent = find_entry(address);
+
+  if (!ent) {
+    lock.read_unlock();
+    return frg::null_opt;
+  }
+
+  ent->obj->lock.lock();
+
+  auto ret =
+      ent->obj->anon.amap->anon_at((address - ent->start) / Hal::PAGE_SIZE);
+
+  // Entries only go away with their amap
+  if (ret.has_value()) {
+    ent->obj->refcnt++;
+    owner = ent->obj;
+  }
+
+  ent->obj->lock.unlock();
+
+  lock.read_unlock();
+
+  return ret;
+}
+
+frg::optional<Object *> Space::object_at(uintptr_t address,
+                                         uintptr_t &offset) {
+  lock.read_lock();
+
+  auto ent = find_entry(address);
+  frg::optional<Object *> ret;
+
+  if (ent) {
+    offset = address - ent->start;
+    ret = ent->obj;
+  }
+
+  lock.read_unlock();
+
+  return ret;
+}
+
 Result<uintptr_t, Error> Space::map(Object *obj,
                                     frg::optional<uintptr_t> address,
                                     size_t size, Hal::Vm::Prot prot) {
   uintptr_t start = 0;
 
+  lock.write_lock();
+
   if (address.has_value()) {
     start = address.value();
   } else {
@@ -27,7 +147,7 @@ Result<uintptr_t, Error> Space::map(Object *obj,
           : size;
 
   auto entry =
-      new (Vm::Subsystem::VM) Entry(aligned_addr, real_size, obj, prot);
+      new (Vm::Subsystem::VM) Entry(this, aligned_addr, real_size, obj, prot);
 
   // if was not a copy, retain
   if (!obj->anon.parent) {
@@ -36,31 +156,40 @@ Result<uintptr_t, Error> Space::map(Object *obj,
 
   entries.insert_tail(entry);
 
+  rmap_lock.lock();
+  obj->mappings.insert_tail(entry);
+  rmap_lock.unlock();
+
+  lock.write_unlock();
+
   return Ok(start);
 }
 
 Result<Void, Error> Space::unmap(uintptr_t address, size_t size) {
+  lock.write_lock();
 
-  Entry *ent = nullptr;
-  for (auto entry : entries) {
-    if (address >= entry->start && address < entry->start + entry->size) {
-      ent = entry;
-      break;
-    }
-  }
+  Entry *ent = find_entry(address);
 
   if (!ent) {
+    lock.write_unlock();
     return Err(Error::NOT_FOUND);
   }
 
   if (address != ent->start || size != ent->size) {
     // error("Partial unmap not implemented (yet)");
+    lock.write_unlock();
     return Err(Error::NOT_IMPLEMENTED);
   }
 
   // 1. remove entry from map
   entries.remove(ent);
 
+  rmap_lock.lock();
+  ent->obj->mappings.remove(ent);
+  rmap_lock.unlock();
+
+  lock.write_unlock();
+
   // 2. unmap address(es)
   for (size_t i = 0; i < ent->size; i += Hal::PAGE_SIZE) {
     auto mapping = pagemap->get_mapping(ent->start + i);
@@ -69,6 +198,9 @@ Result<Void, Error> Space::unmap(uintptr_t address, size_t size) {
       pagemap->unmap(ent->start + i);
   }
 
+  // The pages may be freed along with the object
+  Hal::Vm::flush_stale();
+
   // 3. release obj
   ent->obj->release();
 
@@ -78,6 +210,8 @@ Result<Void, Error> Space::unmap(uintptr_t address, size_t size) {
 }
 
 Result<Void, Error> Space::copy(Space *dest) {
+  lock.read_lock();
+
   for (auto entry : entries) {
     auto newobj = entry->obj->copy();
 
@@ -88,26 +222,46 @@ Result<Void, Error> Space::copy(Space *dest) {
 
 #if VM_ENABLE_COW
         // This should, in theory, ensure all writes are caught
-        dest->pagemap->map(
+        auto res = dest->pagemap->map(
             entry->start + i, (uintptr_t)anon.value()->anon->physpage,
             (Hal::Vm::Prot)(Hal::Vm::Prot::READ | Hal::Vm::Prot::EXECUTE),
             Hal::Vm::USER);
 
-        this->pagemap->remap(
-            entry->start + i,
-            (Hal::Vm::Prot)(Hal::Vm::Prot::READ | Hal::Vm::Prot::EXECUTE),
-            Hal::Vm::USER);
+        if (res.is_ok()) {
+          this->pagemap->remap(
+              entry->start + i,
+              (Hal::Vm::Prot)(Hal::Vm::Prot::READ | Hal::Vm::Prot::EXECUTE),
+              Hal::Vm::USER);
+        }
 #else
-        dest->pagemap->map(entry->start + i,
-                           (uintptr_t)anon.value()->anon->physpage,
-                           (Hal::Vm::Prot)(entry->prot), Hal::Vm::USER);
+        auto res = dest->pagemap->map(
+            entry->start + i, (uintptr_t)anon.value()->anon->physpage,
+            (Hal::Vm::Prot)(entry->prot), Hal::Vm::USER);
 #endif
+
+        // The caller releases `dest`, which takes care of what was already
+        // copied
+        if (res.is_err()) {
+          newobj->release();
+          lock.read_unlock();
+          return Err(res.error().value());
+        }
       }
     }
 
-    TRY(dest->map(newobj, entry->start, entry->size, entry->prot));
+    auto res = dest->map(newobj, entry->start, entry->size, entry->prot);
+
+    if (res.is_err()) {
+      lock.read_unlock();
+      return Err(res.error().value());
+    }
   }
 
+  lock.read_unlock();
+
+  // Our other threads must not keep writing to pages the copy now shares
+  Hal::Vm::flush_stale();
+
   return Ok({});
 }
 
@@ -124,54 +278,115 @@ Result<uintptr_t, Error> Space::new_anon(frg::optional<uintptr_t> address,
   return Ok(addr);
 }
 
-bool Space::fault(uintptr_t address, FaultFlags flags) {
-  Entry *ent = nullptr;
+Result<Void, Error> Space::fault(uintptr_t address, FaultFlags flags) {
+  // Faults only read the entries, so threads of the same process can fault
+  // concurrently
+  lock.read_lock();
 
-  for (auto entry : entries) {
-    if (address >= entry->start && address < entry->start + entry->size) {
-      ent = entry;
-      break;
-    }
-  }
+  Entry *ent = find_entry(address);
 
   // Address is not in map at all
   if (!ent) {
-    return false;
+    lock.read_unlock();
+    return Err(Error::NOT_FOUND);
   }
 
   // Verify protection here
   if (!(ent->prot & Hal::Vm::Prot::WRITE) && (flags & WRITE)) {
     error("Protection violation: write on read-only page");
-    return false;
+    lock.read_unlock();
+    return Err(Error::PERMISSION_DENIED);
   }
 
   if (!(ent->prot & Hal::Vm::Prot::EXECUTE) && (flags & EXEC)) {
     error("Protection violation: execute on NX page");
-    return false;
+    lock.read_unlock();
+    return Err(Error::PERMISSION_DENIED);
   }
 
-  return ent->obj->fault(this, ent->start,
-                         (address - ent->start) / Hal::PAGE_SIZE, flags,
-                         ent->prot);
+  Anon *replaced = nullptr;
+
+  auto ret = ent->obj->fault(this, ent->start,
+                             (address - ent->start) / Hal::PAGE_SIZE, flags,
+                             ent->prot, replaced);
+
+  lock.read_unlock();
+
+  // Copy-on-write pointed the PTE to a new page, the old one may be freed once
+  // no CPU maps it anymore
+  Hal::Vm::flush_stale();
+
+  if (replaced)
+    replaced->release();
+
+  return ret;
+}
+
+Result<Void, Error> Space::write(uintptr_t address, const void *buf,
+                                 size_t size) {
+  auto src = (const uint8_t *)buf;
+
+  while (size) {
+    auto page = ALIGN_DOWN(address, Hal::PAGE_SIZE);
+    auto count = page + Hal::PAGE_SIZE - address;
+
+    if (count > size)
+      count = size;
+
+    TRY(fault(address, (FaultFlags)(WRITE | USER)));
+
+    auto mapping = TRY(pagemap->get_mapping(page));
+
+    memcpy((void *)Hal::phys_to_virt(mapping.address + (address - page)), src,
+           count);
+
+    address += count;
+    src += count;
+    size -= count;
+  }
+
+  return Ok({});
+}
+
+size_t Space::resident_pages() {
+  size_t ret = 0;
+
+  for_each_anon([&](AnonMap::Entry *, uintptr_t) { ret++; });
+
+  return ret;
 }
 
 void Space::release() {
-  for (auto entry : entries) {
+  if (user) {
+    user_spaces_lock.lock();
+    user_spaces().remove(this);
+    user_spaces_lock.unlock();
+  }
+
+  lock.write_lock();
+
+  while (auto entry = entries.head()) {
+    entries.remove(entry);
+
     if (entry->obj) {
+      rmap_lock.lock();
+      entry->obj->mappings.remove(entry);
+      rmap_lock.unlock();
+
       entry->obj->release();
     }
 
     delete entry;
   }
 
-  entries.reset();
+  lock.write_unlock();
 
   this->pagemap->destroy();
 }
 
 void init() {
   Hal::Vm::init();
-  kernel_pagemap.init(true);
+  kernel_pagemap.init(true).unwrap();
   kernel_pagemap.activate();
   vmem_bootstrap();
   vm_kernel_init();
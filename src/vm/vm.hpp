@@ -5,16 +5,103 @@
 #include <hal/hal.hpp>
 #include <hal/mmu.hpp>
 #include <lib/base.hpp>
+#include <lib/rwlock.hpp>
+#include <lib/spinlock.hpp>
 #include <vm/vmem.h>
 
 #define VM_ENABLE_COW 1
+#define VM_ENABLE_KSM 0
 
 namespace Gaia::Vm {
 void init();
 
 extern Hal::Vm::Pagemap kernel_pagemap;
 
+/*
+ * Locking, outermost first:
+ *   - Space::lock, a reader/writer lock over the space's entries. Faults and
+ *     lookups are readers, map/unmap/release are writers
+ *   - Object::lock, protects the object's amap and refcount
+ *   - Anon::lock, protects the anon's refcount and page
+ *   - rmap_lock, protects the reverse map (Anon::refs and Object::mappings)
+ *   - the pagemap's own lock
+ *
+ * Pages are never allocated with one of these held, see Object::fault.
+ *
+ * These are spinlocks: VM code either runs with interrupts disabled (syscalls,
+ * faults) or at Ipl::HIGH (KSM, compaction), so a holder can't be preempted.
+ * For the same reason, TLB shootdowns are only waited for once all of them are
+ * dropped (see Hal::Vm::flush_stale): a CPU spinning on one can't ack.
+ */
+extern Spinlock rmap_lock;
+
 struct Object;
+struct Anon;
+
+class AnonMap {
+public:
+  struct Entry {
+    Anon *anon;
+    size_t offset; // offset within the amap, anons may be shared by KSM
+    AnonMap *amap;
+    ListNode<Entry> link;
+    ListNode<Entry> anon_link; // Link in the anon's list of references
+
+    // Call `fn(space, address)` for every place this entry is mapped at
+    template <typename F> void for_each_mapping(F fn);
+  };
+
+  frg::optional<Entry *> anon_at(uintptr_t page);
+
+  void insert_anon(Anon *anon, size_t offset);
+
+  // Make `entry` point to `anon`, the old anon is NOT released
+  void replace_anon(Entry *entry, Anon *anon);
+
+  // NOTE: the owner's lock must be held for all of the above
+
+  AnonMap *copy();
+
+  void release();
+
+  auto begin() { return entries.begin(); }
+  auto end() { return entries.end(); }
+
+  Object *owner = nullptr;
+
+private:
+  List<Entry, &Entry::link> entries;
+};
+
+struct Anon {
+  int refcnt;
+  void *physpage;
+  uint64_t checksum = 0; // content hash seen by the last KSM pass
+  frg::simple_spinlock lock;
+
+  // Every amap entry pointing to this anon (reverse map)
+  List<AnonMap::Entry, &AnonMap::Entry::anon_link> refs;
+
+  // Call `fn(space, address)` for every place this anon is mapped at, with
+  // rmap_lock held
+  template <typename F> void for_each_mapping(F fn);
+
+  // Remove the page from every space mapping it
+  void unmap_all();
+
+  // Remove write access to the page from every space mapping it
+  void write_protect_all();
+
+  // Point every PTE that maps the anon to its current physpage
+  void remap_all();
+
+  void retain();
+  void release();
+
+  // Copy the anon's content to `page`, returns the new anon
+  Anon *copy(void *page);
+  Anon(void *physpage) : refcnt(1), physpage(physpage){};
+};
 
 class Space {
 public:
@@ -31,54 +118,95 @@ public:
     EXEC = (1 << 4),
   };
 
-  // Fault on address, returns true if fault was resolved
-  bool fault(uintptr_t address, FaultFlags flags);
+  // Fault on address, fails with OUT_OF_MEMORY if the fault could be resolved
+  // but no memory was available to do so
+  Result<Void, Error> fault(uintptr_t address, FaultFlags flags);
+
+  // Number of pages faulted in, walks every entry
+  size_t resident_pages();
 
   Result<uintptr_t, Error> new_anon(frg::optional<uintptr_t> address,
                                     size_t size, Hal::Vm::Prot prot);
 
   Result<Void, Error> copy(Space *dest);
 
+  // Write to the space's memory, which doesn't have to be the current one.
+  // Pages shared copy-on-write are copied first, like on a user write.
+  Result<Void, Error> write(uintptr_t address, const void *buf, size_t size);
+
+  // Find the amap entry backing the page at `address`, if it was faulted in.
+  // `owner` gets the object it belongs to, which the caller has to release: the
+  // entry is valid for as long as the object is.
+  frg::optional<AnonMap::Entry *> anon_at(uintptr_t address, Object *&owner);
+
+  // The object mapped at `address` and the offset of `address` in it, without
+  // taking a reference: only good as an identity, e.g. for futex keys
+  frg::optional<Object *> object_at(uintptr_t address, uintptr_t &offset);
+
+  // Call `fn(amap_entry, address)` for every anon mapped in this space, with
+  // the space's lock read-held and the owning object's lock held
+  template <typename F> void for_each_anon(F fn);
+
+  // Resumable for_each_anon, walking mappings by address: the anons of the
+  // mapping at `start` that come after `after`, if it still maps `obj`, then
+  // those of every mapping above it. Stops once `fn` returns false.
+  template <typename F>
+  void for_each_anon_from(uintptr_t start, Object *obj, AnonMap::Entry *after,
+                          F fn);
+
   void activate() { pagemap->activate(); }
 
   Space(Hal::Vm::Pagemap *pagemap, Vmem vmem) : pagemap(pagemap), vmem(vmem) {}
 
-  Space(const char *name, bool user) {
-    pagemap = new Hal::Vm::Pagemap();
-    pagemap->init(!user);
-
-    vmem_init(&vmem, name, (void *)0x80000000000, 0x100000000, 0x1000, 0, 0, 0,
-              0, 0);
-  }
+  // A space with a pagemap of its own
+  static Result<Space *, Error> create(const char *name, bool user);
 
   void release();
 
   Hal::Vm::Pagemap *pagemap;
 
-private:
+  ListNode<Space> link; // Link in the list of user spaces
+  uint64_t id = 0;       // User spaces are kept in creation order, by id
+
+  RwLock lock;
+
   struct Entry {
     ListNode<Entry> link;
+    ListNode<Entry> obj_link; // Link in the object's list of mappings
+    Space *space;
     uintptr_t start;
     size_t size;
     Object *obj;
     Hal::Vm::Prot prot;
 
-    Entry(uintptr_t start, size_t size, Object *obj, Hal::Vm::Prot prot)
-        : start(start), size(size), obj(obj), prot(prot) {}
+    Entry(Space *space, uintptr_t start, size_t size, Object *obj,
+          Hal::Vm::Prot prot)
+        : space(space), start(start), size(size), obj(obj), prot(prot) {}
   };
 
+private:
+  Space(const char *name, bool user, Hal::Vm::Pagemap *pagemap);
+
+  Entry *find_entry(uintptr_t address);
+
+  // The lowest mapping starting at or above `address`, or above it only
+  Entry *entry_from(uintptr_t address, bool inclusive);
+
   List<Entry, &Entry::link> entries;
 
   Vmem vmem;
+  bool user = false;
 };
 
-class AnonMap;
-
-struct Anon;
+// Every user space currently alive, walked by the KSM scanner and compaction
+// NOTE: user_spaces_lock is taken before any space lock
+List<Space, &Space::link> &user_spaces();
+extern Spinlock user_spaces_lock;
 
 struct Object {
   int refcnt;
   size_t size;
+  Spinlock lock;
 
   union {
     struct {
@@ -97,42 +225,93 @@ struct Object {
   // NOTE: if the refcnt reaches 0, object WILL commit suicide (`delete this`)
   void release();
 
+  // Every space entry mapping this object (reverse map)
+  List<Space::Entry, &Space::Entry::obj_link> mappings;
+
   Object(size_t size);
   Object(size_t size, AnonMap *amap);
 
-  // Try and resolve a fault on the object
-  bool fault(Space *map, uintptr_t vaddr, size_t offset,
-             Space::FaultFlags flags, Hal::Vm::Prot obj_prot);
-};
+  // Try and resolve a fault on the object. If copy-on-write replaced an anon,
+  // it is returned in `replaced` for the caller to release once the old
+  // translation is flushed everywhere.
+  Result<Void, Error> fault(Space *map, uintptr_t vaddr, size_t offset,
+                            Space::FaultFlags flags, Hal::Vm::Prot obj_prot,
+                            Anon *&replaced);
 
-struct Anon {
-  int refcnt;
-  void *physpage;
-  size_t offset; // offset within the amap
-  frg::simple_spinlock lock;
+private:
+  enum class FaultResult {
+    RESOLVED,
+    FAILED,
+    NO_MEMORY, // The page tables couldn't be allocated
+    NEED_PAGE, // Call again with a freshly allocated page
+  };
 
-  void release();
-  Anon *copy();
-  Anon(void *physpage, size_t offset)
-      : refcnt(1), physpage(physpage), offset(offset){};
+  FaultResult fault_locked(Space *map, uintptr_t vaddr, size_t offset,
+                           bool write, Hal::Vm::Prot obj_prot, void *&page,
+                           Anon *&replaced);
 };
 
-class AnonMap {
-public:
-  struct Entry {
-    Anon *anon;
-    ListNode<Entry> link;
-  };
+template <typename F> void Space::for_each_anon(F fn) {
+  lock.read_lock();
 
-  frg::optional<Entry *> anon_at(uintptr_t page);
+  for (auto entry : entries) {
+    entry->obj->lock.lock();
 
-  void insert_anon(Anon *anon);
+    for (auto aent : *entry->obj->anon.amap) {
+      fn(aent, entry->start + aent->offset * Hal::PAGE_SIZE);
+    }
 
-  AnonMap *copy();
+    entry->obj->lock.unlock();
+  }
 
-  void release();
+  lock.read_unlock();
+}
+
+template <typename F>
+void Space::for_each_anon_from(uintptr_t start, Object *obj,
+                               AnonMap::Entry *after, F fn) {
+  lock.read_lock();
+
+  auto entry = entry_from(start, true);
+  bool more = true;
+
+  while (entry && more) {
+    entry->obj->lock.lock();
+
+    auto aent = *entry->obj->anon.amap->begin();
+
+    if (after && entry->start == start && entry->obj == obj)
+      aent = after->link.next;
+
+    for (; aent && more; aent = aent->link.next)
+      more = fn(aent, entry->start + aent->offset * Hal::PAGE_SIZE);
+
+    entry->obj->lock.unlock();
+
+    entry = entry_from(entry->start, false);
+  }
+
+  lock.read_unlock();
+}
+
+template <typename F> void AnonMap::Entry::for_each_mapping(F fn) {
+  for (auto mapping : amap->owner->mappings) {
+    auto address = mapping->start + offset * Hal::PAGE_SIZE;
+
+    if (address < mapping->start + mapping->size) {
+      fn(mapping->space, address);
+    }
+  }
+}
+
+template <typename F> void Anon::for_each_mapping(F fn) {
+  rmap_lock.lock();
+
+  for (auto ref : refs) {
+    ref->for_each_mapping(fn);
+  }
+
+  rmap_lock.unlock();
+}
 
-private:
-  List<Entry, &Entry::link> entries;
-};
 } // namespace Gaia::Vm
@@ -38,15 +38,45 @@ void vm_kernel_init() {
   kernel_space = new Space(&kernel_pagemap, *vmem_kernel.get());
 }
 
+// Undo a partially done vm_kernel_alloc, `mapped` out of `npages` pages were
+// mapped
+static void rollback(void *virt, int npages, int mapped) {
+  for (int i = 0; i < mapped; i++) {
+    auto addr = (uintptr_t)virt + i * Hal::PAGE_SIZE;
+
+    phys_free((void *)kernel_pagemap.get_mapping(addr).unwrap().address);
+    kernel_pagemap.unmap(addr);
+  }
+
+  vmem_free(vmem_kernel.get(), virt, npages * Hal::PAGE_SIZE);
+}
+
 extern "C" void *vm_kernel_alloc(int npages, bool bootstrap) {
   void *virt = vmem_alloc(vmem_kernel.get(), npages * Hal::PAGE_SIZE,
                           VM_INSTANTFIT | (bootstrap ? VM_BOOTSTRAP : 0));
 
+  if (!virt) {
+    return nullptr;
+  }
+
   for (int i = 0; i < npages; i++) {
-    void *addr = phys_alloc(true).unwrap();
+    auto addr = phys_alloc(true);
 
-    kernel_pagemap.map((uintptr_t)virt + i * Hal::PAGE_SIZE, (uintptr_t)addr,
-                       (Prot)(Prot::READ | Prot::WRITE), Hal::Vm::Flags::NONE);
+    if (addr.is_err()) {
+      rollback(virt, npages, i);
+      return nullptr;
+    }
+
+    auto res = kernel_pagemap.map((uintptr_t)virt + i * Hal::PAGE_SIZE,
+                                  (uintptr_t)addr.unwrap(),
+                                  (Prot)(Prot::READ | Prot::WRITE),
+                                  Hal::Vm::Flags::NONE);
+
+    if (res.is_err()) {
+      phys_free(addr.unwrap());
+      rollback(virt, npages, i);
+      return nullptr;
+    }
   }
 
   return virt;
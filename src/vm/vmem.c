@@ -165,7 +165,7 @@ static void hashtab_insert(Vmem *vmem, VmemSegment *seg) {
 }
 
 static VmemSegList *freelist_for_size(Vmem *vmem, size_t size) {
-  return &vmem->freelist[GET_LIST(size) - 1];
+  return &vmem->freelist[GET_LIST(size)];
 }
 
 static int vmem_contains(Vmem *vmp, void *address, size_t size) {
@@ -253,6 +253,7 @@ int vmem_init(Vmem *ret, const char *name, void *base, size_t size,
   ret->source = source;
   ret->qcache_max = qcache_max;
   ret->vmflag = vmflag;
+  ret->nextfit = (uintptr_t)base;
   ret->stat.free = size;
   ret->stat.total += size;
   ret->stat.in_use = 0;
@@ -363,7 +364,33 @@ void *vmem_xalloc(Vmem *vmp, size_t size, size_t align, size_t phase,
           }
         }
     } else if (vmflag & VM_NEXTFIT) {
-      ASSERT(!"TODO: implement nextfit");
+      uintptr_t cursor = MAX((uintptr_t)minaddr, vmp->nextfit);
+
+      /* Until the arena wraps around, allocations come from the free segment
+       * at its end: try it first so that the common case is constant-time */
+      seg = TAILQ_LAST(&vmp->segqueue, VmemSegQueue);
+
+      if (seg != NULL && seg->type == SEGMENT_FREE &&
+          seg_fit(seg, size, align, phase, nocross, cursor, (uintptr_t)maxaddr,
+                  &start) == 0)
+        goto found;
+
+      /* Then every segment in address order, from where the last allocation
+       * ended */
+      TAILQ_FOREACH(seg, &vmp->segqueue, segqueue) {
+        if (seg->type == SEGMENT_FREE &&
+            seg_fit(seg, size, align, phase, nocross, cursor,
+                    (uintptr_t)maxaddr, &start) == 0)
+          goto found;
+      }
+
+      /* And from the start of the arena */
+      TAILQ_FOREACH(seg, &vmp->segqueue, segqueue) {
+        if (seg->type == SEGMENT_FREE &&
+            seg_fit(seg, size, align, phase, nocross, (uintptr_t)minaddr,
+                    (uintptr_t)maxaddr, &start) == 0)
+          goto found;
+      }
     }
 
     if (vmem_import(vmp, size, vmflag) == 0) {
@@ -371,6 +398,8 @@ void *vmem_xalloc(Vmem *vmp, size_t size, size_t align, size_t phase,
     }
 
     ASSERT(!"Allocation failed");
+    seg_free(new_seg);
+    seg_free(new_seg2);
     return NULL;
   }
 
@@ -456,6 +485,9 @@ found:
 
   new_seg->type = SEGMENT_ALLOCATED;
 
+  if (vmflag & VM_NEXTFIT)
+    vmp->nextfit = new_seg->base + size;
+
   ret = (void *)new_seg->base;
 
   return ret;
@@ -101,6 +101,7 @@ typedef struct vmem {
   struct vmem *source; /* Import arena */
   size_t qcache_max;   /* Maximum size to cache */
   int vmflag;          /* VM_SLEEP or VM_NOSLEEP */
+  uintptr_t nextfit;   /* Where the last VM_NEXTFIT allocation ended */
 
   VmemSegQueue segqueue;
   VmemSegList freelist[FREELISTS_N];   /* Power of two freelists. Freelists[n]
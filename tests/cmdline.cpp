@@ -0,0 +1,45 @@
+/* @license:bsd2 */
+#include <catch2/catch.hpp>
+#include <lib/cmdline.hpp>
+
+using namespace Gaia;
+
+TEST_CASE("Command line", "[cmdline]") {
+  frg::string_view cmdline = "quiet isolcpus=2-3 root=/dev/sda  isolcpus=1";
+
+  SECTION("Options with a value") {
+    auto root = cmdline_get(cmdline, "root");
+    REQUIRE(root);
+    REQUIRE(*root == "/dev/sda");
+  }
+
+  SECTION("Options without a value") {
+    auto quiet = cmdline_get(cmdline, "quiet");
+    REQUIRE(quiet);
+    REQUIRE(quiet->size() == 0);
+  }
+
+  SECTION("Last occurrence wins") {
+    auto isolcpus = cmdline_get(cmdline, "isolcpus");
+    REQUIRE(isolcpus);
+    REQUIRE(*isolcpus == "1");
+  }
+
+  SECTION("Missing options") {
+    REQUIRE(!cmdline_get(cmdline, "iso"));
+    REQUIRE(!cmdline_get("", "quiet"));
+  }
+}
+
+TEST_CASE("CPU lists", "[cmdline]") {
+  REQUIRE(*parse_cpu_list("0") == 0b1);
+  REQUIRE(*parse_cpu_list("1,3-5") == 0b111010);
+  REQUIRE(*parse_cpu_list("63") == 1ull << 63);
+
+  REQUIRE(!parse_cpu_list("64"));
+  REQUIRE(!parse_cpu_list("3-1"));
+  REQUIRE(!parse_cpu_list("1;2"));
+  REQUIRE(!parse_cpu_list("-1"));
+  REQUIRE(!parse_cpu_list("1,"));
+  REQUIRE(!parse_cpu_list("1-2,"));
+}
@@ -50,4 +50,68 @@ TEST_CASE("Freelist", "[freelist]") {
 
   free(first_reg);
   free(second_reg);
-}
\ No newline at end of file
+}
+
+TEST_CASE("Freelist contiguous", "[freelist]") {
+  Freelist freelist(4096);
+  void *mem = aligned_alloc(4096 * 16, 4096 * 16);
+
+  auto reg = (Freelist::Region *)(mem);
+  reg->size = 4096 * 16;
+
+  freelist.add_region(reg);
+
+  SECTION("freelist contiguous alloc") {
+    auto first_alloc = freelist.alloc_contiguous(4096 * 4, 4096 * 8);
+    REQUIRE(first_alloc.is_ok() == true);
+    REQUIRE(first_alloc.value().value() == (uintptr_t)mem);
+
+    auto second_alloc = freelist.alloc_contiguous(4096 * 4, 4096 * 8);
+    REQUIRE(second_alloc.is_ok() == true);
+    REQUIRE(second_alloc.value().value() == (uintptr_t)mem + 4096 * 8);
+
+    // Only two 4 pages holes are left, both misaligned
+    auto third_alloc = freelist.alloc_contiguous(4096 * 4, 4096 * 8);
+    REQUIRE(third_alloc.is_err() == true);
+    REQUIRE(third_alloc.error().value() == Error::OUT_OF_MEMORY);
+
+    for (int i = 0; i < 8; i++) {
+      REQUIRE(freelist.alloc().is_ok() == true);
+    }
+
+    REQUIRE(freelist.alloc().is_err() == true);
+  }
+
+  SECTION("freelist remove range") {
+    size_t pieces = 0;
+
+    auto removed = freelist.remove_range((uintptr_t)mem + 4096 * 2, 4096 * 4,
+                                         [&](uintptr_t start, size_t size) {
+                                           REQUIRE(start ==
+                                                   (uintptr_t)mem + 4096 * 2);
+                                           REQUIRE(size == 4096 * 4);
+                                           pieces++;
+                                         });
+
+    REQUIRE(removed == 4096 * 4);
+    REQUIRE(pieces == 1);
+
+    size_t left = 0;
+    freelist.for_each_region([&](uintptr_t start, size_t size) {
+      bool outside = start + size <= (uintptr_t)mem + 4096 * 2 ||
+                     start >= (uintptr_t)mem + 4096 * 6;
+      REQUIRE(outside == true);
+      left += size;
+    });
+
+    REQUIRE(left == 4096 * 12);
+
+    freelist.free_range((uintptr_t)mem + 4096 * 2, 4096 * 4);
+
+    auto alloc = freelist.alloc_contiguous(4096 * 4, 4096 * 2);
+    REQUIRE(alloc.is_ok() == true);
+    REQUIRE(alloc.value().value() == (uintptr_t)mem + 4096 * 2);
+  }
+
+  free(mem);
+}
@@ -0,0 +1,53 @@
+/* @license:bsd2 */
+#include <catch2/catch.hpp>
+#include <lib/rwlock.hpp>
+#include <thread>
+
+using namespace Gaia;
+
+TEST_CASE("RwLock", "[rwlock]") {
+  RwLock lock;
+
+  SECTION("readers share the lock") {
+    REQUIRE(lock.try_read_lock() == true);
+    REQUIRE(lock.try_read_lock() == true);
+    REQUIRE(lock.readers() == 2);
+    REQUIRE(lock.try_write_lock() == false);
+
+    lock.read_unlock();
+    lock.read_unlock();
+
+    REQUIRE(lock.try_write_lock() == true);
+  }
+
+  SECTION("writers are exclusive") {
+    lock.write_lock();
+
+    REQUIRE(lock.is_write_locked() == true);
+    REQUIRE(lock.try_read_lock() == false);
+    REQUIRE(lock.try_write_lock() == false);
+
+    lock.write_unlock();
+
+    REQUIRE(lock.try_read_lock() == true);
+    lock.read_unlock();
+  }
+
+  SECTION("concurrent writers") {
+    int counter = 0;
+
+    auto work = [&]() {
+      for (int i = 0; i < 10000; i++) {
+        lock.write_lock();
+        counter++;
+        lock.write_unlock();
+      }
+    };
+
+    std::thread a(work), b(work);
+    a.join();
+    b.join();
+
+    REQUIRE(counter == 20000);
+  }
+}